@@ -1,337 +1,9369 @@
-/**
-
-@file mp4_scanner.c
-
-@brief Утилита для рекурсивного поиска MP4-файлов в папках и подсчёта их общей длительности.
-
-
-
-Поддерживает кроссплатформенность (Linux/Windows),
-
-может отображать подробную информацию (-v),
-
-извлекает длительность MP4-файлов через парсинг атомов moov/mvhd.
-*/
-
-#include <stdio.h>
-#include <stdlib.h>
-#include <stdint.h>
-#include <string.h>
-#include <dirent.h>
-#include <sys/stat.h>
-#include <unistd.h>
-#include <ctype.h>
-#include <limits.h>
-
-#ifdef _WIN32
-#include <windows.h>
-#define COLOR_YELLOW "\x1b[33m"
-#define COLOR_GREEN "\x1b[32m"
-#define COLOR_RESET "\x1b[0m"
-#define CP_UTF8 65001
-#else
-#define COLOR_YELLOW "\033[33m"
-#define COLOR_GREEN "\033[32m"
-#define COLOR_RESET "\033[0m"
-#endif
-
-/**
- * @struct MP4Duration
- * @brief Структура для хранения длительности MP4-файла.
- */
-typedef struct
-{
-    double duration_seconds; /**< Длительность в секундах */
-    int found;               /**< Флаг, указывающий, была ли найдена длительность */
-} MP4Duration;
-
-/**
-
-@struct Stats
-
-@brief Статистика по найденным MP4-файлам.
-*/
-typedef struct
-{
-    int total_files;               /** < Общее количество MP4 - файлов */
-    int total_folders_with_mp4;    /** < Количество папок с MP4 */
-    double total_duration_seconds; /**< Общая длительность видео */
-} Stats;
-
-/**
-
-@struct Options
-
-@brief Опции командной строки.
-*/
-typedef struct
-{
-    int verbose; /**< Флаг подробного вывода */
-} Options;
-
-/**
-
-@brief Чтение 4 байт в формате big-endian.
-*/
-uint32_t read_u32_be(FILE *file)
-{
-    uint8_t buf[4];
-    if (fread(buf, 1, 4, file) != 4)
-        return 0;
-    return (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
-}
-
-/**
-
-@brief Чтение 8 байт в формате big-endian.
-*/
-uint64_t read_u64_be(FILE *file)
-{
-    uint64_t high = read_u32_be(file);
-    uint64_t low = read_u32_be(file);
-    return (high << 32) | low;
-}
-
-/**
-
-@brief Поиск атома по имени.
-*/
-int find_atom(FILE *file, const char *atom_type, uint64_t *size, uint64_t *start_pos)
-{
-    char box_type[5] = {0};
-    uint32_t box_size;
-
-    while (!feof(file))
-    {
-        box_size = read_u32_be(file);
-        if (fread(box_type, 1, 4, file) != 4)
-            break;
-
-        if (box_size == 1)
-        {
-            box_size = (uint32_t)read_u64_be(file);
-        }
-
-        if (strncmp(box_type, atom_type, 4) == 0)
-        {
-            *size = box_size;
-            *start_pos = ftell(file);
-            return 1;
-        }
-        else
-        {
-            if (fseek(file, box_size - 8, SEEK_CUR) != 0)
-                break;
-        }
-    }
-    return 0;
-}
-
-/**
-
-@brief Получение длительности MP4-файла.
-*/
-MP4Duration get_mp4_duration(const char *filename)
-{
-    FILE *file = fopen(filename, "rb");
-    MP4Duration result = {0, 0};
-    if (!file)
-        return result;
-
-    uint64_t moov_size, moov_pos;
-    if (!find_atom(file, "moov", &moov_size, &moov_pos))
-    {
-        fclose(file);
-        return result;
-    }
-
-    uint64_t mvhd_size, mvhd_pos;
-    if (!find_atom(file, "mvhd", &mvhd_size, &mvhd_pos))
-    {
-        fclose(file);
-        return result;
-    }
-
-    uint8_t version;
-    fread(&version, 1, 1, file);
-    fseek(file, 3, SEEK_CUR); // Пропускаем флаги
-
-    uint32_t timescale;
-    double duration;
-
-    if (version == 1)
-    {
-        fseek(file, 8 + 8, SEEK_CUR);
-        timescale = read_u32_be(file);
-        duration = read_u64_be(file);
-    }
-    else
-    {
-        fseek(file, 4 + 4, SEEK_CUR);
-        timescale = read_u32_be(file);
-        duration = read_u32_be(file);
-    }
-
-    if (timescale > 0)
-    {
-        result.duration_seconds = duration / timescale;
-        result.found = 1;
-    }
-
-    fclose(file);
-    return result;
-}
-
-/**
-
-@brief Форматирует длительность в часы, минуты и секунды.
-*/
-void format_duration(double total_seconds, int *hours, int *minutes, int *seconds)
-{
-    *hours = (int)(total_seconds / 3600);
-    *minutes = (int)((total_seconds - (*hours * 3600)) / 60);
-    *seconds = (int)total_seconds % 60;
-}
-
-/**
-
-@brief Усечение длинных путей для отображения.
-*/
-void truncate_path(const char *input, char *output, size_t max_len)
-{
-    size_t len = strlen(input);
-    if (len <= max_len)
-    {
-        strcpy(output, input);
-        return;
-    }
-
-#ifdef _WIN32
-    size_t head = max_len / 2;
-    size_t tail = max_len / 2;
-    snprintf(output, max_len + 1, "%.*s...%.*s", (int)head, input, (int)tail, input + len - tail);
-#else
-    size_t head = max_len / 2 - 2;
-    size_t tail = max_len / 2 - 2;
-    snprintf(output, max_len + 1, "%.*s...%.*s", (int)head, input, (int)tail, input + len - tail);
-#endif
-}
-
-/**
-
-@brief Рекурсивное сканирование директории.
-*/
-void scan_directory(const char *path, Stats *stats, Options *opts)
-{
-    DIR *dir = opendir(path);
-    struct dirent *entry;
-    struct stat st;
-    int local_mp4_count = 0;
-    double local_duration = 0.0;
-
-    if (!dir)
-        return;
-
-    while ((entry = readdir(dir)) != NULL)
-    {
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
-            continue;
-
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-
-        if (stat(full_path, &st) == -1)
-            continue;
-
-        if (S_ISDIR(st.st_mode))
-        {
-            scan_directory(full_path, stats, opts);
-        }
-        else if (S_ISREG(st.st_mode))
-        {
-            const char *ext = strrchr(entry->d_name, '.');
-            if (ext && strcasecmp(ext, ".mp4") == 0)
-            {
-                MP4Duration d = get_mp4_duration(full_path);
-                if (d.found)
-                {
-                    stats->total_files++;
-                    local_mp4_count++;
-                    local_duration += d.duration_seconds;
-                    stats->total_duration_seconds += d.duration_seconds;
-                }
-            }
-        }
-    }
-
-    if (local_mp4_count > 0)
-    {
-        stats->total_folders_with_mp4++;
-        if (opts->verbose)
-        {
-            int h, m, s;
-            format_duration(local_duration, &h, &m, &s);
-            char time_str[32];
-            snprintf(time_str, sizeof(time_str), "%d:%02d:%02d", h, m, s);
-
-            char truncated[128];
-            truncate_path(path, truncated, 90);
-
-            printf("\xF0\x9F\x9F\xA1 %s " COLOR_GREEN "%s\n" COLOR_RESET, time_str, truncated);
-        }
-    }
-
-    closedir(dir);
-}
-
-/**
-
-@brief Точка входа в программу.
-*/
-int main(int argc, char *argv[])
-{
-#ifdef _WIN32
-    SetConsoleOutputCP(CP_UTF8);
-#endif
-
-    Stats stats = {0, 0, 0.0};
-    Options opts = {0};
-    char path[PATH_MAX] = {0};
-    const char *target_dir = NULL;
-
-    // Обработка аргументов командной строки
-    for (int i = 1; i < argc; ++i)
-    {
-        if (strcmp(argv[i], "-v") == 0)
-        {
-            opts.verbose = 1;
-        }
-        else
-        {
-            target_dir = argv[i];
-        }
-    }
-
-    if (!target_dir)
-    {
-        if (!getcwd(path, sizeof(path)))
-        {
-            perror("getcwd failed");
-            return 1;
-        }
-        target_dir = path;
-    }
-
-    printf("\xF0\x9F\x95\x92 Scanning folder: %s\n", target_dir);
-    scan_directory(target_dir, &stats, &opts);
-
-    int h, m, s;
-    format_duration(stats.total_duration_seconds, &h, &m, &s);
-
-    printf("\n\xF0\x9F\x93\x8A Result:\n");
-    printf("\xF0\x9F\x91\x8C Found " COLOR_YELLOW "%d" COLOR_RESET " MP4 files in " COLOR_YELLOW "%d" COLOR_RESET " folders.\n",
-           stats.total_files, stats.total_folders_with_mp4);
-    printf("\xF0\x9F\x8F\x81 Total duration: " COLOR_YELLOW "%d:%02d:%02d" COLOR_RESET "\n", h, m, s);
-
-    return 0;
-}
+/**
+
+@file mp4_scanner.c
+
+@brief Утилита для рекурсивного поиска MP4-файлов в папках и подсчёта их общей длительности.
+
+
+
+Поддерживает кроссплатформенность (Linux/Windows),
+
+может отображать подробную информацию (-v),
+
+извлекает длительность MP4-файлов через парсинг атомов moov/mvhd.
+*/
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <ftw.h>
+#endif
+#ifndef _WIN32
+#include <regex.h>
+#endif
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#define COLOR_YELLOW "\x1b[33m"
+#define COLOR_GREEN "\x1b[32m"
+#define COLOR_RESET "\x1b[0m"
+#define CP_UTF8 65001
+#else
+#define COLOR_YELLOW "\033[33m"
+#define COLOR_GREEN "\033[32m"
+#define COLOR_RESET "\033[0m"
+#endif
+
+/**
+ * @struct MP4Duration
+ * @brief Структура для хранения длительности MP4-файла.
+ */
+typedef struct
+{
+    double duration_seconds; /**< Длительность в секундах */
+    uint64_t ticks;          /**< Длительность в микросекундах (для точного суммирования) */
+    int found;               /**< Флаг, указывающий, была ли найдена длительность */
+} MP4Duration;
+
+/** Единиц длительности в секунде: суммы хранятся в целых микросекундах. */
+#define TICKS_PER_SECOND 1000000ull
+
+/**
+
+@struct Stats
+
+@brief Статистика по найденным MP4-файлам.
+*/
+typedef struct
+{
+    uint64_t total_files;          /** < Общее количество MP4 - файлов */
+    uint64_t total_folders_with_mp4; /** < Количество папок с MP4 */
+    uint64_t total_ticks;          /**< Общая длительность видео в микросекундах */
+} Stats;
+
+/**
+
+@enum IoBackend
+
+@brief Способ чтения заголовков MP4-файла.
+*/
+typedef enum
+{
+    IO_STDIO, /**< fopen/fread/fseek, как в исходной версии */
+    IO_PREAD, /**< open + pread через окно 4 КиБ, переходы без системных вызовов */
+    IO_MMAP,  /**< mmap всего файла, чтение копированием из отображения */
+    IO_COUNT
+} IoBackend;
+
+static const char *io_backend_names[IO_COUNT] = {"stdio", "pread", "mmap"};
+
+/**
+
+@enum StatxSync
+
+@brief Синхронизация атрибутов с сервером при statx() (--statx-sync).
+*/
+typedef enum
+{
+    STATX_SYNC_AUTO, /**< Без синхронизации только на сетевых ФС */
+    STATX_SYNC_ON,   /**< Поведение по умолчанию, как у stat() */
+    STATX_SYNC_OFF   /**< AT_STATX_DONT_SYNC везде */
+} StatxSync;
+
+/**
+
+@enum RollupMode
+
+@brief Вид подробного вывода с итогами поддеревьев.
+*/
+typedef enum
+{
+    ROLLUP_NONE, /**< Только файлы непосредственно в папке (-v) */
+    ROLLUP_DU,   /**< Итог поддерева и полный путь, дети перед родителем (--du) */
+    ROLLUP_TREE  /**< Итог поддерева с отступом, родитель перед детьми (--tree) */
+} RollupMode;
+
+/**
+
+@enum GroupKind
+
+@brief Признак группировки итогов (--group-by).
+*/
+typedef enum
+{
+    GROUP_NONE,  /**< Без группировки */
+    GROUP_DEPTH, /**< Первые N компонентов пути относительно корня */
+    GROUP_REGEX, /**< Первая группа захвата (или всё совпадение) регулярного выражения */
+    GROUP_UID    /**< Владелец файла */
+} GroupKind;
+
+/**
+
+@struct GroupBy
+
+@brief Разобранный параметр --group-by.
+*/
+typedef struct
+{
+    GroupKind kind;   /**< Признак группировки */
+    int depth;        /**< Глубина для depth:N */
+    const char *spec; /**< Исходная строка параметра */
+#ifndef _WIN32
+    regex_t re;       /**< Скомпилированное выражение для regex: */
+#endif
+} GroupBy;
+
+/**
+
+@struct Options
+
+@brief Опции командной строки.
+*/
+typedef struct
+{
+    int verbose;          /**< Флаг подробного вывода */
+    int walk_bfs;         /**< Обход в ширину вместо обхода в глубину */
+    size_t mem_budget;    /**< Бюджет памяти для списка ожидающих папок, байт */
+    int stats;            /**< Печатать подробную статистику ввода-вывода (--stats) */
+    unsigned progress_ms; /**< Период строки прогресса в stderr, мс (0 — выключено) */
+    IoBackend io_backend; /**< Способ чтения заголовков (--io) */
+    unsigned io_hints;    /**< Подсказки ядру для каждого файла (--io-hints, IO_HINT_*) */
+    int nofollow;         /**< Не открывать MP4 по символическим ссылкам (--nofollow) */
+    StatxSync statx_sync; /**< Синхронизация атрибутов при statx() (--statx-sync) */
+    int jobs;             /**< Потоков разбора MP4 (-j), 1 — без пула */
+    size_t top_n;         /**< Сколько самых длинных файлов показать (--top) */
+    size_t bottom_n;      /**< Сколько самых коротких файлов показать (--bottom) */
+    int histogram;        /**< Поминутная гистограмма длительностей (--histogram) */
+    int sketch;           /**< Квантили длительностей по t-digest (--sketch) */
+    int format_json;      /**< Итог в формате JSON (--format json) */
+    GroupBy group;        /**< Группировка итогов (--group-by) */
+    const char *files_from; /**< Список файлов вместо обхода (--files-from), "-" — stdin */
+    int list_nul;         /**< Пути в списке разделены символом NUL (-0) */
+    int follow_symlinks;  /**< Следовать символическим ссылкам (-L, по умолчанию) или нет (-P) */
+    int dedupe_hardlinks; /**< Учитывать жёсткие ссылки на файл один раз (--dedupe-hardlinks) */
+    int one_file_system;  /**< Не переходить на другие файловые системы (-x) */
+    int device_jobs;      /**< Предел потоков на одно устройство (--device-jobs), 0 — автоматически */
+    int adaptive;         /**< Подбирать предел потоков по задержке и скорости разбора (--adaptive) */
+    double max_iops;      /**< Предел opendir()/stat() в секунду (--max-iops), 0 — без ограничения */
+    double max_opens;     /**< Предел открытий MP4 в секунду (--max-opens) */
+    unsigned long long max_bw; /**< Предел чтения с носителя, байт в секунду (--max-bw) */
+    int idle;             /**< Фоновый приоритет ввода-вывода и процессора (--idle) */
+    const char *checkpoint; /**< Журнал завершённых папок для продолжения (--checkpoint) */
+    int shard_index;      /**< Номер своей части при --shard i/N (с нуля) */
+    int shard_count;      /**< Количество частей N, 0 — без разбиения */
+    int shard_depth;      /**< Глубина разбиения (--shard-depth), 0 — автоматически */
+    const char *partial;  /**< Файл частичного результата (--partial) */
+    int estimate;         /**< Оценить итог по случайной выборке файлов (--estimate) */
+    double estimate_error; /**< Целевая относительная погрешность оценки (доля, не проценты) */
+    unsigned estimate_time_ms; /**< Бюджет времени оценки от начала сканирования, мс (0 — без предела) */
+    int bitrate_model;    /**< Оценивать длительность по размеру файла (--bitrate-model) */
+    double model_tolerance; /**< Допустимое отклонение модели битрейта (доля) */
+    char **match_rules;   /**< Правила --exclude и --include (с !) в синтаксисе .gitignore */
+    size_t nmatch_rules;  /**< Количество правил */
+    int no_scanignore;    /**< Не читать файлы .scanignore (--no-scanignore) */
+    RollupMode rollup;    /**< Итоги поддеревьев вместо -v (--du, --tree) */
+    int max_depth;        /**< Глубина строк подробного вывода (--max-depth), -1 — без ограничения */
+} Options;
+
+/** Подсказка FADV_RANDOM перед разбором: отключает упреждающее чтение. */
+#define IO_HINT_RANDOM 0x1
+/** Подсказка FADV_DONTNEED после разбора: освобождает кэш страниц файла. */
+#define IO_HINT_DONTNEED 0x2
+/** Явный readahead() только диапазона moov. */
+#define IO_HINT_READAHEAD 0x4
+/** Верхняя граница явного readahead() для moov. */
+#define MOOV_READAHEAD_MAX (1024 * 1024)
+
+/** Размер пачки заданий, которой обмениваются координатор и пул. */
+#define POOL_BATCH 32
+/** Сколько заданий в полёте допускается на один поток пула. */
+#define POOL_INFLIGHT_PER_THREAD 256
+/** Предел потоков на вращающийся диск: больше только добавляет поиск головок. */
+#define ROTATIONAL_DEVICE_JOBS 2
+/** Потоков пула при --adaptive без явного -j: верхняя граница подбора. */
+#define ADAPTIVE_MAX_JOBS 64
+/** Начальный предел потоков на устройство при --adaptive. */
+#define ADAPTIVE_START_JOBS 2
+/** Длительность окна измерений регулятора, нс. */
+#define ADAPTIVE_WINDOW_NS 100000000ull
+/** Рост задержки относительно лучшей, после которого устройство считается перегруженным. */
+#define ADAPTIVE_LATENCY_SLACK 2.0
+/** Сколько изменений предела хранится для --stats. */
+#define ADAPTIVE_TIMELINE_MAX 256
+
+/** Бюджет памяти списка ожидающих папок по умолчанию (МиБ). */
+#define DEFAULT_MEM_BUDGET_MB 64
+
+/** Размер блока, которым список ожидающих папок сбрасывается на диск. */
+#define SPILL_CHUNK_SIZE (64 * 1024)
+
+/** Количество поддиапазонов на одну степень двойки в гистограмме задержек. */
+#define HIST_SUB_BITS 3
+/** Количество корзин гистограммы: 64 степени двойки по 2^HIST_SUB_BITS. */
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+/**
+
+@enum Phase
+
+@brief Фазы работы, для которых собираются время и задержки.
+*/
+typedef enum
+{
+    PH_DIR_OPEN,  /**< opendir() */
+    PH_READDIR,   /**< readdir() */
+    PH_STAT,      /**< stat() */
+    PH_FILE_OPEN, /**< Открытие MP4-файла */
+    PH_READ,      /**< Чтение заголовков */
+    PH_SEEK,      /**< Переходы между атомами */
+    PH_CLOSE,     /**< Закрытие файла */
+    PH_COUNT
+} Phase;
+
+static const char *phase_names[PH_COUNT] = {
+    "opendir", "readdir", "stat", "open", "read", "seek", "close"};
+
+/**
+
+@struct Histogram
+
+@brief Логарифмическая гистограмма задержек в наносекундах (в стиле HDR).
+
+Значение попадает в корзину по старшему биту и следующим за ним
+HIST_SUB_BITS битам, что даёт относительную погрешность около 12%
+при фиксированном объёме памяти. Гистограммы складываются поэлементно.
+*/
+typedef struct
+{
+    uint64_t buckets[HIST_BUCKETS]; /**< Счётчики корзин */
+    uint64_t count;                 /**< Количество значений */
+    uint64_t max;                   /**< Максимальное значение */
+} Histogram;
+
+/**
+
+@struct ThreadStats
+
+@brief Счётчики одного потока.
+
+Каждый поток пишет только в свою структуру, поэтому счётчики не
+требуют синхронизации; итог получается сложением всех структур.
+*/
+typedef struct ThreadStats
+{
+    struct ThreadStats *next;   /**< Следующая структура в реестре */
+    uint64_t ops[PH_COUNT];     /**< Количество операций по фазам */
+    uint64_t wall_ns[PH_COUNT]; /**< Реальное время по фазам */
+    uint64_t cpu_ns[PH_COUNT];  /**< Процессорное время по фазам */
+    Histogram lat[PH_COUNT];    /**< Задержки по фазам */
+    uint64_t entries;           /**< Прочитано записей каталогов */
+    uint64_t files_probed;      /**< Открыто MP4-файлов */
+    uint64_t bytes_read;        /**< Прочитано байт заголовков */
+    uint64_t bytes_storage;     /**< Байт, прочитанных с носителя по учёту --max-bw */
+    uint64_t box_hops;          /**< Просмотрено атомов */
+    uint64_t opens_noatime;     /**< Открыто с O_NOATIME */
+    uint64_t opens_fallback;    /**< Открыто без O_NOATIME после EPERM */
+    uint64_t opens_plain;       /**< Открыто без попытки O_NOATIME */
+    uint64_t opens_symlink_refused; /**< Отклонено O_NOFOLLOW (символическая ссылка) */
+    uint64_t stats_dont_sync;   /**< statx() с AT_STATX_DONT_SYNC */
+    uint64_t throttle_waits;    /**< Ожиданий из-за ограничений скорости */
+    uint64_t throttle_ns;       /**< Суммарное время этих ожиданий */
+} ThreadStats;
+
+/**
+
+@struct OpTimer
+
+@brief Отметка начала операции.
+*/
+typedef struct
+{
+    uint64_t wall; /**< Монотонное время начала */
+    uint64_t cpu;  /**< Процессорное время потока в начале */
+} OpTimer;
+
+/** Включён ли сбор времени и задержек (--stats). */
+static int g_timing_enabled = 0;
+/** Реестр счётчиков всех потоков. */
+static ThreadStats *g_thread_stats = NULL;
+/** Защищает добавление в реестр счётчиков. */
+static pthread_mutex_t g_thread_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+/** Счётчики текущего потока. */
+static _Thread_local ThreadStats *tls_stats = NULL;
+
+/**
+
+@brief Монотонное время в наносекундах.
+*/
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, counter;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+
+@brief Процессорное время текущего потока в наносекундах.
+*/
+static uint64_t thread_cpu_ns(void)
+{
+#if defined(_WIN32) || !defined(CLOCK_THREAD_CPUTIME_ID)
+    return 0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/**
+
+@brief Счётчики текущего потока (создаются при первом обращении).
+*/
+static ThreadStats *thread_stats(void)
+{
+    static ThreadStats fallback;
+
+    if (!tls_stats)
+    {
+        ThreadStats *ts = calloc(1, sizeof(*ts));
+        if (!ts)
+            return &fallback;
+        pthread_mutex_lock(&g_thread_stats_lock);
+        ts->next = g_thread_stats;
+        g_thread_stats = ts;
+        pthread_mutex_unlock(&g_thread_stats_lock);
+        tls_stats = ts;
+    }
+    return tls_stats;
+}
+
+/**
+
+@struct RateLimit
+
+@brief Ограничитель скорости по алгоритму GCRA (виртуальное расписание).
+
+Вместо счётчика жетонов хранится одно число — теоретическое время
+прибытия tat следующей операции. Операция стоимостью cost сдвигает его
+на cost * interval одним compare-and-swap, без блокировок, и ждёт, если
+опережает расписание больше чем на burst_ns. Так потоки делят один
+предел, а операции идут ровно, без пачек в начале каждой секунды.
+*/
+typedef struct
+{
+    _Atomic uint64_t tat; /**< Теоретическое время следующей операции, нс */
+    double ns_per_unit;   /**< Интервал на единицу стоимости, нс (0 — без ограничения) */
+    uint64_t burst_ns;    /**< Допустимое опережение расписания, нс */
+} RateLimit;
+
+/** Допустимый всплеск сверх предела, нс работы по расписанию. */
+#define RATE_BURST_NS 10000000ull
+
+/** Метаданные: opendir() и stat() в секунду (--max-iops). */
+static RateLimit g_limit_meta;
+/** Открытия MP4-файлов в секунду (--max-opens). */
+static RateLimit g_limit_opens;
+/** Байты, прочитанные с носителя, в секунду (--max-bw). */
+static RateLimit g_limit_bytes;
+
+/**
+
+@brief Задаёт предел rate единиц в секунду (0 — без ограничения).
+*/
+static void rate_limit_init(RateLimit *rl, double rate)
+{
+    rl->ns_per_unit = rate > 0.0 ? 1e9 / rate : 0.0;
+    rl->burst_ns = RATE_BURST_NS;
+    atomic_store(&rl->tat, 0);
+}
+
+/**
+
+@brief Занимает cost единиц предела, при необходимости засыпая до своей очереди.
+*/
+static void rate_limit_acquire(RateLimit *rl, uint64_t cost)
+{
+    if (rl->ns_per_unit == 0.0)
+        return;
+    uint64_t step = (uint64_t)((double)cost * rl->ns_per_unit);
+    uint64_t now = now_ns();
+    uint64_t tat = atomic_load_explicit(&rl->tat, memory_order_relaxed);
+    uint64_t start;
+    do
+        start = tat > now ? tat : now;
+    while (!atomic_compare_exchange_weak_explicit(&rl->tat, &tat, start + step, memory_order_relaxed,
+                                                  memory_order_relaxed));
+    if (start <= now + rl->burst_ns)
+        return;
+
+    uint64_t wait = start - rl->burst_ns - now;
+    ThreadStats *ts = thread_stats();
+    ts->throttle_waits++;
+    ts->throttle_ns += wait;
+#ifdef _WIN32
+    Sleep((DWORD)(wait / 1000000));
+#else
+    struct timespec delay = {(time_t)(wait / 1000000000ull), (long)(wait % 1000000000ull)};
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        ;
+#endif
+}
+
+/**
+
+@brief Настраивает общие ограничители скорости по опциям.
+*/
+static void rate_limits_apply(const Options *opts)
+{
+    rate_limit_init(&g_limit_meta, opts->max_iops);
+    rate_limit_init(&g_limit_opens, opts->max_opens);
+    rate_limit_init(&g_limit_bytes, (double)opts->max_bw);
+}
+
+/** Класс приоритета ввода-вывода IDLE для ioprio_set() (IOPRIO_PRIO_VALUE(3, 0)). */
+#define IOPRIO_IDLE_VALUE (3 << 13)
+/** ioprio_set() для отдельного потока: IOPRIO_WHO_PROCESS с его tid. */
+#define IOPRIO_WHO_THREAD 1
+
+/**
+
+@brief Переводит текущий поток в фоновый режим (--idle).
+
+Класс ввода-вывода IDLE: планировщик диска (BFQ, CFQ) обслуживает
+запросы потока, только когда у устройства нет других. SCHED_IDLE: поток
+получает процессор, только когда больше некому. Приоритеты задаются
+каждому потоку отдельно, поэтому координатор может остаться отзывчивым.
+
+@param cpu Понизить и приоритет процессора.
+*/
+static void enter_idle_priority(int cpu)
+{
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_THREAD, (int)syscall(SYS_gettid), IOPRIO_IDLE_VALUE) != 0)
+        perror("ioprio_set(IDLE) failed");
+#endif
+#if defined(__linux__) && defined(SCHED_IDLE)
+    if (cpu)
+    {
+        struct sched_param param = {0};
+        int rc = pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+        if (rc != 0)
+            fprintf(stderr, "SCHED_IDLE failed: %s\n", strerror(rc));
+    }
+#else
+    (void)cpu;
+#endif
+}
+
+/**
+
+@brief Номер корзины гистограммы для значения.
+*/
+static unsigned hist_bucket_bits(uint64_t v, unsigned bits)
+{
+    if (v < (1u << bits))
+        return (unsigned)v;
+    unsigned msb = 63 - (unsigned)__builtin_clzll(v);
+    unsigned sub = (unsigned)(v >> (msb - bits)) & ((1u << bits) - 1);
+    return ((msb - bits + 1) << bits) + sub;
+}
+
+static unsigned hist_bucket(uint64_t v)
+{
+    return hist_bucket_bits(v, HIST_SUB_BITS);
+}
+
+/**
+
+@brief Нижняя граница значений корзины.
+*/
+static uint64_t hist_bucket_value_bits(unsigned b, unsigned bits)
+{
+    if (b < (1u << bits))
+        return b;
+    unsigned msb = (b >> bits) + bits - 1;
+    uint64_t sub = b & ((1u << bits) - 1);
+    return ((uint64_t)1 << msb) | (sub << (msb - bits));
+}
+
+static uint64_t hist_bucket_value(unsigned b)
+{
+    return hist_bucket_value_bits(b, HIST_SUB_BITS);
+}
+
+/**
+
+@brief Добавляет значение в гистограмму.
+*/
+static void hist_record(Histogram *h, uint64_t v)
+{
+    h->buckets[hist_bucket(v)]++;
+    h->count++;
+    if (v > h->max)
+        h->max = v;
+}
+
+/**
+
+@brief Прибавляет одну гистограмму к другой.
+*/
+static void hist_merge(Histogram *dst, const Histogram *src)
+{
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+/**
+
+@brief Значение заданного перцентиля (0..100).
+*/
+static uint64_t hist_percentile(const Histogram *h, double pct)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+            return hist_bucket_value(i) < h->max ? hist_bucket_value(i) : h->max;
+    }
+    return h->max;
+}
+
+/**
+
+@brief Запоминает начало операции (только при включённом --stats).
+*/
+static inline void op_begin(OpTimer *t)
+{
+    if (g_timing_enabled)
+    {
+        t->wall = now_ns();
+        t->cpu = thread_cpu_ns();
+    }
+    else
+    {
+        t->wall = t->cpu = 0;
+    }
+}
+
+/**
+
+@brief Учитывает завершённую операцию фазы.
+*/
+static inline void op_end(Phase phase, const OpTimer *t)
+{
+    ThreadStats *ts = thread_stats();
+    ts->ops[phase]++;
+    if (g_timing_enabled)
+    {
+        uint64_t wall = now_ns() - t->wall;
+        ts->wall_ns[phase] += wall;
+        ts->cpu_ns[phase] += thread_cpu_ns() - t->cpu;
+        hist_record(&ts->lat[phase], wall);
+    }
+}
+
+/**
+
+@brief Сумма счётчиков всех потоков.
+*/
+static void collect_thread_stats(ThreadStats *total)
+{
+    memset(total, 0, sizeof(*total));
+    // Счётчики работающих потоков читаются без синхронизации: для строки
+    // прогресса достаточно приблизительного снимка, а итоговый отчёт
+    // собирается после остановки пула.
+    pthread_mutex_lock(&g_thread_stats_lock);
+    ThreadStats *head = g_thread_stats;
+    pthread_mutex_unlock(&g_thread_stats_lock);
+    for (ThreadStats *ts = head; ts; ts = ts->next)
+    {
+        for (int p = 0; p < PH_COUNT; p++)
+        {
+            total->ops[p] += ts->ops[p];
+            total->wall_ns[p] += ts->wall_ns[p];
+            total->cpu_ns[p] += ts->cpu_ns[p];
+            hist_merge(&total->lat[p], &ts->lat[p]);
+        }
+        total->entries += ts->entries;
+        total->files_probed += ts->files_probed;
+        total->bytes_read += ts->bytes_read;
+        total->bytes_storage += ts->bytes_storage;
+        total->box_hops += ts->box_hops;
+        total->opens_noatime += ts->opens_noatime;
+        total->opens_fallback += ts->opens_fallback;
+        total->opens_plain += ts->opens_plain;
+        total->opens_symlink_refused += ts->opens_symlink_refused;
+        total->stats_dont_sync += ts->stats_dont_sync;
+        total->throttle_waits += ts->throttle_waits;
+        total->throttle_ns += ts->throttle_ns;
+    }
+}
+
+/** Размер окна чтения бэкенда pread. */
+#define PROBE_WINDOW 4096
+
+/**
+
+@struct Probe
+
+@brief Открытый для разбора MP4-файл.
+
+Бэкенды различаются только способом доставки байтов; разбор атомов
+в find_atom() и get_mp4_duration() от бэкенда не зависит.
+*/
+typedef struct
+{
+    IoBackend backend;            /**< Используемый бэкенд */
+    unsigned hints;               /**< Подсказки ядру (IO_HINT_*) */
+    FILE *file;                   /**< Поток (stdio) */
+    int fd;                       /**< Дескриптор (pread, mmap) */
+    uint64_t pos;                 /**< Текущая позиция */
+    uint64_t block;               /**< Единица чтения с носителя: буфер stdio, страница (--max-bw) */
+    uint64_t charged_off;         /**< Начало блока, оплаченного последним (--max-bw) */
+    uint64_t charged_end;         /**< Его конец (0 — ничего не оплачено) */
+    uint64_t size;                /**< Размер файла (mmap) */
+    const uint8_t *map;           /**< Отображение файла (mmap) */
+    int eof;                      /**< Достигнут конец файла */
+    uint64_t win_off;             /**< Смещение окна чтения (pread) */
+    size_t win_len;               /**< Заполненность окна чтения (pread) */
+    uint8_t window[PROBE_WINDOW]; /**< Окно чтения (pread) */
+} Probe;
+
+#ifndef _WIN32
+/** Сколько отказов O_NOATIME подряд на одной файловой системе отключают попытки на ней. */
+#define NOATIME_GIVE_UP 64
+/** Ячеек таблицы отказов O_NOATIME (файловых систем, учитываемых по отдельности). */
+#define NOATIME_FS_SLOTS 64
+
+/**
+
+@struct NoatimeFs
+
+@brief Отказы O_NOATIME на одной файловой системе, общие для всех потоков.
+*/
+typedef struct
+{
+    _Atomic uint64_t key; /**< Устройство + 1 (0 — свободная ячейка) */
+    _Atomic int denied;   /**< Отказов подряд; NOATIME_GIVE_UP — попытки прекращены */
+} NoatimeFs;
+
+static NoatimeFs g_noatime_fs[NOATIME_FS_SLOTS];
+
+/**
+
+@brief Счётчик отказов O_NOATIME для устройства или NULL, если таблица заполнена.
+*/
+static _Atomic int *noatime_denied(uint64_t dev)
+{
+    uint64_t key = dev + 1;
+    size_t start = (size_t)((key * 0x9E3779B97F4A7C15ull) >> 58);
+    for (size_t i = 0; i < NOATIME_FS_SLOTS; i++)
+    {
+        NoatimeFs *fs = &g_noatime_fs[(start + i) % NOATIME_FS_SLOTS];
+        uint64_t cur = atomic_load_explicit(&fs->key, memory_order_acquire);
+        if (cur == 0 && atomic_compare_exchange_strong(&fs->key, &cur, key))
+            return &fs->denied;
+        if (cur == key)
+            return &fs->denied;
+    }
+    return NULL;
+}
+
+/**
+
+@brief Открытие файла только на чтение без побочных эффектов.
+
+Файл открывается с O_NOATIME, чтобы чтение заголовков не превращалось
+в запись atime на томах без noatime/relatime, и с O_CLOEXEC. Ядро
+разрешает O_NOATIME только владельцу файла (или с CAP_FOWNER), поэтому
+при EPERM этот файл открывается повторно без флага. Отказы считаются
+по файловой системе: после серии отказов подряд на ней O_NOATIME больше
+не пробуется, чтобы не удваивать число системных вызовов на чужих
+архивах, а другие тома и потоки продолжают его использовать.
+
+@param dev Устройство файла (0 — неизвестно; такие файлы учитываются вместе).
+*/
+static int open_readonly(const char *filename, uint64_t dev, const Options *opts)
+{
+    ThreadStats *ts = thread_stats();
+    int flags = O_RDONLY;
+    int fd;
+
+#ifdef O_CLOEXEC
+    flags |= O_CLOEXEC;
+#endif
+#ifdef O_NOFOLLOW
+    if (opts->nofollow)
+        flags |= O_NOFOLLOW;
+#else
+    (void)opts;
+#endif
+
+#ifdef O_NOATIME
+    _Atomic int *denied = noatime_denied(dev);
+    if (!denied || atomic_load_explicit(denied, memory_order_relaxed) < NOATIME_GIVE_UP)
+    {
+        fd = open(filename, flags | O_NOATIME);
+        if (fd >= 0)
+        {
+            if (denied && atomic_load_explicit(denied, memory_order_relaxed) < NOATIME_GIVE_UP)
+                atomic_store_explicit(denied, 0, memory_order_relaxed);
+            ts->opens_noatime++;
+            return fd;
+        }
+        if (errno != EPERM)
+        {
+            if (errno == ELOOP)
+                ts->opens_symlink_refused++;
+            return -1;
+        }
+        if (denied)
+            atomic_fetch_add_explicit(denied, 1, memory_order_relaxed);
+        fd = open(filename, flags);
+        if (fd >= 0)
+            ts->opens_fallback++;
+        return fd;
+    }
+#endif
+
+    fd = open(filename, flags);
+    if (fd >= 0)
+        ts->opens_plain++;
+    else if (errno == ELOOP)
+        ts->opens_symlink_refused++;
+    return fd;
+}
+#endif
+
+/** Открытые программой дескрипторы: папки обхода, MP4-файлы в потоках пула. */
+static _Atomic int g_open_handles;
+/** Их максимум одновременно. */
+static _Atomic int g_peak_handles;
+
+/**
+
+@brief Учёт открытия или закрытия дескриптора (из любого потока).
+*/
+static void track_handle(int delta)
+{
+    int open = atomic_fetch_add_explicit(&g_open_handles, delta, memory_order_relaxed) + delta;
+    int peak = atomic_load_explicit(&g_peak_handles, memory_order_relaxed);
+    while (open > peak && !atomic_compare_exchange_weak_explicit(&g_peak_handles, &peak, open, memory_order_relaxed,
+                                                                 memory_order_relaxed))
+        ;
+}
+
+/**
+
+@brief Дескриптор открытого MP4-файла (для подсказок ядру).
+*/
+static int probe_fd(const Probe *probe)
+{
+    return probe->file ? fileno(probe->file) : probe->fd;
+}
+
+/**
+
+@brief Оплачивает у --max-bw байты носителя, которые прочитает ядро.
+
+@param cost Размер системного вызова чтения или подгружаемого диапазона.
+*/
+static void probe_charge_bytes(uint64_t cost)
+{
+    thread_stats()->bytes_storage += cost;
+    rate_limit_acquire(&g_limit_bytes, cost);
+}
+
+/**
+
+@brief Оплачивает у --max-bw блоки, которые затронет чтение [off, off + size).
+
+Буфер stdio и страницы отображения заполняются с носителя целыми
+блоками, выровненными по их размеру, поэтому оплачиваются блоки, а не
+запрошенные байты. Последний оплаченный блок остаётся в буфере, и
+чтения и переходы внутри него носитель не трогают.
+*/
+static void probe_charge(Probe *probe, uint64_t off, size_t size)
+{
+    if (g_limit_bytes.ns_per_unit == 0.0 || size == 0)
+        return;
+    uint64_t first = off & ~(probe->block - 1);
+    uint64_t end = (off + size + probe->block - 1) & ~(probe->block - 1);
+    if (first >= probe->charged_off && end <= probe->charged_end)
+        return;
+    if (first == probe->charged_off && probe->charged_end > first)
+        first = probe->charged_end;
+    probe->charged_off = end - probe->block;
+    probe->charged_end = end;
+    probe_charge_bytes(end - first);
+}
+
+/**
+
+@brief Открытие MP4-файла выбранным бэкендом с учётом статистики.
+
+@return 1 при успехе, 0 при ошибке.
+*/
+static int probe_open(Probe *probe, const char *filename, uint64_t dev, const Options *opts)
+{
+    OpTimer t;
+    int ok = 0;
+    IoBackend backend = opts->io_backend;
+
+    memset(probe, 0, offsetof(Probe, window));
+    probe->backend = backend;
+    probe->hints = opts->io_hints;
+    probe->fd = -1;
+    probe->block = PROBE_WINDOW;
+
+    rate_limit_acquire(&g_limit_opens, 1);
+    op_begin(&t);
+#ifndef _WIN32
+    probe->fd = open_readonly(filename, dev, opts);
+    ok = probe->fd >= 0;
+    if (ok && backend == IO_STDIO)
+    {
+        probe->file = fdopen(probe->fd, "rb");
+        if (!probe->file)
+        {
+            close(probe->fd);
+            ok = 0;
+        }
+        probe->fd = -1;
+    }
+    else if (ok)
+    {
+        if (backend == IO_MMAP)
+        {
+            struct stat st;
+            void *map = MAP_FAILED;
+            if (fstat(probe->fd, &st) == 0 && st.st_size > 0)
+                map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, probe->fd, 0);
+            if (map == MAP_FAILED)
+            {
+                close(probe->fd);
+                ok = 0;
+            }
+            else
+            {
+                madvise(map, (size_t)st.st_size, MADV_RANDOM);
+                probe->map = map;
+                probe->size = (uint64_t)st.st_size;
+                probe->block = (uint64_t)sysconf(_SC_PAGESIZE);
+            }
+        }
+    }
+#else
+    (void)dev;
+    probe->file = fopen(filename, "rb");
+    ok = probe->file != NULL;
+#endif
+    op_end(PH_FILE_OPEN, &t);
+
+    // Размер буфера stdio по умолчанию равен st_blksize и на сетевых
+    // томах доходит до мегабайт: с --max-bw он фиксирован, чтобы
+    // оплачивать каждое его заполнение. Поток после fdopen() не знает
+    // своей позиции и при первом переходе перечитал бы буфер заново;
+    // fseeko() к началу задаёт её без чтения
+    if (ok && probe->file && g_limit_bytes.ns_per_unit != 0.0)
+    {
+        setvbuf(probe->file, NULL, _IOFBF, PROBE_WINDOW);
+        fseeko(probe->file, 0, SEEK_SET);
+    }
+
+    if (ok)
+    {
+        track_handle(1);
+        thread_stats()->files_probed++;
+#ifdef POSIX_FADV_RANDOM
+        if (probe->hints & IO_HINT_RANDOM)
+            posix_fadvise(probe_fd(probe), 0, 0, POSIX_FADV_RANDOM);
+#endif
+    }
+    return ok;
+}
+
+/**
+
+@brief Явно подгружает диапазон атома moov (IO_HINT_READAHEAD).
+
+Вместе с FADV_RANDOM это заменяет упреждающее чтение ядра, которое
+захватывает и ненужный mdat, одним запросом ровно на moov.
+*/
+static void probe_readahead(Probe *probe, uint64_t offset, uint64_t size)
+{
+#ifdef __linux__
+    if (!(probe->hints & IO_HINT_READAHEAD))
+        return;
+    if (size == 0 || size > MOOV_READAHEAD_MAX)
+        size = MOOV_READAHEAD_MAX;
+    if (g_limit_bytes.ns_per_unit != 0.0)
+        probe_charge_bytes(size);
+    readahead(probe_fd(probe), (off64_t)offset, (size_t)size);
+#else
+    (void)probe;
+    (void)offset;
+    (void)size;
+#endif
+}
+
+#ifndef _WIN32
+/**
+
+@brief Чтение через окно бэкенда pread.
+*/
+static size_t probe_pread(Probe *probe, uint8_t *buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        if (probe->pos < probe->win_off || probe->pos >= probe->win_off + probe->win_len)
+        {
+            if (g_limit_bytes.ns_per_unit != 0.0)
+                probe_charge_bytes(PROBE_WINDOW);
+            ssize_t n = pread(probe->fd, probe->window, PROBE_WINDOW, (off_t)probe->pos);
+            if (n <= 0)
+            {
+                probe->eof = 1;
+                break;
+            }
+            probe->win_off = probe->pos;
+            probe->win_len = (size_t)n;
+        }
+        size_t off = (size_t)(probe->pos - probe->win_off);
+        size_t chunk = probe->win_len - off;
+        if (chunk > size - done)
+            chunk = size - done;
+        memcpy(buf + done, probe->window + off, chunk);
+        done += chunk;
+        probe->pos += chunk;
+    }
+    return done;
+}
+#endif
+
+/**
+
+@brief Чтение из MP4-файла с учётом статистики.
+*/
+static size_t probe_read(Probe *probe, void *buf, size_t size)
+{
+    OpTimer t;
+    size_t n = 0;
+
+    op_begin(&t);
+    switch (probe->backend)
+    {
+#ifndef _WIN32
+    case IO_PREAD:
+        n = probe_pread(probe, buf, size);
+        break;
+    case IO_MMAP:
+        if (probe->pos < probe->size)
+        {
+            n = probe->size - probe->pos < size ? (size_t)(probe->size - probe->pos) : size;
+            probe_charge(probe, probe->pos, n);
+            memcpy(buf, probe->map + probe->pos, n);
+            probe->pos += n;
+        }
+        if (n < size)
+            probe->eof = 1;
+        break;
+#endif
+    default:
+        probe_charge(probe, probe->pos, size);
+        n = fread(buf, 1, size, probe->file);
+        probe->eof = feof(probe->file);
+        probe->pos += n;
+        break;
+    }
+    op_end(PH_READ, &t);
+    thread_stats()->bytes_read += n;
+    return n;
+}
+
+/**
+
+@brief Переход по MP4-файлу с учётом статистики.
+*/
+static int probe_seek(Probe *probe, long long offset, int whence)
+{
+    OpTimer t;
+    int rc = 0;
+
+    op_begin(&t);
+    if (probe->backend == IO_STDIO)
+    {
+        rc = fseeko(probe->file, (off_t)offset, whence);
+        if (rc == 0)
+            probe->pos = whence == SEEK_CUR ? probe->pos + (uint64_t)offset : (uint64_t)offset;
+    }
+    else
+    {
+        // Позиция хранится в памяти: переход не требует системного вызова
+        long long base = whence == SEEK_CUR ? (long long)probe->pos : 0;
+        if (base + offset < 0)
+            rc = -1;
+        else
+            probe->pos = (uint64_t)(base + offset);
+        probe->eof = 0;
+    }
+    op_end(PH_SEEK, &t);
+    return rc;
+}
+
+/**
+
+@brief Текущая позиция в MP4-файле.
+*/
+static uint64_t probe_tell(Probe *probe)
+{
+    if (probe->backend == IO_STDIO)
+        return (uint64_t)ftello(probe->file);
+    return probe->pos;
+}
+
+/**
+
+@brief Закрытие MP4-файла с учётом статистики.
+*/
+static void probe_close(Probe *probe)
+{
+    OpTimer t;
+#ifdef POSIX_FADV_DONTNEED
+    if (probe->hints & IO_HINT_DONTNEED)
+        posix_fadvise(probe_fd(probe), 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    op_begin(&t);
+#ifndef _WIN32
+    if (probe->map)
+        munmap((void *)probe->map, (size_t)probe->size);
+    if (probe->fd >= 0)
+        close(probe->fd);
+#endif
+    if (probe->file)
+        fclose(probe->file);
+    op_end(PH_CLOSE, &t);
+    track_handle(-1);
+}
+
+/**
+
+@brief Чтение 4 байт в формате big-endian.
+*/
+uint32_t read_u32_be(Probe *probe)
+{
+    uint8_t buf[4];
+    if (probe_read(probe, buf, 4) != 4)
+        return 0;
+    return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+/**
+
+@brief Чтение 8 байт в формате big-endian.
+*/
+uint64_t read_u64_be(Probe *probe)
+{
+    uint64_t high = read_u32_be(probe);
+    uint64_t low = read_u32_be(probe);
+    return (high << 32) | low;
+}
+
+/**
+
+@brief Поиск атома по имени.
+*/
+int find_atom(Probe *probe, const char *atom_type, uint64_t *size, uint64_t *start_pos)
+{
+    char box_type[5] = {0};
+    uint64_t box_size;
+    uint64_t header;
+
+    while (!probe->eof)
+    {
+        box_size = read_u32_be(probe);
+        if (probe_read(probe, box_type, 4) != 4)
+            break;
+        thread_stats()->box_hops++;
+
+        header = 8;
+        if (box_size == 1)
+        {
+            box_size = read_u64_be(probe); // 64-битный largesize
+            header = 16;
+        }
+
+        if (strncmp(box_type, atom_type, 4) == 0)
+        {
+            *size = box_size;
+            *start_pos = probe_tell(probe);
+            return 1;
+        }
+
+        // Размер 0 означает атом до конца файла; размер меньше заголовка
+        // или за пределами off_t — повреждённый файл. Дальше искать негде.
+        if (box_size < header || box_size - header > (uint64_t)LLONG_MAX)
+            break;
+        if (probe_seek(probe, (long long)(box_size - header), SEEK_CUR) != 0)
+            break;
+    }
+    return 0;
+}
+
+/**
+
+@brief Перевод длительности из единиц timescale в микросекунды.
+
+Целые микросекунды складываются без потери точности в любом порядке,
+поэтому итог не зависит от того, в каком порядке потоки разобрали файлы.
+*/
+static uint64_t duration_to_ticks(uint64_t duration, uint32_t timescale)
+{
+    uint64_t whole = duration / timescale;
+    uint64_t frac = duration % timescale;
+    return whole * TICKS_PER_SECOND + (frac * TICKS_PER_SECOND + timescale / 2) / timescale;
+}
+
+/**
+
+@brief Получение длительности MP4-файла.
+
+@param dev Устройство файла для учёта отказов O_NOATIME (0 — неизвестно).
+*/
+MP4Duration get_mp4_duration(const char *filename, uint64_t dev, const Options *opts)
+{
+    Probe probe;
+    MP4Duration result = {0, 0, 0};
+    if (!probe_open(&probe, filename, dev, opts))
+        return result;
+
+    uint64_t moov_size, moov_pos;
+    if (!find_atom(&probe, "moov", &moov_size, &moov_pos))
+    {
+        probe_close(&probe);
+        return result;
+    }
+
+    probe_readahead(&probe, moov_pos, moov_size);
+
+    uint64_t mvhd_size, mvhd_pos;
+    if (!find_atom(&probe, "mvhd", &mvhd_size, &mvhd_pos))
+    {
+        probe_close(&probe);
+        return result;
+    }
+
+    uint8_t version;
+    probe_read(&probe, &version, 1);
+    probe_seek(&probe, 3, SEEK_CUR); // Пропускаем флаги
+
+    uint32_t timescale;
+    uint64_t duration;
+
+    if (version == 1)
+    {
+        probe_seek(&probe, 8 + 8, SEEK_CUR);
+        timescale = read_u32_be(&probe);
+        duration = read_u64_be(&probe);
+    }
+    else
+    {
+        probe_seek(&probe, 4 + 4, SEEK_CUR);
+        timescale = read_u32_be(&probe);
+        duration = read_u32_be(&probe);
+    }
+
+    if (timescale > 0)
+    {
+        result.duration_seconds = (double)duration / timescale;
+        result.ticks = duration_to_ticks(duration, timescale);
+        result.found = 1;
+    }
+
+    probe_close(&probe);
+    return result;
+}
+
+/**
+
+@brief Форматирует длительность в часы, минуты и секунды.
+*/
+void format_duration(double total_seconds, int *hours, int *minutes, int *seconds)
+{
+    *hours = (int)(total_seconds / 3600);
+    *minutes = (int)((total_seconds - (*hours * 3600)) / 60);
+    *seconds = (int)total_seconds % 60;
+}
+
+/**
+
+@brief Печать строки в формате JSON (в кавычках, с экранированием).
+*/
+static void json_print_string(FILE *out, const char *text)
+{
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            fprintf(out, "\\%c", *p);
+        else if (*p < 0x20)
+            fprintf(out, "\\u%04x", *p);
+        else
+            fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+/**
+
+@brief Длительность в микросекундах как «Ч:ММ:СС.мс».
+*/
+static void format_ticks(uint64_t ticks, char *buf, size_t size)
+{
+    uint64_t secs = ticks / TICKS_PER_SECOND;
+    unsigned ms = (unsigned)(ticks % TICKS_PER_SECOND / 1000);
+    snprintf(buf, size, "%llu:%02llu:%02llu.%03u", (unsigned long long)(secs / 3600),
+             (unsigned long long)(secs / 60 % 60), (unsigned long long)(secs % 60), ms);
+}
+
+/**
+
+@brief Усечение длинных путей для отображения.
+*/
+void truncate_path(const char *input, char *output, size_t max_len)
+{
+    size_t len = strlen(input);
+    if (len <= max_len)
+    {
+        strcpy(output, input);
+        return;
+    }
+
+#ifdef _WIN32
+    size_t head = max_len / 2;
+    size_t tail = max_len / 2;
+    snprintf(output, max_len + 1, "%.*s...%.*s", (int)head, input, (int)tail, input + len - tail);
+#else
+    size_t head = max_len / 2 - 2;
+    size_t tail = max_len / 2 - 2;
+    snprintf(output, max_len + 1, "%.*s...%.*s", (int)head, input, (int)tail, input + len - tail);
+#endif
+}
+
+/**
+
+@struct DirNode
+
+@brief Папка в процессе обхода.
+
+Папка «закрывается», когда прочитана и закрыты все её подпапки; в этот
+момент ей присваивается порядковый номер строки подробного вывода —
+тот же, что и при последовательном обходе (в режиме --tree номер
+присваивается раньше, при создании узла, что даёт прямой порядок).
+Узел живёт, пока не разобраны все её MP4-файлы, которые могут
+обрабатываться пулом потоков, и не завершены все подпапки: только
+тогда известен итог поддерева, который прибавляется к родителю.
+*/
+typedef struct DirNode
+{
+    struct DirNode *parent; /**< Родительская папка (NULL для корня) */
+    char *path;             /**< Полный путь к папке */
+    long pending;           /**< Количество ещё не закрытых подпапок */
+    long children_pending;  /**< Подпапки, итог поддерева которых ещё не известен */
+    long files_pending;     /**< MP4-файлы, ещё не разобранные пулом */
+    int enumerated;         /**< Содержимое папки прочитано полностью */
+    int closed;             /**< Папка закрыта */
+    int depth;              /**< Глубина от корня сканирования (корень — 0) */
+    int root;               /**< Номер корня сканирования */
+    uint64_t seq;           /**< Порядковый номер строки вывода или NO_SEQ */
+    uint64_t local_mp4_count; /**< MP4-файлов непосредственно в папке */
+    uint64_t local_ticks;   /**< Их суммарная длительность в микросекундах */
+    uint64_t subtree_files; /**< MP4-файлов во всём поддереве */
+    uint64_t subtree_ticks; /**< Их суммарная длительность */
+    uint64_t subtree_folders; /**< Папок с MP4 во всём поддереве */
+    long subdirs;           /**< Подпапок, найденных при чтении */
+    int shard_owned;        /**< Поддерево целиком принадлежит своей части (--shard) */
+    int via_link;           /**< Папка достигнута через символическую ссылку на папку (-L) */
+    uint32_t match_state;   /**< Состояние правил исключения после пути папки (0 — правил нет) */
+} DirNode;
+
+/** Папке не положена строка вывода (глубже --max-depth). */
+#define NO_SEQ UINT64_MAX
+
+/** При автоматической глубине папка делится между частями, если подпапок не меньше N раз по столько. */
+#define SHARD_AUTO_FANOUT 4
+
+/** Первая строка файла частичного результата. */
+#define PARTIAL_MAGIC "mp4_scanner partial 2\n"
+
+/** Первая строка журнала --checkpoint. */
+#define CHECKPOINT_MAGIC "mp4_scanner checkpoint 2\n"
+/** Начало первой строки журнала любой версии. */
+#define CHECKPOINT_MAGIC_PREFIX "mp4_scanner checkpoint "
+/** Записей журнала между вызовами fsync(). */
+#define CHECKPOINT_BATCH 1024
+/** Наибольший промежуток между вызовами fsync(), нс. */
+#define CHECKPOINT_SYNC_NS 1000000000ull
+
+/** Подразрядов размера файла в номере слоя --estimate: слой покрывает полстепени двойки. */
+#define ESTIMATE_SUB_BITS 1
+/** Количество слоёв --estimate по размеру файла. */
+#define ESTIMATE_STRATA (64 << ESTIMATE_SUB_BITS)
+/** Пилотная выборка из каждого слоя. */
+#define ESTIMATE_PILOT 8
+/** Квантиль нормального распределения для 95% доверительного интервала. */
+#define ESTIMATE_Z 1.959964
+
+/** Меньше MP4-файлов в папке — модель битрейта для неё не строится. */
+#define MODEL_MIN_FILES 8
+/** Файлов папки, разбираемых для обучения модели битрейта. */
+#define MODEL_TRAIN 3
+/** Из стольких оценённых по размеру файлов один разбирается для проверки. */
+#define MODEL_SPOT_EVERY 16
+/** Во сколько раз размер может выйти за диапазон обучающих файлов. */
+#define MODEL_SIZE_RANGE 2
+/** Сколько проверок может разойтись с моделью, пока она считается верной. */
+#define MODEL_MAX_MISSES 1
+
+/** Ещё не вычисленный переход автомата правил исключения. */
+#define MATCH_UNKNOWN UINT32_MAX
+/** Приоритет правил командной строки: выше правил любого .scanignore. */
+#define MATCH_CLI_PRIORITY 0x80000000u
+/** Наибольший читаемый размер файла .scanignore. */
+#define SCANIGNORE_MAX (1024 * 1024)
+
+/** Получен SIGINT или SIGTERM: обход останавливается, итог печатается частичным. */
+static volatile sig_atomic_t g_interrupted = 0;
+
+/**
+
+@struct ParseJob
+
+@brief Разбор одного MP4-файла в пуле потоков.
+*/
+typedef struct ParseJob
+{
+    struct ParseJob *next;  /**< Следующее задание в очереди */
+    DirNode *node;          /**< Папка, в которой лежит файл */
+    uint32_t uid;           /**< Владелец файла (для --group-by uid) */
+    size_t root_len;        /**< Длина пути корня (для --group-by depth:N) */
+    uint64_t dev;           /**< Устройство файла (очередь пула) */
+    struct ModelDir *model; /**< Модель битрейта, ждущая этого файла (или NULL) */
+    size_t sample;          /**< Номер файла в массиве модели */
+    MP4Duration result;     /**< Результат разбора */
+    char path[];            /**< Полный путь к файлу */
+} ParseJob;
+
+/**
+
+@struct RankedFile
+
+@brief Файл в списке самых длинных или самых коротких.
+*/
+typedef struct
+{
+    uint64_t ticks; /**< Длительность в микросекундах */
+    char *path;     /**< Полный путь к файлу */
+} RankedFile;
+
+/**
+
+@struct RankHeap
+
+@brief Ограниченная куча для --top и --bottom.
+
+В корне лежит «худший» из сохранённых файлов: самый короткий для
+--top и самый длинный для --bottom. Новый файл сравнивается только с
+корнем, поэтому для большинства файлов проверка стоит одно сравнение,
+а память не превышает limit элементов при любом размере архива.
+*/
+typedef struct
+{
+    RankedFile *items; /**< Элементы кучи */
+    size_t len;        /**< Количество элементов */
+    size_t cap;        /**< Выделено под элементы */
+    size_t limit;      /**< Сколько файлов хранить (0 — выключено) */
+    int longest;       /**< 1 — самые длинные, 0 — самые короткие */
+} RankHeap;
+
+/** Поддиапазонов на степень двойки в гистограмме длительностей (~3%). */
+#define DUR_SUB_BITS 5
+/** Корзин логарифмической гистограммы длительностей. */
+#define DUR_BUCKETS (64 << DUR_SUB_BITS)
+/** Поминутных корзин; более длинные файлы попадают в последнюю. */
+#define DUR_MINUTE_BUCKETS 240
+/** Параметр сжатия t-digest: больше — точнее и больше центроидов. */
+#define TDIGEST_COMPRESSION 100
+/** Сколько значений копится до сжатия t-digest. */
+#define TDIGEST_BUFFER 512
+/** Предел числа центроидов после сжатия с масштабной функцией k1. */
+#define TDIGEST_MAX_CENTROIDS (2 * TDIGEST_COMPRESSION)
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/**
+
+@struct Centroid
+
+@brief Центроид t-digest: среднее и вес группы значений.
+*/
+typedef struct
+{
+    double mean;   /**< Среднее значение группы */
+    double weight; /**< Количество значений в группе */
+} Centroid;
+
+/**
+
+@struct TDigest
+
+@brief Сливающийся t-digest для квантилей длительностей (--sketch).
+
+Значения копятся в буфере и при его заполнении вливаются в отсортированный
+список центроидов. Размер центроида ограничен масштабной функцией k1,
+поэтому хвосты распределения (p1, p99) описываются точнее середины.
+Дайджесты разных потоков сливаются так же, как буфер.
+*/
+typedef struct
+{
+    Centroid centroids[TDIGEST_MAX_CENTROIDS + 1]; /**< Сжатые центроиды */
+    size_t ncentroids;                             /**< Их количество */
+    Centroid buffer[TDIGEST_BUFFER];               /**< Ещё не влитые значения */
+    size_t nbuffer;                                /**< Заполненность буфера */
+    double min;                                    /**< Минимальное значение */
+    double max;                                    /**< Максимальное значение */
+} TDigest;
+
+/**
+
+@struct DurationDist
+
+@brief Распределение длительностей файлов за один проход.
+
+Логарифмическая гистограмма в микросекундах даёт перцентили с
+погрешностью около 3%, поминутные корзины — распределение для
+планирования. Обе складываются поэлементно, поэтому каждый поток
+ведёт свою копию, а в конце они суммируются.
+*/
+typedef struct
+{
+    uint64_t buckets[DUR_BUCKETS];              /**< Логарифмические корзины */
+    uint64_t minutes[DUR_MINUTE_BUCKETS];       /**< Файлов по минутам длительности */
+    uint64_t count;                             /**< Количество файлов */
+    uint64_t min;                               /**< Минимальная длительность */
+    uint64_t max;                               /**< Максимальная длительность */
+    TDigest *sketch;                            /**< t-digest (NULL без --sketch) */
+} DurationDist;
+
+/**
+
+@struct GroupEntry
+
+@brief Итоги одной группы.
+*/
+typedef struct
+{
+    uint64_t hash;   /**< Хэш ключа (0 — свободная ячейка) */
+    const char *key; /**< Ключ группы, хранится в пуле строк карты */
+    uint64_t files;  /**< Количество файлов */
+    uint64_t ticks;  /**< Суммарная длительность в микросекундах */
+    uint64_t folders; /**< Папок с MP4 (для журнала --checkpoint) */
+    int root;         /**< Корень, под которым папка завершена (для журнала --checkpoint) */
+} GroupEntry;
+
+/**
+
+@struct GroupArena
+
+@brief Блок пула строк, в который копируются ключи групп.
+*/
+typedef struct GroupArena
+{
+    struct GroupArena *next; /**< Предыдущий блок */
+    size_t used;             /**< Занято байт */
+    size_t size;             /**< Размер данных */
+    char data[];             /**< Строки ключей */
+} GroupArena;
+
+/**
+
+@struct GroupMap
+
+@brief Хэш-таблица групп с открытой адресацией.
+
+Ключ копируется в пул строк один раз, при создании группы; дальше
+файлы той же группы обходятся поиском по хэшу без выделения памяти.
+*/
+typedef struct
+{
+    GroupEntry *slots;  /**< Ячейки таблицы (ёмкость — степень двойки) */
+    size_t cap;         /**< Ёмкость таблицы */
+    size_t len;         /**< Количество групп */
+    GroupArena *arena;  /**< Текущий блок пула строк */
+} GroupMap;
+
+/**
+
+@struct FileTally
+
+@brief Итоги по отдельным файлам, которые ведёт каждый поток.
+*/
+typedef struct
+{
+    RankHeap top;      /**< Самые длинные файлы (--top) */
+    RankHeap bottom;   /**< Самые короткие файлы (--bottom) */
+    DurationDist dist; /**< Распределение длительностей */
+    GroupMap groups;   /**< Итоги по группам (--group-by) */
+    const GroupBy *group; /**< Параметры группировки */
+} FileTally;
+
+/**
+
+@struct PoolWorker
+
+@brief Собственное состояние рабочего потока пула.
+*/
+typedef struct
+{
+    struct ParsePool *pool; /**< Пул, которому принадлежит поток */
+    pthread_t thread;       /**< Поток */
+    FileTally tally;        /**< Итоги по файлам, разобранным потоком */
+} PoolWorker;
+
+/**
+
+@struct AdaptPoint
+
+@brief Изменение предела потоков устройства регулятором --adaptive.
+*/
+typedef struct
+{
+    uint64_t at_ns;    /**< Момент изменения */
+    int limit;         /**< Новый предел */
+    double rate;       /**< Файлов в секунду в завершившемся окне */
+    double latency_us; /**< Средняя задержка разбора файла в окне, мкс */
+} AdaptPoint;
+
+/**
+
+@struct DeviceQueue
+
+@brief Очередь заданий одного устройства и её статистика.
+
+У каждого устройства свой предел одновременно работающих с ним потоков:
+медленный диск или сетевой том занимает не больше limit потоков, а
+остальные берут задания с других устройств.
+*/
+typedef struct
+{
+    uint64_t dev;         /**< Устройство */
+    ParseJob *head;       /**< Ожидающие задания */
+    ParseJob *tail;
+    size_t queued;        /**< Длина очереди */
+    int active;           /**< Потоков, разбирающих файлы этого устройства */
+    int limit;            /**< Предел одновременных потоков */
+    int rotational;       /**< Вращающийся диск (1), SSD (0) или неизвестно (-1) */
+    uint64_t files;       /**< Разобрано файлов */
+    uint64_t bytes;       /**< Прочитано байт заголовков */
+    uint64_t busy_ns;     /**< Суммарное время разбора */
+    uint64_t first_ns;    /**< Начало первого разбора */
+    uint64_t last_ns;     /**< Конец последнего разбора */
+    size_t max_queued;    /**< Наибольшая длина очереди */
+    uint64_t depth_sum;   /**< Сумма длин очереди в моменты постановки */
+    uint64_t depth_samples; /**< Количество замеров длины */
+    uint64_t win_start_ns;  /**< Начало текущего окна регулятора */
+    uint64_t win_files;     /**< Файлов, разобранных в окне */
+    uint64_t win_lat_ns;    /**< Суммарная задержка этих файлов */
+    int win_max_active;     /**< Наибольшее число потоков на устройстве в окне */
+    double prev_rate;       /**< Скорость в предыдущем окне, файлов/с */
+    double min_latency_us;  /**< Лучшая средняя задержка за всё время */
+    int backed_off;         /**< Был спад: рост дальше только по одному потоку */
+    AdaptPoint *timeline;   /**< История изменений предела */
+    size_t timeline_len;
+    uint64_t timeline_dropped; /**< Изменений, не поместившихся в историю */
+} DeviceQueue;
+
+/**
+
+@struct ParsePool
+
+@brief Пул потоков, разбирающих MP4-файлы.
+
+Обход остаётся однопоточным: координатор ставит задания в очередь
+пачками, рабочие потоки забирают их пачками и возвращают результаты в
+очередь готовых. Итоги папок обновляет только координатор, поэтому
+узлы DirNode и Stats не требуют блокировок.
+*/
+typedef struct ParsePool
+{
+    pthread_mutex_t lock;   /**< Защищает обе очереди */
+    pthread_cond_t has_work; /**< Появились задания */
+    pthread_cond_t has_done; /**< Появились результаты */
+    DeviceQueue *devices;   /**< Очереди заданий по устройствам */
+    size_t ndevices;        /**< Количество устройств */
+    size_t next_device;     /**< С какой очереди начинать поиск (по кругу) */
+    size_t queued;          /**< Заданий во всех очередях */
+    ParseJob *done;         /**< Готовые задания */
+    size_t in_flight;       /**< Отправлено, но ещё не учтено координатором */
+    int stop;               /**< Заданий больше не будет */
+    PoolWorker *workers;    /**< Рабочие потоки */
+    int nthreads;           /**< Количество рабочих потоков */
+    const Options *opts;    /**< Опции для get_mp4_duration() */
+} ParsePool;
+
+/**
+
+@struct OutSlot
+
+@brief Ячейка буфера упорядочивания подробного вывода.
+*/
+typedef struct
+{
+    int ready;  /**< Строка с этим номером готова */
+    char *line; /**< Текст строки или NULL, если печатать нечего */
+} OutSlot;
+
+/**
+
+@struct DirItem
+
+@brief Ожидающая обхода папка, хранящаяся в памяти.
+*/
+typedef struct DirItem
+{
+    struct DirItem *next; /**< Следующий элемент очереди */
+    DirNode *parent;      /**< Узел родительской папки */
+    int via_link;         /**< Папка достигнута через символическую ссылку (-L) */
+    size_t path_len;      /**< Длина пути без завершающего нуля */
+    char path[];          /**< Путь к папке */
+} DirItem;
+
+/**
+
+@struct SpillChunk
+
+@brief Блок очереди, вытесненный во временный файл.
+*/
+typedef struct SpillChunk
+{
+    struct SpillChunk *next; /**< Следующий блок */
+    long long offset;        /**< Смещение блока во временном файле */
+    size_t size;             /**< Размер блока в байтах */
+} SpillChunk;
+
+/**
+
+@struct DirQueue
+
+@brief FIFO-очередь ожидающих папок с вытеснением на диск.
+
+Пока общий бюджет памяти не исчерпан, элементы хранятся в списке.
+После исчерпания новые элементы сериализуются в буфер записи, а полные
+буферы дописываются во временный файл. Порядок FIFO сохраняется:
+сначала память, затем блоки на диске, затем буфер записи.
+*/
+typedef struct
+{
+    DirItem *head;         /**< Начало списка в памяти */
+    DirItem *tail;         /**< Конец списка в памяти */
+    SpillChunk *chunks;    /**< Блоки на диске в порядке записи */
+    SpillChunk *chunks_tail;
+    char *wbuf;            /**< Буфер записи вытесняемых элементов */
+    size_t wbuf_len;       /**< Заполненность буфера записи */
+    size_t wbuf_cap;       /**< Ёмкость буфера записи */
+    size_t count;          /**< Общее количество элементов */
+} DirQueue;
+
+/** Количество сегментов множества (dev, ino); у каждого своя блокировка. */
+#define DEVINO_SHARDS 64
+
+/**
+
+@struct DevIno
+
+@brief Идентификатор файла: устройство и inode.
+*/
+typedef struct
+{
+    uint64_t dev; /**< Устройство */
+    uint64_t ino; /**< Номер inode (0 — свободная ячейка) */
+} DevIno;
+
+/**
+
+@struct DevInoShard
+
+@brief Сегмент множества (dev, ino): хэш-таблица с открытой адресацией.
+*/
+typedef struct
+{
+    pthread_mutex_t lock; /**< Защищает сегмент */
+    DevIno *slots;        /**< Ячейки (ёмкость — степень двойки) */
+    size_t cap;           /**< Ёмкость */
+    size_t len;           /**< Количество элементов */
+} DevInoShard;
+
+/**
+
+@struct DevInoSet
+
+@brief Множество (dev, ino), разбитое на сегменты.
+
+Сегмент выбирается по младшим битам хэша, поэтому потоки, вставляющие
+разные файлы, почти никогда не ждут одну и ту же блокировку.
+*/
+typedef struct
+{
+    DevInoShard shards[DEVINO_SHARDS]; /**< Сегменты */
+} DevInoSet;
+
+/**
+
+@struct RootTotal
+
+@brief Итоги одного корня сканирования.
+*/
+typedef struct
+{
+    const char *path;   /**< Путь корня */
+    size_t path_len;    /**< Длина пути */
+    uint64_t files;     /**< MP4-файлов, засчитанных корню */
+    uint64_t ticks;     /**< Их длительность в микросекундах */
+    uint64_t folders;   /**< Папок с MP4 */
+    uint64_t dup_dirs;  /**< Папок, уже пройденных под другим корнем */
+    uint64_t dup_files; /**< Повторных жёстких ссылок на уже учтённые файлы */
+    uint64_t dev;       /**< Устройство корня (для -x) */
+    uint64_t xdev_dirs; /**< Пропущенных точек монтирования других ФС (-x) */
+} RootTotal;
+
+/**
+
+@struct FolderRec
+
+@brief Итог MP4-файлов одной папки в частичном результате.
+*/
+typedef struct
+{
+    char *path;     /**< Путь папки */
+    uint64_t files; /**< MP4-файлов непосредственно в папке */
+    uint64_t ticks; /**< Их длительность в микросекундах */
+} FolderRec;
+
+/**
+
+@struct FolderSink
+
+@brief Итоги папок для частичного результата, упорядочиваемые по пути.
+
+Записи копятся в памяти; сверх бюджета --mem-budget они сортируются и
+сбрасываются во временный файл (серию), а при записи результата серии
+сливаются k-путевым слиянием. Память не зависит от числа папок.
+*/
+typedef struct
+{
+    int active;      /**< Собирать итоги папок (--partial, --shard) */
+    FolderRec *recs; /**< Записи в памяти */
+    size_t len;      /**< Их количество */
+    size_t cap;      /**< Ёмкость массива */
+    size_t mem;      /**< Память, занятая записями */
+    FILE **runs;     /**< Отсортированные серии во временных файлах */
+    size_t nruns;    /**< Количество серий */
+    uint64_t count;  /**< Всего записей */
+} FolderSink;
+
+/**
+
+@enum EstimateStop
+
+@brief Почему прекратилось уточнение оценки --estimate.
+*/
+typedef enum
+{
+    ESTIMATE_TARGET,      /**< Достигнута целевая погрешность */
+    ESTIMATE_BUDGET,      /**< Исчерпан бюджет времени */
+    ESTIMATE_EXHAUSTED,   /**< Разобраны все сохранённые кандидаты */
+    ESTIMATE_INTERRUPTED  /**< Получен сигнал прерывания */
+} EstimateStop;
+
+/**
+
+@struct Stratum
+
+@brief Слой выборки --estimate: MP4-файлы одного класса размера.
+
+Пока пути помещаются в --mem-budget, хранятся все; сверх бюджета слой
+становится резервуаром, хранящим равномерную выборку путей. После обхода
+выборка перемешивается, и разбираются её первые parsed путей, то есть
+простая случайная выборка из слоя любого размера.
+*/
+typedef struct
+{
+    uint64_t files;  /**< Файлов в слое */
+    char **paths;    /**< Выборка путей */
+    size_t len;      /**< Путей в выборке */
+    size_t cap;      /**< Ёмкость массива путей */
+    size_t limit;    /**< Предел выборки (0 — хранятся все пути) */
+    size_t parsed;   /**< Разобрано первых путей */
+    uint64_t found;  /**< Из них распознано MP4 */
+    double sum;      /**< Сумма длительностей, секунды */
+    double sum_sq;   /**< Сумма квадратов длительностей */
+} Stratum;
+
+/**
+
+@struct Estimator
+
+@brief Состояние оценки итога по стратифицированной выборке (--estimate).
+*/
+typedef struct
+{
+    Stratum strata[ESTIMATE_STRATA]; /**< Слои по размеру файла */
+    uint64_t rng;          /**< Состояние генератора случайных чисел */
+    size_t mem;            /**< Память, занятая путями выборки */
+    size_t mem_budget;     /**< Бюджет памяти путей (--mem-budget) */
+    uint64_t candidates;   /**< Всего файлов .mp4 */
+    uint64_t folders;      /**< Папок с файлами .mp4 */
+    uint64_t sampled;      /**< Разобрано файлов */
+    unsigned rounds;       /**< Раундов разбора */
+    uint64_t sample_ns;    /**< Время разбора выборки */
+    EstimateStop stop;     /**< Причина остановки */
+    double files;          /**< Оценка числа MP4-файлов */
+    double files_error;    /**< Полуширина интервала для числа файлов */
+    double seconds;        /**< Оценка суммарной длительности, секунды */
+    double seconds_error;  /**< Полуширина интервала для длительности */
+} Estimator;
+
+/**
+
+@enum MatchNodeKind
+
+@brief Узел недетерминированного автомата шаблона исключения.
+*/
+typedef enum
+{
+    MN_CHAR,    /**< Один заданный символ */
+    MN_ANY,     /**< ? — любой символ, кроме / */
+    MN_CLASS,   /**< [...] — символ из набора, кроме / */
+    MN_STAR,    /**< * — любая строка без / */
+    MN_DSEG,    /**< ** / — ноль или больше папок; за ним всегда MN_DSEG_IN */
+    MN_DSEG_IN, /**< Внутри имени папки, поглощаемой ** / */
+    MN_ANYSTR,  /**< / ** в конце — всё содержимое папки */
+    MN_ACCEPT   /**< Шаблон совпал */
+} MatchNodeKind;
+
+/**
+
+@struct MatchNode
+
+@brief Узел автомата шаблона; следующий узел шаблона идёт за ним в массиве.
+*/
+typedef struct
+{
+    uint8_t kind;  /**< MatchNodeKind */
+    uint8_t ch;    /**< Символ для MN_CHAR */
+    uint32_t rule; /**< Номер правила */
+    uint32_t cls;  /**< Номер набора символов для MN_CLASS */
+} MatchNode;
+
+/**
+
+@struct MatchRule
+
+@brief Правило исключения в смысле .gitignore.
+*/
+typedef struct
+{
+    uint32_t priority; /**< Из совпавших правил действует правило с большим приоритетом */
+    uint8_t negate;    /**< !ШАБЛОН (--include) возвращает запись */
+    uint8_t dir_only;  /**< ШАБЛОН/ относится только к папкам */
+} MatchRule;
+
+/**
+
+@struct MatchState
+
+@brief Состояние детерминированного автомата: множество узлов шаблонов.
+*/
+typedef struct
+{
+    uint32_t *nodes;      /**< Отсортированные номера узлов */
+    uint32_t len;         /**< Их количество */
+    uint32_t *next;       /**< Переходы по байту (MATCH_UNKNOWN — ещё не вычислен), NULL до первого */
+    uint8_t exclude_file; /**< Файл с таким путём исключён */
+    uint8_t exclude_dir;  /**< Папка с таким путём исключена */
+} MatchState;
+
+/**
+
+@struct Matcher
+
+@brief Правила --exclude, --include и .scanignore, скомпилированные в
+один автомат.
+
+Шаблоны всех правил — узлы одного недетерминированного автомата.
+Детерминированные состояния (множества узлов) строятся лениво и
+запоминаются вместе с переходами, поэтому имя записи проверяется за
+время, линейное по его длине, при любом числе правил. Правила нового
+.scanignore только добавляют начальные узлы к состоянию своей папки, и
+уже построенные состояния остаются верными.
+*/
+typedef struct
+{
+    MatchNode *nodes;       /**< Узлы шаблонов */
+    size_t nnodes;          /**< Их количество */
+    size_t nodes_cap;       /**< Ёмкость массива */
+    MatchRule *rules;       /**< Правила */
+    size_t nrules;          /**< Их количество */
+    size_t rules_cap;       /**< Ёмкость массива */
+    uint8_t (*classes)[32]; /**< Наборы символов [...] (битовые карты) */
+    size_t nclasses;        /**< Их количество */
+    size_t classes_cap;     /**< Ёмкость массива */
+    MatchState *states;     /**< Состояния; 0 — пустое множество */
+    size_t nstates;         /**< Их количество */
+    size_t states_cap;      /**< Ёмкость массива */
+    uint32_t *index;        /**< Хэш-таблица множеств узлов (номера состояний + 1) */
+    size_t index_cap;       /**< Размер таблицы (степень двойки) */
+    uint32_t *mark;         /**< Поколение, в котором узел добавлен в строящееся множество */
+    uint32_t gen;           /**< Текущее поколение */
+    uint32_t *set;          /**< Строящееся множество */
+    size_t set_len;         /**< Его длина */
+    size_t set_cap;         /**< Ёмкость */
+    uint32_t next_priority; /**< Приоритет следующего правила .scanignore */
+    uint32_t root;          /**< Состояние корня: правила командной строки */
+} Matcher;
+
+/**
+
+@enum ModelRole
+
+@brief Роль файла папки в модели битрейта.
+*/
+typedef enum
+{
+    MODEL_PENDING,  /**< Ждёт решения модели */
+    MODEL_TRAINING, /**< Разбирается для обучения */
+    MODEL_SPOT      /**< Разбирается для проверки */
+} ModelRole;
+
+/**
+
+@struct SizedFile
+
+@brief MP4-файл папки, ожидающий решения модели битрейта.
+*/
+typedef struct
+{
+    char *path;         /**< Путь файла */
+    uint64_t size;      /**< Размер в байтах */
+    uint64_t dev;       /**< Устройство */
+    uint32_t uid;       /**< Владелец */
+    ModelRole role;     /**< Роль файла в модели */
+    MP4Duration result; /**< Результат разбора обучающего или проверочного файла */
+} SizedFile;
+
+/**
+
+@struct ModelDir
+
+@brief Папка, модель битрейта которой ждёт разбора обучающих и проверочных файлов.
+
+Эти файлы разбираются пулом, как и остальные, и обход не ждёт их:
+решение принимается, когда пул вернёт последний из них.
+*/
+typedef struct ModelDir
+{
+    DirNode *node;    /**< Папка */
+    SizedFile *files; /**< Её MP4-файлы, по возрастанию размера */
+    size_t n;         /**< Количество файлов */
+    double lo, hi;    /**< Диапазон размеров, в котором модели можно верить */
+    size_t pending;   /**< Разборов в полёте (плюс один, пока они ставятся в очередь) */
+} ModelDir;
+
+/**
+
+@struct ModelStats
+
+@brief Счётчики модели битрейта (--bitrate-model).
+*/
+typedef struct
+{
+    uint64_t dirs;      /**< Папок, для которых строилась модель */
+    uint64_t fitted;    /**< Из них папок, где модель подтвердилась */
+    uint64_t estimated; /**< Файлов, длительность которых оценена по размеру */
+    uint64_t parsed;    /**< Файлов, разобранных для обучения и проверки */
+    uint64_t outliers;  /**< Файлов вне модели (размер или проверка), разобранных честно */
+    uint64_t unfit;     /**< Файлов папок без модели, разобранных честно */
+} ModelStats;
+
+/**
+
+@struct WalkState
+
+@brief Состояние итеративного обхода и учёт ресурсов.
+*/
+typedef struct
+{
+    Stats *stats;             /**< Накопляемая статистика */
+    Options *opts;            /**< Опции командной строки */
+    DirQueue **stack;         /**< Стек очередей (DFS) или одна очередь (BFS) */
+    size_t depth;             /**< Количество очередей в стеке */
+    size_t capacity;          /**< Ёмкость стека */
+    size_t mem_used;          /**< Память, занятая элементами очередей */
+    FILE *spill;              /**< Временный файл для вытеснения */
+    long long spill_end;      /**< Конец данных во временном файле */
+    long long spilled_items;  /**< Сколько элементов было вытеснено */
+    uint64_t lost_entries;    /**< Папок и MP4-файлов, потерянных из-за нехватки памяти или ошибки временного файла */
+    uint64_t started_ns;      /**< Время начала обхода */
+    uint64_t next_progress_ns; /**< Время следующей строки прогресса */
+    ParsePool *pool;          /**< Пул разбора (NULL при -j 1) */
+    ParseJob *batch;          /**< Задания, ещё не отправленные в пул */
+    int batch_len;            /**< Длина пачки */
+    uint64_t next_seq;        /**< Следующий порядковый номер папки */
+    OutSlot *out;             /**< Кольцевой буфер упорядочивания вывода */
+    size_t out_cap;           /**< Ёмкость буфера (степень двойки) */
+    uint64_t out_next;        /**< Номер следующей строки для печати */
+    DeviceQueue *devices;     /**< Статистика очередей устройств после остановки пула */
+    size_t ndevices;          /**< Количество устройств */
+    FileTally tally;          /**< Итоги по файлам: --top, --bottom, распределение */
+    RootTotal *roots;         /**< Итоги по корням сканирования */
+    int nroots;               /**< Количество корней */
+    DevInoSet *seen_dirs;     /**< Пройденные папки (NULL — не отслеживаются) */
+    char *root_real;          /**< realpath() единственного корня при -L: ссылки внутрь него не обходятся */
+    size_t root_real_len;     /**< Его длина */
+    DevInoSet *seen_files;    /**< Файлы с несколькими жёсткими ссылками */
+    FILE *journal;            /**< Журнал --checkpoint, открытый на дозапись */
+    GroupMap done_dirs;       /**< Папки, завершённые в прошлых запусках, с итогами поддеревьев */
+    size_t journal_unsynced;  /**< Записей после последнего fsync() */
+    uint64_t journal_synced_ns; /**< Время последнего fsync() */
+    uint64_t resumed_dirs;    /**< Поддеревьев, взятых из журнала без обхода */
+    uint64_t shard_dirs;      /**< Поддеревьев, отданных другим частям (--shard) */
+    uint64_t shard_files;     /**< MP4-файлов в общих папках, отданных другим частям */
+    FolderSink folders;       /**< Итоги папок для частичного результата */
+    Estimator *estimate;      /**< Оценка по выборке (NULL без --estimate) */
+    ModelStats model;         /**< Счётчики модели битрейта */
+    Matcher *matcher;         /**< Правила исключения (NULL — не заданы и .scanignore не читаются) */
+    uint64_t pruned_entries;  /**< Записей, отброшенных правилами исключения */
+    uint64_t pruned_dirs;     /**< Из них папок, которые не открывались */
+    uint64_t scanignore_files; /**< Прочитано файлов .scanignore */
+} WalkState;
+
+/**
+
+@brief Печатает строку прогресса в stderr, если подошло её время.
+
+@param final Ненулевое значение завершает строку прогресса.
+*/
+static void progress_tick(WalkState *ws, int final)
+{
+    if (ws->opts->progress_ms == 0)
+        return;
+
+    uint64_t now = now_ns();
+    if (!final && now < ws->next_progress_ns)
+        return;
+    ws->next_progress_ns = now + (uint64_t)ws->opts->progress_ms * 1000000ull;
+
+    ThreadStats total;
+    collect_thread_stats(&total);
+    double elapsed = (double)(now - ws->started_ns) / 1e9;
+    if (elapsed <= 0)
+        elapsed = 1e-9;
+    double mb = (double)total.bytes_read / (1024.0 * 1024.0);
+
+    fprintf(stderr, "\r\xE2\x8F\xB3 %llu files (%.0f/s), %llu dirs, %.1f MB read (%.2f MB/s)   ",
+            (unsigned long long)total.files_probed, (double)total.files_probed / elapsed,
+            (unsigned long long)total.ops[PH_DIR_OPEN], mb, mb / elapsed);
+    if (final)
+        fputc('\n', stderr);
+    fflush(stderr);
+}
+
+/**
+
+@brief Сбрасывает буфер записи очереди во временный файл.
+*/
+static int dir_queue_flush(WalkState *ws, DirQueue *q)
+{
+    if (q->wbuf_len == 0)
+        return 1;
+
+    if (!ws->spill)
+    {
+        ws->spill = tmpfile();
+        if (!ws->spill)
+            return 0;
+        track_handle(1);
+    }
+
+    SpillChunk *chunk = malloc(sizeof(*chunk));
+    if (!chunk)
+        return 0;
+    chunk->next = NULL;
+    chunk->offset = ws->spill_end;
+    chunk->size = q->wbuf_len;
+
+    if (fseeko(ws->spill, (off_t)chunk->offset, SEEK_SET) != 0 ||
+        fwrite(q->wbuf, 1, q->wbuf_len, ws->spill) != q->wbuf_len)
+    {
+        free(chunk);
+        return 0;
+    }
+
+    ws->spill_end += (long long)q->wbuf_len;
+    if (q->chunks_tail)
+        q->chunks_tail->next = chunk;
+    else
+        q->chunks = chunk;
+    q->chunks_tail = chunk;
+    q->wbuf_len = 0;
+    return 1;
+}
+
+/**
+
+@brief Добавляет в очередь элемент, уже размещённый в памяти.
+*/
+static void dir_queue_link(DirQueue *q, DirItem *item)
+{
+    item->next = NULL;
+    if (q->tail)
+        q->tail->next = item;
+    else
+        q->head = item;
+    q->tail = item;
+}
+
+/**
+
+@brief Создаёт элемент очереди в памяти.
+*/
+static DirItem *dir_item_new(WalkState *ws, DirNode *parent, int via_link, const char *path, size_t len)
+{
+    DirItem *item = malloc(sizeof(*item) + len + 1);
+    if (!item)
+        return NULL;
+    item->parent = parent;
+    item->via_link = via_link;
+    item->path_len = len;
+    memcpy(item->path, path, len);
+    item->path[len] = '\0';
+    ws->mem_used += sizeof(*item) + len + 1;
+    return item;
+}
+
+/**
+
+@brief Разбирает сериализованные элементы и добавляет их в конец списка в памяти.
+*/
+static void dir_queue_unpack(WalkState *ws, DirQueue *q, const char *buf, size_t size)
+{
+    size_t pos = 0;
+    while (pos + sizeof(DirNode *) + sizeof(uint32_t) + 1 <= size)
+    {
+        DirNode *parent;
+        uint32_t len;
+        memcpy(&parent, buf + pos, sizeof(parent));
+        pos += sizeof(parent);
+        memcpy(&len, buf + pos, sizeof(len));
+        pos += sizeof(len);
+        int via_link = buf[pos++];
+        if (pos + len > size)
+            break;
+        DirItem *item = dir_item_new(ws, parent, via_link, buf + pos, len);
+        pos += len;
+        if (item)
+            dir_queue_link(q, item);
+        else
+            ws->lost_entries++;
+    }
+}
+
+/**
+
+@brief Помещает папку в конец очереди.
+
+Пока бюджет памяти не превышен и очередь не вытеснялась, элемент
+хранится в памяти; иначе он сериализуется для записи на диск.
+*/
+static int dir_queue_push(WalkState *ws, DirQueue *q, DirNode *parent, int via_link, const char *path)
+{
+    size_t len = strlen(path);
+    size_t cost = sizeof(DirItem) + len + 1;
+    int spilling = q->chunks || q->wbuf_len;
+
+    if (!spilling && ws->mem_used + cost <= ws->opts->mem_budget)
+    {
+        DirItem *item = dir_item_new(ws, parent, via_link, path, len);
+        if (!item)
+            return 0;
+        dir_queue_link(q, item);
+        q->count++;
+        return 1;
+    }
+
+    size_t rec = sizeof(parent) + sizeof(uint32_t) + 1 + len;
+    if (q->wbuf_len + rec > SPILL_CHUNK_SIZE && !dir_queue_flush(ws, q))
+        return 0;
+    if (q->wbuf_len + rec > q->wbuf_cap)
+    {
+        // Буфер растёт постепенно: при глубоком дереве вытесняющих
+        // очередей много, и большинство из них короткие.
+        size_t cap = q->wbuf_cap ? q->wbuf_cap : 256;
+        while (cap < q->wbuf_len + rec)
+            cap *= 2;
+        char *wbuf = realloc(q->wbuf, cap);
+        if (!wbuf)
+            return 0;
+        q->wbuf = wbuf;
+        q->wbuf_cap = cap;
+    }
+
+    uint32_t len32 = (uint32_t)len;
+    memcpy(q->wbuf + q->wbuf_len, &parent, sizeof(parent));
+    memcpy(q->wbuf + q->wbuf_len + sizeof(parent), &len32, sizeof(len32));
+    q->wbuf[q->wbuf_len + sizeof(parent) + sizeof(len32)] = (char)(via_link != 0);
+    memcpy(q->wbuf + q->wbuf_len + sizeof(parent) + sizeof(len32) + 1, path, len);
+    q->wbuf_len += rec;
+    q->count++;
+    ws->spilled_items++;
+    return 1;
+}
+
+/**
+
+@brief Извлекает папку из начала очереди, подгружая блоки с диска.
+*/
+static DirItem *dir_queue_pop(WalkState *ws, DirQueue *q)
+{
+    if (!q->head && q->chunks)
+    {
+        SpillChunk *chunk = q->chunks;
+        char *buf = malloc(chunk->size);
+        if (buf && fseeko(ws->spill, (off_t)chunk->offset, SEEK_SET) == 0 &&
+            fread(buf, 1, chunk->size, ws->spill) == chunk->size)
+            dir_queue_unpack(ws, q, buf, chunk->size);
+        else
+        {
+            // Сколько папок было в блоке, уже не узнать: итог неполон
+            fprintf(stderr, "Spill file: cannot read back %zu bytes of pending folders\n", chunk->size);
+            ws->lost_entries++;
+        }
+        free(buf);
+        q->chunks = chunk->next;
+        if (!q->chunks)
+            q->chunks_tail = NULL;
+        free(chunk);
+    }
+    if (!q->head && q->wbuf_len)
+    {
+        dir_queue_unpack(ws, q, q->wbuf, q->wbuf_len);
+        q->wbuf_len = 0;
+    }
+
+    DirItem *item = q->head;
+    if (!item)
+    {
+        q->count = 0;
+        return NULL;
+    }
+    q->head = item->next;
+    if (!q->head)
+        q->tail = NULL;
+    q->count--;
+    ws->mem_used -= sizeof(*item) + item->path_len + 1;
+    return item;
+}
+
+/**
+
+@brief Освобождает очередь вместе с оставшимися элементами.
+*/
+static void dir_queue_free(WalkState *ws, DirQueue *q)
+{
+    DirItem *item;
+    while ((item = dir_queue_pop(ws, q)) != NULL)
+        free(item);
+    free(q->wbuf);
+    free(q);
+}
+
+/**
+
+@brief Кладёт очередь на вершину стека обхода.
+*/
+static int walk_push_queue(WalkState *ws, DirQueue *q)
+{
+    if (ws->depth == ws->capacity)
+    {
+        size_t cap = ws->capacity ? ws->capacity * 2 : 64;
+        DirQueue **stack = realloc(ws->stack, cap * sizeof(*stack));
+        if (!stack)
+            return 0;
+        ws->stack = stack;
+        ws->capacity = cap;
+    }
+    ws->stack[ws->depth++] = q;
+    return 1;
+}
+
+/**
+
+@brief Выбирает следующую папку для обхода.
+
+В режиме DFS берётся первая папка из верхней очереди стека: так
+порядок обхода совпадает с рекурсивным. В режиме BFS стек состоит
+из единственной общей очереди.
+*/
+static DirItem *walk_next(WalkState *ws)
+{
+    while (ws->depth > 0)
+    {
+        DirQueue *q = ws->stack[ws->depth - 1];
+        DirItem *item = dir_queue_pop(ws, q);
+        if (item)
+            return item;
+        if (ws->opts->walk_bfs)
+            return NULL;
+        dir_queue_free(ws, q);
+        ws->depth--;
+    }
+    return NULL;
+}
+
+/**
+
+@brief Создаёт пустое множество (dev, ino).
+*/
+static DevInoSet *devino_set_new(void)
+{
+    DevInoSet *set = calloc(1, sizeof(*set));
+    if (!set)
+        return NULL;
+    for (int i = 0; i < DEVINO_SHARDS; i++)
+        pthread_mutex_init(&set->shards[i].lock, NULL);
+    return set;
+}
+
+/**
+
+@brief Освобождает множество (dev, ino).
+*/
+static void devino_set_free(DevInoSet *set)
+{
+    if (!set)
+        return;
+    for (int i = 0; i < DEVINO_SHARDS; i++)
+    {
+        pthread_mutex_destroy(&set->shards[i].lock);
+        free(set->shards[i].slots);
+    }
+    free(set);
+}
+
+/**
+
+@brief Перемешивание битов (финализатор splitmix64).
+*/
+static uint64_t devino_hash(uint64_t dev, uint64_t ino)
+{
+    uint64_t h = ino * 0x9E3779B97F4A7C15ull ^ dev;
+    h ^= h >> 30;
+    h *= 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 27;
+    h *= 0x94D049BB133111EBull;
+    h ^= h >> 31;
+    return h;
+}
+
+/**
+
+@brief Добавляет (dev, ino) в множество.
+
+@return 1, если элемент новый; 0, если он уже был. При нехватке памяти
+элемент считается новым, чтобы файл не потерялся.
+*/
+static int devino_insert(DevInoSet *set, uint64_t dev, uint64_t ino)
+{
+    uint64_t h = devino_hash(dev, ino);
+    DevInoShard *shard = &set->shards[h % DEVINO_SHARDS];
+    int inserted = 1;
+
+    // Номер inode 0 означает свободную ячейку
+    if (ino == 0)
+        ino = UINT64_MAX;
+    h /= DEVINO_SHARDS;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((shard->len + 1) * 10 > shard->cap * 7)
+    {
+        size_t cap = shard->cap ? shard->cap * 2 : 256;
+        DevIno *slots = calloc(cap, sizeof(*slots));
+        if (!slots)
+        {
+            pthread_mutex_unlock(&shard->lock);
+            return 1;
+        }
+        for (size_t i = 0; i < shard->cap; i++)
+        {
+            DevIno *e = &shard->slots[i];
+            if (!e->ino)
+                continue;
+            size_t j = (devino_hash(e->dev, e->ino == UINT64_MAX ? 0 : e->ino) / DEVINO_SHARDS) & (cap - 1);
+            while (slots[j].ino)
+                j = (j + 1) & (cap - 1);
+            slots[j] = *e;
+        }
+        free(shard->slots);
+        shard->slots = slots;
+        shard->cap = cap;
+    }
+    for (size_t j = h & (shard->cap - 1);; j = (j + 1) & (shard->cap - 1))
+    {
+        DevIno *e = &shard->slots[j];
+        if (!e->ino)
+        {
+            e->dev = dev;
+            e->ino = ino;
+            shard->len++;
+            break;
+        }
+        if (e->dev == dev && e->ino == ino)
+        {
+            inserted = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return inserted;
+}
+
+/**
+
+@brief Кладёт строку с номером seq в буфер и печатает готовые строки по порядку.
+*/
+static void output_put(WalkState *ws, uint64_t seq, char *line)
+{
+    if (seq - ws->out_next >= ws->out_cap)
+    {
+        size_t cap = ws->out_cap ? ws->out_cap : 64;
+        while (seq - ws->out_next >= cap)
+            cap *= 2;
+        OutSlot *slots = calloc(cap, sizeof(*slots));
+        if (!slots)
+        {
+            // Без памяти порядок не сохранить; строка печатается сразу
+            if (line)
+                fputs(line, stdout);
+            free(line);
+            return;
+        }
+        for (size_t i = 0; i < ws->out_cap; i++)
+        {
+            uint64_t k = ws->out_next + i;
+            slots[k & (cap - 1)] = ws->out[k & (ws->out_cap - 1)];
+        }
+        free(ws->out);
+        ws->out = slots;
+        ws->out_cap = cap;
+    }
+
+    OutSlot *slot = &ws->out[seq & (ws->out_cap - 1)];
+    slot->ready = 1;
+    slot->line = line;
+
+    while (ws->out_cap && ws->out[ws->out_next & (ws->out_cap - 1)].ready)
+    {
+        slot = &ws->out[ws->out_next & (ws->out_cap - 1)];
+        if (slot->line)
+            fputs(slot->line, stdout);
+        free(slot->line);
+        slot->line = NULL;
+        slot->ready = 0;
+        ws->out_next++;
+    }
+}
+
+/**
+
+@brief Строка подробного вывода для завершённой папки или NULL.
+
+-v печатает длительность файлов непосредственно в папке, --du — итог
+поддерева с полным путём, --tree — итог поддерева с отступом по глубине.
+*/
+static char *dir_line(const WalkState *ws, const DirNode *node)
+{
+    const Options *opts = ws->opts;
+    char time_str[32];
+    int h, m, s;
+
+    if (opts->rollup == ROLLUP_NONE)
+    {
+        if (!opts->verbose || node->local_mp4_count == 0)
+            return NULL;
+        format_duration((double)node->local_ticks / TICKS_PER_SECOND, &h, &m, &s);
+        snprintf(time_str, sizeof(time_str), "%d:%02d:%02d", h, m, s);
+
+        char truncated[128];
+        truncate_path(node->path, truncated, 90);
+
+        size_t size = strlen(time_str) + strlen(truncated) + 32;
+        char *line = malloc(size);
+        if (line)
+            snprintf(line, size, "\xF0\x9F\x9F\xA1 %s " COLOR_GREEN "%s\n" COLOR_RESET, time_str, truncated);
+        return line;
+    }
+
+    if (node->subtree_files == 0)
+        return NULL;
+    format_duration((double)node->subtree_ticks / TICKS_PER_SECOND, &h, &m, &s);
+    snprintf(time_str, sizeof(time_str), "%d:%02d:%02d", h, m, s);
+
+    const char *name = node->path;
+    int indent = 0;
+    if (opts->rollup == ROLLUP_TREE && node->depth > 0)
+    {
+        const char *slash = strrchr(node->path, '/');
+        name = slash ? slash + 1 : node->path;
+        indent = 2 * node->depth;
+    }
+
+    size_t size = strlen(name) + (size_t)indent + 64;
+    char *line = malloc(size);
+    if (line)
+        snprintf(line, size, "%12s %8llu  %*s%s\n", time_str, (unsigned long long)node->subtree_files, indent, "",
+                 name);
+    return line;
+}
+
+/**
+
+@brief Сравнение итогов папок по пути.
+*/
+static int cmp_folder_path(const void *a, const void *b)
+{
+    const FolderRec *x = a, *y = b;
+    return strcmp(x->path, y->path);
+}
+
+/**
+
+@brief Запись итога папки в частичном результате.
+*/
+static void folder_write(FILE *f, const FolderRec *rec)
+{
+    fprintf(f, "F %llu %llu %zu %s\n", (unsigned long long)rec->files, (unsigned long long)rec->ticks,
+            strlen(rec->path), rec->path);
+}
+
+/**
+
+@brief Сортирует записи в памяти и сбрасывает их серией во временный файл.
+
+Если файл создать не удалось, записи остаются в памяти.
+*/
+static void folder_sink_spill(WalkState *ws)
+{
+    FolderSink *sink = &ws->folders;
+    FILE **runs = realloc(sink->runs, (sink->nruns + 1) * sizeof(*runs));
+    if (!runs)
+        return;
+    sink->runs = runs;
+    FILE *run = tmpfile();
+    if (!run)
+        return;
+    track_handle(1);
+
+    qsort(sink->recs, sink->len, sizeof(*sink->recs), cmp_folder_path);
+    for (size_t i = 0; i < sink->len; i++)
+    {
+        folder_write(run, &sink->recs[i]);
+        free(sink->recs[i].path);
+    }
+    fputs("end\n", run);
+    runs[sink->nruns++] = run;
+    sink->len = 0;
+    sink->mem = 0;
+}
+
+/**
+
+@brief Добавляет итог завершённой папки.
+*/
+static void folder_sink_add(WalkState *ws, const char *path, uint64_t files, uint64_t ticks)
+{
+    FolderSink *sink = &ws->folders;
+    if (sink->len == sink->cap)
+    {
+        size_t cap = sink->cap ? sink->cap * 2 : 256;
+        FolderRec *recs = realloc(sink->recs, cap * sizeof(*recs));
+        if (!recs)
+            return;
+        sink->recs = recs;
+        sink->cap = cap;
+    }
+    size_t len = strlen(path);
+    char *copy = malloc(len + 1);
+    if (!copy)
+        return;
+    memcpy(copy, path, len + 1);
+    sink->recs[sink->len++] = (FolderRec){copy, files, ticks};
+    sink->mem += sizeof(FolderRec) + len + 1;
+    sink->count++;
+    if (sink->mem > ws->opts->mem_budget)
+        folder_sink_spill(ws);
+}
+
+/**
+
+@brief Освобождает записи и серии итогов папок.
+*/
+static void folder_sink_free(WalkState *ws)
+{
+    FolderSink *sink = &ws->folders;
+    for (size_t i = 0; i < sink->len; i++)
+        free(sink->recs[i].path);
+    free(sink->recs);
+    for (size_t i = 0; i < sink->nruns; i++)
+    {
+        fclose(sink->runs[i]);
+        track_handle(-1);
+    }
+    free(sink->runs);
+    memset(sink, 0, sizeof(*sink));
+}
+
+/**
+
+@brief Сбрасывает журнал --checkpoint на диск.
+*/
+static void checkpoint_sync(WalkState *ws)
+{
+    if (!ws->journal)
+        return;
+    fflush(ws->journal);
+#ifndef _WIN32
+    fsync(fileno(ws->journal));
+#endif
+    ws->journal_unsynced = 0;
+    ws->journal_synced_ns = now_ns();
+}
+
+/**
+
+@brief Учитывает записанную в журнал запись.
+
+Записи копятся в буфере stdio и сбрасываются с fsync() пачками: не чаще
+раза в CHECKPOINT_BATCH записей или в секунду.
+*/
+static void checkpoint_note(WalkState *ws)
+{
+    if (++ws->journal_unsynced >= CHECKPOINT_BATCH || now_ns() - ws->journal_synced_ns >= CHECKPOINT_SYNC_NS)
+        checkpoint_sync(ws);
+}
+
+/**
+
+@brief Записывает в журнал завершённое поддерево.
+
+Запись: «D корень файлы микросекунды папки файлы_папки
+микросекунды_папки длина_пути путь» — итоги поддерева и самой папки
+(для --partial). Длина позволяет хранить пути с любыми символами и
+отличить запись, оборванную при аварийном завершении.
+*/
+static void checkpoint_write(WalkState *ws, const DirNode *node)
+{
+    fprintf(ws->journal, "D %d %llu %llu %llu %llu %llu %zu %s\n", node->root, (unsigned long long)node->subtree_files,
+            (unsigned long long)node->subtree_ticks, (unsigned long long)node->subtree_folders,
+            (unsigned long long)node->local_mp4_count, (unsigned long long)node->local_ticks, strlen(node->path),
+            node->path);
+    checkpoint_note(ws);
+}
+
+/**
+
+@brief Записывает в журнал учтённый MP4-файл: «F корень микросекунды uid длина путь».
+
+По этим записям продолжение восстанавливает --top, --bottom,
+гистограмму, t-digest и группы для поддеревьев, которые не обходит.
+*/
+static void checkpoint_file(WalkState *ws, int root, uint64_t ticks, uint32_t uid, const char *path)
+{
+    fprintf(ws->journal, "F %d %llu %u %zu %s\n", root, (unsigned long long)ticks, (unsigned)uid, strlen(path), path);
+    checkpoint_note(ws);
+}
+
+/**
+
+@brief Записывает в журнал элемент множества пройденных папок (S) или
+жёстких ссылок (H): «S устройство inode длина путь».
+*/
+static void checkpoint_seen(WalkState *ws, char tag, uint64_t dev, uint64_t ino, const char *path)
+{
+    fprintf(ws->journal, "%c %llu %llu %zu %s\n", tag, (unsigned long long)dev, (unsigned long long)ino, strlen(path),
+            path);
+    checkpoint_note(ws);
+}
+
+/**
+
+@brief Папка и всё её поддерево завершены: учёт, строка вывода и
+передача итога поддерева родителю.
+
+Родитель, у которого это была последняя незавершённая часть,
+завершается тут же.
+*/
+static void dir_done(WalkState *ws, DirNode *node)
+{
+    while (node)
+    {
+        if (node->local_mp4_count > 0)
+        {
+            ws->stats->total_folders_with_mp4++;
+            ws->roots[node->root].folders++;
+            node->subtree_folders++;
+        }
+        if (node->seq != NO_SEQ)
+            output_put(ws, node->seq, dir_line(ws, node));
+        if (ws->journal)
+            checkpoint_write(ws, node);
+        if (ws->folders.active && node->local_mp4_count > 0)
+            folder_sink_add(ws, node->path, node->local_mp4_count, node->local_ticks);
+
+        DirNode *parent = node->parent;
+        if (parent)
+        {
+            parent->subtree_files += node->subtree_files;
+            parent->subtree_ticks += node->subtree_ticks;
+            parent->subtree_folders += node->subtree_folders;
+            parent->children_pending--;
+        }
+        free(node->path);
+        free(node);
+
+        if (parent && parent->closed && parent->files_pending == 0 && parent->children_pending == 0)
+            node = parent;
+        else
+            node = NULL;
+    }
+}
+
+/**
+
+@brief Нужна ли папке строка подробного вывода.
+*/
+static int dir_wants_line(const WalkState *ws, const DirNode *node)
+{
+    return ws->opts->max_depth < 0 || node->depth <= ws->opts->max_depth;
+}
+
+/**
+
+@brief Регистрирует новый узел папки у родителя.
+
+В режиме --tree номер строки присваивается здесь: обход в глубину
+создаёт узлы в прямом порядке, и родитель печатается перед подпапками.
+*/
+static void dir_attach(WalkState *ws, DirNode *node, DirNode *parent)
+{
+    node->parent = parent;
+    node->depth = parent ? parent->depth + 1 : 0;
+    if (parent)
+        node->root = parent->root;
+    node->seq = NO_SEQ;
+    if (parent)
+    {
+        parent->children_pending++;
+        node->shard_owned = parent->shard_owned;
+    }
+    if (ws->opts->rollup == ROLLUP_TREE && dir_wants_line(ws, node))
+        node->seq = ws->next_seq++;
+}
+
+/**
+
+@brief Закрывает папку и всех предков, у которых не осталось подпапок.
+
+Номера присваиваются в порядке закрытия, который определяется только
+обходом и совпадает с порядком строк последовательной версии.
+*/
+static void finish_dir(WalkState *ws, DirNode *node)
+{
+    while (node && node->enumerated && node->pending == 0 && !node->closed)
+    {
+        DirNode *parent = node->parent;
+        node->closed = 1;
+        if (ws->opts->rollup != ROLLUP_TREE && dir_wants_line(ws, node))
+            node->seq = ws->next_seq++;
+        if (node->files_pending == 0 && node->children_pending == 0)
+            dir_done(ws, node);
+        if (parent)
+            parent->pending--;
+        node = parent;
+    }
+}
+
+/**
+
+@brief Учитывает результат разбора файла папки.
+*/
+static void account_file(WalkState *ws, DirNode *node, const MP4Duration *d)
+{
+    if (d->found)
+    {
+        ws->stats->total_files++;
+        ws->stats->total_ticks += d->ticks;
+        ws->roots[node->root].files++;
+        ws->roots[node->root].ticks += d->ticks;
+        node->local_mp4_count++;
+        node->local_ticks += d->ticks;
+        node->subtree_files++;
+        node->subtree_ticks += d->ticks;
+    }
+}
+
+/**
+
+@brief Стоит ли файл a в списке выше файла b.
+
+При равной длительности порядок определяет путь, чтобы результат не
+зависел от порядка разбора.
+*/
+static int rank_above(const RankHeap *heap, uint64_t ticks, const char *path, const RankedFile *b)
+{
+    if (ticks != b->ticks)
+        return heap->longest ? ticks > b->ticks : ticks < b->ticks;
+    return strcmp(path, b->path) < 0;
+}
+
+/**
+
+@brief Восстанавливает кучу вниз от позиции i.
+*/
+static void rank_sift_down(RankHeap *heap, size_t i)
+{
+    RankedFile item = heap->items[i];
+
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= heap->len)
+            break;
+        // Ищем худшего из потомков: он должен оказаться выше
+        if (child + 1 < heap->len &&
+            rank_above(heap, heap->items[child].ticks, heap->items[child].path, &heap->items[child + 1]))
+            child++;
+        if (!rank_above(heap, item.ticks, item.path, &heap->items[child]))
+            break;
+        heap->items[i] = heap->items[child];
+        i = child;
+    }
+    heap->items[i] = item;
+}
+
+/**
+
+@brief Предлагает файл куче.
+
+@param path Путь; если owned, куча забирает строку или освобождает её.
+*/
+static void rank_offer(RankHeap *heap, uint64_t ticks, char *path, int owned)
+{
+    if (heap->limit == 0 ||
+        (heap->len == heap->limit && !rank_above(heap, ticks, path, &heap->items[0])))
+    {
+        if (owned)
+            free(path);
+        return;
+    }
+
+    char *copy = owned ? path : strdup(path);
+    if (!copy)
+        return;
+
+    if (heap->len < heap->limit)
+    {
+        if (heap->len == heap->cap)
+        {
+            size_t cap = heap->cap ? heap->cap * 2 : 64;
+            if (cap > heap->limit)
+                cap = heap->limit;
+            RankedFile *items = realloc(heap->items, cap * sizeof(*items));
+            if (!items)
+            {
+                free(copy);
+                return;
+            }
+            heap->items = items;
+            heap->cap = cap;
+        }
+        // Просеивание вверх: худшие элементы ближе к корню
+        size_t i = heap->len++;
+        while (i > 0)
+        {
+            size_t parent = (i - 1) / 2;
+            if (!rank_above(heap, heap->items[parent].ticks, heap->items[parent].path,
+                            &(RankedFile){ticks, copy}))
+                break;
+            heap->items[i] = heap->items[parent];
+            i = parent;
+        }
+        heap->items[i] = (RankedFile){ticks, copy};
+        return;
+    }
+
+    free(heap->items[0].path);
+    heap->items[0] = (RankedFile){ticks, copy};
+    rank_sift_down(heap, 0);
+}
+
+/**
+
+@brief Переносит все элементы src в dst и очищает src.
+*/
+static void rank_merge(RankHeap *dst, RankHeap *src)
+{
+    for (size_t i = 0; i < src->len; i++)
+        rank_offer(dst, src->items[i].ticks, src->items[i].path, 1);
+    free(src->items);
+    src->items = NULL;
+    src->len = src->cap = 0;
+}
+
+/**
+
+@brief Освобождает кучу со всеми путями.
+*/
+static void rank_free(RankHeap *heap)
+{
+    for (size_t i = 0; i < heap->len; i++)
+        free(heap->items[i].path);
+    free(heap->items);
+    heap->items = NULL;
+    heap->len = heap->cap = 0;
+}
+
+/**
+
+@brief Настраивает кучу для --top или --bottom.
+*/
+static void rank_init(RankHeap *heap, size_t limit, int longest)
+{
+    memset(heap, 0, sizeof(*heap));
+    heap->limit = limit;
+    heap->longest = longest;
+}
+
+/**
+
+@brief Масштабная функция k1 t-digest и обратная к ней.
+*/
+static double tdigest_k(double q)
+{
+    return TDIGEST_COMPRESSION / (2.0 * M_PI) * asin(2.0 * q - 1.0);
+}
+
+static double tdigest_q(double k)
+{
+    return (sin(k * 2.0 * M_PI / TDIGEST_COMPRESSION) + 1.0) / 2.0;
+}
+
+static int cmp_centroid(const void *a, const void *b)
+{
+    const Centroid *x = a, *y = b;
+    return x->mean < y->mean ? -1 : x->mean > y->mean;
+}
+
+/**
+
+@brief Вливает буфер в центроиды.
+*/
+static void tdigest_compress(TDigest *td)
+{
+    Centroid all[TDIGEST_MAX_CENTROIDS + 1 + TDIGEST_BUFFER];
+    size_t n = td->ncentroids;
+    double total = 0;
+
+    if (td->nbuffer == 0)
+        return;
+    memcpy(all, td->centroids, n * sizeof(*all));
+    memcpy(all + n, td->buffer, td->nbuffer * sizeof(*all));
+    n += td->nbuffer;
+    td->nbuffer = 0;
+    qsort(all, n, sizeof(*all), cmp_centroid);
+    for (size_t i = 0; i < n; i++)
+        total += all[i].weight;
+
+    size_t out = 0;
+    double before = 0;
+    double limit = total * tdigest_q(tdigest_k(0) + 1);
+    Centroid cur = all[0];
+    for (size_t i = 1; i < n; i++)
+    {
+        if (before + cur.weight + all[i].weight <= limit)
+        {
+            cur.mean += (all[i].mean - cur.mean) * all[i].weight / (cur.weight + all[i].weight);
+            cur.weight += all[i].weight;
+            continue;
+        }
+        before += cur.weight;
+        if (out < TDIGEST_MAX_CENTROIDS)
+            td->centroids[out++] = cur;
+        else
+        {
+            // Защита от переполнения: склеиваем с последним центроидом
+            Centroid *last = &td->centroids[out - 1];
+            last->mean += (cur.mean - last->mean) * cur.weight / (last->weight + cur.weight);
+            last->weight += cur.weight;
+        }
+        limit = total * tdigest_q(tdigest_k(before / total) + 1);
+        cur = all[i];
+    }
+    td->centroids[out++] = cur;
+    td->ncentroids = out;
+}
+
+/**
+
+@brief Добавляет в дайджест значение с весом.
+*/
+static void tdigest_add(TDigest *td, double x, double weight)
+{
+    if (td->ncentroids == 0 && td->nbuffer == 0)
+        td->min = td->max = x;
+    if (x < td->min)
+        td->min = x;
+    if (x > td->max)
+        td->max = x;
+    td->buffer[td->nbuffer++] = (Centroid){x, weight};
+    if (td->nbuffer == TDIGEST_BUFFER)
+        tdigest_compress(td);
+}
+
+/**
+
+@brief Вливает дайджест src в dst.
+*/
+static void tdigest_merge(TDigest *dst, TDigest *src)
+{
+    tdigest_compress(src);
+    if (src->ncentroids == 0)
+        return;
+    double min = src->min, max = src->max;
+    for (size_t i = 0; i < src->ncentroids; i++)
+        tdigest_add(dst, src->centroids[i].mean, src->centroids[i].weight);
+    if (min < dst->min)
+        dst->min = min;
+    if (max > dst->max)
+        dst->max = max;
+}
+
+/**
+
+@brief Квантиль q (0..1) по дайджесту.
+
+Значение интерполируется между центрами соседних центроидов, а на краях —
+между центроидом и точным минимумом или максимумом.
+*/
+static double tdigest_quantile(TDigest *td, double q)
+{
+    tdigest_compress(td);
+    if (td->ncentroids == 0)
+        return 0;
+
+    double total = 0;
+    for (size_t i = 0; i < td->ncentroids; i++)
+        total += td->centroids[i].weight;
+    double target = q * total;
+
+    double cum = 0;
+    double prev_mid = 0, prev_mean = td->min;
+    for (size_t i = 0; i < td->ncentroids; i++)
+    {
+        const Centroid *c = &td->centroids[i];
+        double mid = cum + c->weight / 2;
+        if (target < mid)
+        {
+            if (mid <= prev_mid)
+                return c->mean;
+            return prev_mean + (c->mean - prev_mean) * (target - prev_mid) / (mid - prev_mid);
+        }
+        prev_mid = mid;
+        prev_mean = c->mean;
+        cum += c->weight;
+    }
+    if (total <= prev_mid)
+        return td->max;
+    return prev_mean + (td->max - prev_mean) * (target - prev_mid) / (total - prev_mid);
+}
+
+/**
+
+@brief Добавляет длительность файла в распределение.
+*/
+static void dist_record(DurationDist *dist, uint64_t ticks)
+{
+    dist->buckets[hist_bucket_bits(ticks, DUR_SUB_BITS)]++;
+    uint64_t minute = ticks / (60 * TICKS_PER_SECOND);
+    dist->minutes[minute < DUR_MINUTE_BUCKETS ? minute : DUR_MINUTE_BUCKETS - 1]++;
+    if (dist->count == 0 || ticks < dist->min)
+        dist->min = ticks;
+    if (ticks > dist->max)
+        dist->max = ticks;
+    dist->count++;
+    if (dist->sketch)
+        tdigest_add(dist->sketch, (double)ticks / TICKS_PER_SECOND, 1);
+}
+
+/**
+
+@brief Прибавляет распределение src к dst и освобождает дайджест src.
+*/
+static void dist_merge(DurationDist *dst, DurationDist *src)
+{
+    if (src->count == 0)
+    {
+        free(src->sketch);
+        src->sketch = NULL;
+        return;
+    }
+    for (unsigned i = 0; i < DUR_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    for (unsigned i = 0; i < DUR_MINUTE_BUCKETS; i++)
+        dst->minutes[i] += src->minutes[i];
+    if (dst->count == 0 || src->min < dst->min)
+        dst->min = src->min;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    dst->count += src->count;
+    if (dst->sketch && src->sketch)
+        tdigest_merge(dst->sketch, src->sketch);
+    free(src->sketch);
+    src->sketch = NULL;
+}
+
+/**
+
+@brief Перцентиль длительности (0..100) в микросекундах.
+
+Берётся середина корзины, ограниченная точными минимумом и максимумом.
+*/
+static uint64_t dist_percentile(const DurationDist *dist, double pct)
+{
+    if (dist->count == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(pct / 100.0 * (double)dist->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < DUR_BUCKETS; i++)
+    {
+        seen += dist->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t lo = hist_bucket_value_bits(i, DUR_SUB_BITS);
+            uint64_t hi = i + 1 < DUR_BUCKETS ? hist_bucket_value_bits(i + 1, DUR_SUB_BITS) : lo;
+            uint64_t v = lo + (hi - lo) / 2;
+            if (v < dist->min)
+                v = dist->min;
+            return v < dist->max ? v : dist->max;
+        }
+    }
+    return dist->max;
+}
+
+/**
+
+@brief Хэш FNV-1a ключа группы (никогда не 0).
+*/
+static uint64_t group_hash(const char *key, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 0x100000001b3ull;
+    }
+    return h ? h : 1;
+}
+
+/**
+
+@brief Копирует ключ в пул строк карты.
+*/
+static const char *group_intern(GroupMap *map, const char *key, size_t len)
+{
+    GroupArena *arena = map->arena;
+    if (!arena || arena->size - arena->used < len + 1)
+    {
+        size_t size = len + 1 > 4096 ? len + 1 : 4096;
+        arena = malloc(sizeof(*arena) + size);
+        if (!arena)
+            return NULL;
+        arena->next = map->arena;
+        arena->used = 0;
+        arena->size = size;
+        map->arena = arena;
+    }
+    char *copy = arena->data + arena->used;
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+    arena->used += len + 1;
+    return copy;
+}
+
+/**
+
+@brief Увеличивает таблицу вдвое.
+*/
+static int group_grow(GroupMap *map)
+{
+    size_t cap = map->cap ? map->cap * 2 : 64;
+    GroupEntry *slots = calloc(cap, sizeof(*slots));
+    if (!slots)
+        return 0;
+    for (size_t i = 0; i < map->cap; i++)
+    {
+        GroupEntry *e = &map->slots[i];
+        if (!e->hash)
+            continue;
+        size_t j = e->hash & (cap - 1);
+        while (slots[j].hash)
+            j = (j + 1) & (cap - 1);
+        slots[j] = *e;
+    }
+    free(map->slots);
+    map->slots = slots;
+    map->cap = cap;
+    return 1;
+}
+
+/**
+
+@brief Прибавляет файлы и длительность к группе key, создавая её при необходимости.
+
+@return Ячейка группы или NULL, если не хватило памяти.
+*/
+static GroupEntry *group_add(GroupMap *map, const char *key, size_t len, uint64_t files, uint64_t ticks)
+{
+    if ((map->len + 1) * 10 > map->cap * 7 && !group_grow(map))
+        return NULL;
+
+    uint64_t h = group_hash(key, len);
+    size_t j = h & (map->cap - 1);
+    for (;; j = (j + 1) & (map->cap - 1))
+    {
+        GroupEntry *e = &map->slots[j];
+        if (!e->hash)
+        {
+            if (!(e->key = group_intern(map, key, len)))
+                return NULL;
+            e->hash = h;
+            map->len++;
+            break;
+        }
+        if (e->hash == h && strncmp(e->key, key, len) == 0 && e->key[len] == '\0')
+            break;
+    }
+    map->slots[j].files += files;
+    map->slots[j].ticks += ticks;
+    return &map->slots[j];
+}
+
+/**
+
+@brief Ищет группу key без создания.
+*/
+static GroupEntry *group_find(const GroupMap *map, const char *key, size_t len)
+{
+    if (!map->len)
+        return NULL;
+    uint64_t h = group_hash(key, len);
+    for (size_t j = h & (map->cap - 1); map->slots[j].hash; j = (j + 1) & (map->cap - 1))
+    {
+        GroupEntry *e = &map->slots[j];
+        if (e->hash == h && strncmp(e->key, key, len) == 0 && e->key[len] == '\0')
+            return e;
+    }
+    return NULL;
+}
+
+/**
+
+@brief Освобождает карту групп вместе с ключами.
+*/
+static void group_free(GroupMap *map)
+{
+    free(map->slots);
+    while (map->arena)
+    {
+        GroupArena *next = map->arena->next;
+        free(map->arena);
+        map->arena = next;
+    }
+    memset(map, 0, sizeof(*map));
+}
+
+/**
+
+@brief Вливает группы src в dst и освобождает src.
+*/
+static void group_merge(GroupMap *dst, GroupMap *src)
+{
+    for (size_t i = 0; i < src->cap; i++)
+    {
+        GroupEntry *e = &src->slots[i];
+        if (e->hash)
+            group_add(dst, e->key, strlen(e->key), e->files, e->ticks);
+    }
+    group_free(src);
+}
+
+/**
+
+@brief Ключ группы для файла.
+
+@param root_len Длина пути корня, от которого считается глубина.
+
+@return Длина ключа в buf.
+*/
+static size_t group_key(const GroupBy *group, const char *path, size_t root_len, uint32_t uid, char *buf,
+                        size_t size)
+{
+    int n = 0;
+
+    switch (group->kind)
+    {
+    case GROUP_DEPTH:
+    {
+        // Путь относительно корня без имени файла, не глубже depth компонентов
+        const char *rel = path + root_len;
+        while (*rel == '/')
+            rel++;
+        const char *end = rel;
+        for (int level = 0; level < group->depth; level++)
+        {
+            const char *slash = strchr(end == rel ? end : end + 1, '/');
+            if (!slash)
+                break;
+            end = slash;
+        }
+        if (end == rel)
+            n = snprintf(buf, size, ".");
+        else
+            n = snprintf(buf, size, "%.*s", (int)(end - rel), rel);
+        break;
+    }
+    case GROUP_REGEX:
+    {
+#ifndef _WIN32
+        regmatch_t m[2];
+        if (regexec(&group->re, path, 2, m, 0) == 0)
+        {
+            const regmatch_t *hit = group->re.re_nsub >= 1 && m[1].rm_so >= 0 ? &m[1] : &m[0];
+            n = snprintf(buf, size, "%.*s", (int)(hit->rm_eo - hit->rm_so), path + hit->rm_so);
+        }
+        else
+#endif
+            n = snprintf(buf, size, "(unmatched)");
+        break;
+    }
+    case GROUP_UID:
+        n = snprintf(buf, size, "%u", uid);
+        break;
+    default:
+        break;
+    }
+    if (n < 0)
+        return 0;
+    return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+/**
+
+@brief Настраивает итоги потока по опциям.
+*/
+static void tally_init(FileTally *tally, const Options *opts)
+{
+    memset(tally, 0, sizeof(*tally));
+    rank_init(&tally->top, opts->top_n, 1);
+    rank_init(&tally->bottom, opts->bottom_n, 0);
+    if (opts->sketch)
+        tally->dist.sketch = calloc(1, sizeof(*tally->dist.sketch));
+    tally->group = &opts->group;
+}
+
+/**
+
+@brief Учитывает разобранный файл в итогах потока.
+*/
+static void tally_add(FileTally *tally, uint64_t ticks, const char *path, size_t root_len, uint32_t uid)
+{
+    dist_record(&tally->dist, ticks);
+    if (tally->group->kind != GROUP_NONE)
+    {
+        char key[PATH_MAX];
+        size_t len = group_key(tally->group, path, root_len, uid, key, sizeof(key));
+        group_add(&tally->groups, key, len, 1, ticks);
+    }
+    rank_offer(&tally->top, ticks, (char *)path, 0);
+    rank_offer(&tally->bottom, ticks, (char *)path, 0);
+}
+
+/**
+
+@brief Переносит итоги потока src в общие dst.
+*/
+static void tally_merge(FileTally *dst, FileTally *src)
+{
+    dist_merge(&dst->dist, &src->dist);
+    group_merge(&dst->groups, &src->groups);
+    rank_merge(&dst->top, &src->top);
+    rank_merge(&dst->bottom, &src->bottom);
+}
+
+/**
+
+@brief Освобождает итоги по файлам.
+*/
+static void tally_free(FileTally *tally)
+{
+    rank_free(&tally->top);
+    rank_free(&tally->bottom);
+    free(tally->dist.sketch);
+    tally->dist.sketch = NULL;
+    group_free(&tally->groups);
+}
+
+/**
+
+@brief Опции, от которых зависит содержимое поддеревьев в журнале --checkpoint.
+
+Строка сравнивается при продолжении целиком, поэтому правила хранятся с
+длиной: «[5]*.tmp». Опции вывода (-v, --top, --group-by и т. п.) в неё
+не входят — они не меняют, какие файлы и папки засчитаны.
+
+@return Строка в куче или NULL при нехватке памяти.
+*/
+static char *checkpoint_fingerprint(const Options *opts)
+{
+    size_t size = 192;
+    for (size_t i = 0; i < opts->nmatch_rules; i++)
+        size += strlen(opts->match_rules[i]) + 24;
+    char *fp = malloc(size);
+    if (!fp)
+        return NULL;
+    size_t n = (size_t)snprintf(fp, size, "%s%s%s%s%s shard=%d/%d depth=%d model=", opts->follow_symlinks ? "-L" : "-P",
+                                opts->one_file_system ? " -x" : "", opts->nofollow ? " --nofollow" : "",
+                                opts->dedupe_hardlinks ? " --dedupe-hardlinks" : "",
+                                opts->no_scanignore ? " --no-scanignore" : "", opts->shard_count ? opts->shard_index : 0,
+                                opts->shard_count ? opts->shard_count : 1, opts->shard_depth);
+    if (opts->bitrate_model)
+        n += (size_t)snprintf(fp + n, size - n, "%g", opts->model_tolerance);
+    else
+        n += (size_t)snprintf(fp + n, size - n, "off");
+    n += (size_t)snprintf(fp + n, size - n, " rules=%zu", opts->nmatch_rules);
+    for (size_t i = 0; i < opts->nmatch_rules; i++)
+        n += (size_t)snprintf(fp + n, size - n, " [%zu]%s", strlen(opts->match_rules[i]), opts->match_rules[i]);
+    return fp;
+}
+
+/**
+
+@brief Читает строку записи журнала длиной len и завершающий перевод строки.
+
+@return 1 при успехе; строка лежит в *buf с нулём в конце.
+*/
+static int journal_read_text(FILE *f, char **buf, size_t *buf_size, size_t len)
+{
+    if (len + 1 > *buf_size)
+    {
+        char *grown = realloc(*buf, len + 1);
+        if (!grown)
+            return 0;
+        *buf = grown;
+        *buf_size = len + 1;
+    }
+    if (fread(*buf, 1, len, f) != len || getc(f) != '\n')
+        return 0;
+    (*buf)[len] = '\0';
+    return 1;
+}
+
+/**
+
+@brief Сверяет заголовок журнала с корнями и опциями этого запуска.
+
+Заголовок: «R длина путь» на каждый корень и «O длина опции» (см.
+checkpoint_fingerprint()). Журнал другого дерева или других правил
+засчитал бы не те поддеревья, поэтому продолжать по нему нельзя.
+
+@return 1, если журнал подходит.
+*/
+static int checkpoint_check_header(WalkState *ws, FILE *f, const char *path, const char *fp)
+{
+    char *buf = NULL;
+    size_t buf_size = 0, len;
+    int ok = 1;
+    for (int r = 0; ok && r < ws->nroots; r++)
+        ok = fscanf(f, "R %zu", &len) == 1 && getc(f) == ' ' && journal_read_text(f, &buf, &buf_size, len) &&
+             strcmp(buf, ws->roots[r].path) == 0;
+    // Лишний корень в журнале — тоже другое дерево
+    int c = getc(f);
+    if (c == 'R')
+        ok = 0;
+    else if (c != EOF)
+        ungetc(c, f);
+    if (!ok)
+    {
+        fprintf(stderr, "%s: checkpoint journal was written for other folders\n", path);
+        free(buf);
+        return 0;
+    }
+    int have = fscanf(f, "O %zu", &len) == 1 && getc(f) == ' ' && journal_read_text(f, &buf, &buf_size, len);
+    if (!have || strcmp(buf, fp) != 0)
+    {
+        fprintf(stderr, "%s: checkpoint journal was written with other options\n  journal: %s\n  this run: %s\n", path,
+                have ? buf : "(damaged)", fp);
+        free(buf);
+        return 0;
+    }
+    free(buf);
+    return 1;
+}
+
+/**
+
+@struct JournalRecord
+
+@brief Запись журнала --checkpoint: тип, числа и длина пути.
+*/
+typedef struct
+{
+    int tag;                 /**< 'D', 'F', 'S' или 'H' */
+    int count;               /**< Количество чисел */
+    unsigned long long v[6]; /**< Числа записи по порядку */
+    size_t len;              /**< Длина пути */
+} JournalRecord;
+
+/**
+
+@brief Читает запись журнала; путь попадает в *buf.
+
+@return 1, если запись прочитана целиком.
+*/
+static int journal_read_record(FILE *f, JournalRecord *rec, char **buf, size_t *buf_size)
+{
+    rec->tag = getc(f);
+    rec->count = rec->tag == 'D' ? 6 : rec->tag == 'F' ? 3 : rec->tag == 'S' || rec->tag == 'H' ? 2 : 0;
+    if (rec->count == 0)
+        return 0;
+    for (int i = 0; i < rec->count; i++)
+        if (getc(f) != ' ' || fscanf(f, "%llu", &rec->v[i]) != 1)
+            return 0;
+    return getc(f) == ' ' && fscanf(f, "%zu", &rec->len) == 1 && getc(f) == ' ' &&
+           journal_read_text(f, buf, buf_size, rec->len);
+}
+
+/**
+
+@brief Записывает начало журнала: версию, корни и опции.
+*/
+static void checkpoint_write_header(const WalkState *ws, FILE *f, const char *fp)
+{
+    fputs(CHECKPOINT_MAGIC, f);
+    for (int r = 0; r < ws->nroots; r++)
+        fprintf(f, "R %zu %s\n", ws->roots[r].path_len, ws->roots[r].path);
+    fprintf(f, "O %zu %s\n", strlen(fp), fp);
+}
+
+/**
+
+@brief Завершена ли папка файла в прошлом запуске.
+*/
+static int checkpoint_file_done(const WalkState *ws, const char *path, size_t len)
+{
+    while (len > 0 && path[len - 1] != '/')
+        len--;
+    return len > 0 && group_find(&ws->done_dirs, path, len - 1) != NULL;
+}
+
+/**
+
+@brief Применяет запись журнала и решает, оставить ли её.
+
+Итоги поддеревьев из записей D засчитываются при обходе
+(checkpoint_resume()); здесь восстанавливается то, что обход пропущенной
+папки дал бы помимо итогов: строки папок для --partial, файлы для
+--top, гистограммы и групп, элементы множеств папок и жёстких ссылок.
+Записи F, S и H папок, не завершённых в прошлом запуске, отбрасываются:
+эти папки будут обойдены заново и запишут их снова.
+
+@return 1, если запись относится к завершённой папке.
+*/
+static int checkpoint_replay(WalkState *ws, const JournalRecord *rec, const char *path)
+{
+    switch (rec->tag)
+    {
+    case 'D':
+        if (ws->folders.active && rec->v[4] > 0)
+            folder_sink_add(ws, path, rec->v[4], rec->v[5]);
+        return 1;
+    case 'F':
+        if (!checkpoint_file_done(ws, path, rec->len) || rec->v[0] >= (unsigned long long)ws->nroots)
+            return 0;
+        tally_add(&ws->tally, rec->v[1], path, ws->roots[rec->v[0]].path_len, (uint32_t)rec->v[2]);
+        return 1;
+    case 'S':
+        if (!group_find(&ws->done_dirs, path, rec->len))
+            return 0;
+        if (!ws->seen_dirs && !(ws->seen_dirs = devino_set_new()))
+            return 1;
+        devino_insert(ws->seen_dirs, rec->v[0], rec->v[1]);
+        return 1;
+    default:
+        if (!checkpoint_file_done(ws, path, rec->len))
+            return 0;
+        if (ws->seen_files)
+            devino_insert(ws->seen_files, rec->v[0], rec->v[1]);
+        return 1;
+    }
+}
+
+/**
+
+@brief Читает журнал --checkpoint и открывает его на дозапись.
+
+Новый журнал начинается с корней и опций запуска; существующий
+принимается, только если они совпадают. Журнал читается дважды: сначала
+собираются завершённые папки, затем применяются записи, которые к ним
+относятся (checkpoint_replay()). Применённые записи переписываются в
+новый журнал, который заменяет старый через rename(): так в нём не
+остаются записи незавершённых папок и запись, оборванная аварийным
+завершением. Повторная запись о той же папке заменяет прежнюю.
+
+@return 1 при успехе, 0 если журнал не открыть, это не журнал или он
+записан для других корней или опций.
+*/
+static int checkpoint_open(WalkState *ws, const char *path)
+{
+    char *fp = checkpoint_fingerprint(ws->opts);
+    if (!fp)
+        return 0;
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        if (errno != ENOENT || !(f = fopen(path, "wb")))
+        {
+            perror(path);
+            free(fp);
+            return 0;
+        }
+        checkpoint_write_header(ws, f, fp);
+        free(fp);
+        ws->journal = f;
+        track_handle(1);
+        checkpoint_sync(ws);
+        return 1;
+    }
+
+    char magic[sizeof(CHECKPOINT_MAGIC)] = "";
+    if (!fgets(magic, sizeof(magic), f) || strcmp(magic, CHECKPOINT_MAGIC) != 0)
+    {
+        if (strncmp(magic, CHECKPOINT_MAGIC_PREFIX, strlen(CHECKPOINT_MAGIC_PREFIX)) == 0)
+            fprintf(stderr, "%s: checkpoint journal of another version, start a new one\n", path);
+        else
+            fprintf(stderr, "%s: not a checkpoint journal\n", path);
+        free(fp);
+        fclose(f);
+        return 0;
+    }
+    if (!checkpoint_check_header(ws, f, path, fp))
+    {
+        free(fp);
+        fclose(f);
+        return 0;
+    }
+
+    long start = ftell(f), good = start;
+    JournalRecord rec;
+    char *buf = NULL;
+    size_t buf_size = 0;
+    while (journal_read_record(f, &rec, &buf, &buf_size))
+    {
+        if (rec.tag == 'D')
+        {
+            GroupEntry *e = group_add(&ws->done_dirs, buf, rec.len, 0, 0);
+            if (e)
+            {
+                e->root = (int)rec.v[0];
+                e->files = rec.v[1];
+                e->ticks = rec.v[2];
+                e->folders = rec.v[3];
+            }
+        }
+        good = ftell(f);
+    }
+
+    char tmp[PATH_MAX];
+    FILE *out = NULL;
+    int ok = (size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) < sizeof(tmp) && (out = fopen(tmp, "wb")) != NULL &&
+             fseek(f, start, SEEK_SET) == 0;
+    if (ok)
+    {
+        checkpoint_write_header(ws, out, fp);
+        while (ftell(f) < good && journal_read_record(f, &rec, &buf, &buf_size))
+        {
+            if (!checkpoint_replay(ws, &rec, buf))
+                continue;
+            fputc(rec.tag, out);
+            for (int i = 0; i < rec.count; i++)
+                fprintf(out, " %llu", rec.v[i]);
+            fprintf(out, " %zu ", rec.len);
+            fwrite(buf, 1, rec.len, out);
+            fputc('\n', out);
+        }
+        ok = fflush(out) == 0 && !ferror(out);
+#ifndef _WIN32
+        ok = ok && fsync(fileno(out)) == 0;
+#endif
+    }
+    free(buf);
+    free(fp);
+    fclose(f);
+    if (out && fclose(out) != 0)
+        ok = 0;
+#ifdef _WIN32
+    if (ok)
+        remove(path);
+#endif
+    if (!ok || rename(tmp, path) != 0 || !(f = fopen(path, "ab")))
+    {
+        perror(out ? tmp : path);
+        if (out)
+            remove(tmp);
+        return 0;
+    }
+    ws->journal = f;
+    track_handle(1);
+    ws->journal_synced_ns = now_ns();
+    return 1;
+}
+
+/**
+
+@brief Пропускает папку, поддерево которой завершено в прошлом запуске.
+
+Итоги поддерева из журнала засчитываются общему итогу, корню и
+родителю так же, как если бы папка была обойдена заново.
+
+@param parent Родительская папка или NULL для корня.
+
+@return 1, если папка есть в журнале и обходить её не нужно.
+*/
+static int checkpoint_resume(WalkState *ws, DirNode *parent, int root, const char *path, size_t len)
+{
+    // Тот же путь встречается под другим корнем, только если корни
+    // пересекаются: это повтор, который отсеет множество пройденных папок
+    const GroupEntry *e = group_find(&ws->done_dirs, path, len);
+    if (!e || e->root != root)
+        return 0;
+    ws->stats->total_files += e->files;
+    ws->stats->total_ticks += e->ticks;
+    ws->stats->total_folders_with_mp4 += e->folders;
+    ws->roots[root].files += e->files;
+    ws->roots[root].ticks += e->ticks;
+    ws->roots[root].folders += e->folders;
+    if (parent)
+    {
+        parent->subtree_files += e->files;
+        parent->subtree_ticks += e->ticks;
+        parent->subtree_folders += e->folders;
+    }
+    ws->resumed_dirs++;
+    return 1;
+}
+
+/**
+
+@brief Часть, которой принадлежит путь при --shard.
+
+Хэшируется путь относительно корня, поэтому хосты, смонтировавшие
+хранилище в разные места, делят дерево одинаково.
+*/
+static int shard_of(const WalkState *ws, int root, const char *path)
+{
+    size_t root_len = ws->roots[root].path_len;
+    const char *rel = strlen(path) >= root_len ? path + root_len : path;
+    while (*rel == '/')
+        rel++;
+    return (int)(group_hash(rel, strlen(rel)) % (uint64_t)ws->opts->shard_count);
+}
+
+/**
+
+@brief Делятся ли подпапки папки между частями.
+
+С --shard-depth D делятся папки глубины D; выше неё дерево обходят все
+части. Без неё папка делится, когда подпапок достаточно, чтобы
+раскидать их по частям равномерно: так перекос верхних уровней (пара
+папок по годам) не отдаёт всё одной части, и решение зависит только от
+самого дерева, одинакового для всех хостов.
+*/
+static int shard_splits(const WalkState *ws, const DirNode *node)
+{
+    if (node->shard_owned)
+        return 0;
+    if (ws->opts->shard_depth > 0)
+        return node->depth + 1 == ws->opts->shard_depth;
+    return node->subdirs >= (long)SHARD_AUTO_FANOUT * ws->opts->shard_count;
+}
+
+/**
+
+@brief Разбирает ли своя часть MP4-файлы непосредственно в папке.
+
+Папки, которые обходят все части, раздают свои файлы по хэшу пути.
+*/
+static int shard_owns_files(const WalkState *ws, const DirNode *node)
+{
+    return !ws->opts->shard_count || node->shard_owned || shard_of(ws, node->root, node->path) == ws->opts->shard_index;
+}
+
+/**
+
+@brief Записывает изменение предела в историю устройства.
+*/
+static void device_record_limit(DeviceQueue *dq, uint64_t at_ns, double rate, double latency_us)
+{
+    if (dq->timeline_len == ADAPTIVE_TIMELINE_MAX)
+    {
+        dq->timeline_dropped++;
+        return;
+    }
+    if (!dq->timeline && !(dq->timeline = malloc(ADAPTIVE_TIMELINE_MAX * sizeof(*dq->timeline))))
+        return;
+    AdaptPoint *point = &dq->timeline[dq->timeline_len++];
+    point->at_ns = at_ns;
+    point->limit = dq->limit;
+    point->rate = rate;
+    point->latency_us = latency_us;
+}
+
+/**
+
+@brief Регулятор AIMD: подстраивает предел потоков устройства по итогам окна.
+
+Окно учитывается, только если предел был упором (все разрешённые потоки
+заняты). Пока скорость не падает, предел растёт: вдвое до первого спада, затем на единицу. Если
+скорость упала или задержка выросла больше чем в ADAPTIVE_LATENCY_SLACK
+раз от лучшей без прироста скорости, устройство перегружено и предел
+уменьшается на четверть. Так предел держится у колена кривой
+пропускной способности: NFS доходит до десятков потоков, HDD — до
+одного-двух. Вызывается под блокировкой пула.
+
+@param taken Файлов в только что разобранной пачке.
+@param busy_ns Время разбора пачки.
+*/
+static void device_adapt(ParsePool *pool, DeviceQueue *dq, size_t taken, uint64_t busy_ns, uint64_t now)
+{
+    dq->win_files += taken;
+    dq->win_lat_ns += busy_ns;
+    // Пачки завершаются не по порядку: конец пачки может оказаться раньше
+    // начала окна, открытого другим потоком
+    if (now < dq->win_start_ns + ADAPTIVE_WINDOW_NS)
+        return;
+
+    double rate = (double)dq->win_files * 1e9 / (double)(now - dq->win_start_ns);
+    double latency_us = (double)dq->win_lat_ns / 1e3 / (double)dq->win_files;
+    int saturated = dq->win_max_active >= dq->limit;
+    int limit = dq->limit;
+
+    if (dq->min_latency_us == 0.0 || latency_us < dq->min_latency_us)
+        dq->min_latency_us = latency_us;
+    // Если потоки не упирались в предел, скорость ограничивал обход, а не
+    // устройство, и окно ничего не говорит о пределе
+    if (!saturated)
+        ;
+    else if (dq->prev_rate > 0.0 && (rate < dq->prev_rate * 0.9 ||
+                                     (latency_us > dq->min_latency_us * ADAPTIVE_LATENCY_SLACK &&
+                                      rate < dq->prev_rate * 1.05)))
+    {
+        limit = limit * 3 / 4;
+        if (limit < 1)
+            limit = 1;
+        dq->backed_off = 1;
+    }
+    else
+        limit = dq->backed_off ? limit + 1 : limit * 2;
+    if (limit > pool->nthreads)
+        limit = pool->nthreads;
+
+    if (limit != dq->limit)
+    {
+        dq->limit = limit;
+        device_record_limit(dq, now, rate, latency_us);
+    }
+    dq->prev_rate = rate;
+    dq->win_start_ns = now;
+    dq->win_files = 0;
+    dq->win_lat_ns = 0;
+    dq->win_max_active = dq->active;
+}
+
+/**
+
+@brief Выбирает очередь устройства, из которой можно взять задания.
+
+Очереди просматриваются по кругу, начиная со следующей после последней
+выбранной, и пропускаются очереди, исчерпавшие предел потоков.
+Вызывается под блокировкой пула.
+*/
+static DeviceQueue *pool_pick_device(ParsePool *pool)
+{
+    for (size_t k = 0; k < pool->ndevices; k++)
+    {
+        size_t i = (pool->next_device + k) % pool->ndevices;
+        DeviceQueue *dq = &pool->devices[i];
+        if (dq->head && dq->active < dq->limit)
+        {
+            pool->next_device = i + 1;
+            return dq;
+        }
+    }
+    return NULL;
+}
+
+/**
+
+@brief Рабочий поток пула: разбирает задания пачками.
+*/
+static void *pool_worker(void *arg)
+{
+    PoolWorker *worker = arg;
+    ParsePool *pool = worker->pool;
+
+    if (pool->opts->idle)
+        enter_idle_priority(1);
+
+    for (;;)
+    {
+        DeviceQueue *dq;
+        pthread_mutex_lock(&pool->lock);
+        while (!(dq = pool_pick_device(pool)) && !(pool->stop && pool->queued == 0))
+            pthread_cond_wait(&pool->has_work, &pool->lock);
+        if (!dq)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        ParseJob *batch = dq->head, *last = batch;
+        size_t taken = 1;
+        for (; taken < POOL_BATCH && last->next; taken++)
+            last = last->next;
+        dq->head = last->next;
+        if (!dq->head)
+            dq->tail = NULL;
+        last->next = NULL;
+        dq->queued -= taken;
+        pool->queued -= taken;
+        dq->active++;
+        if (dq->active > dq->win_max_active)
+            dq->win_max_active = dq->active;
+        uint64_t dev = dq->dev;
+        pthread_mutex_unlock(&pool->lock);
+
+        ThreadStats *ts = thread_stats();
+        uint64_t bytes_before = ts->bytes_read;
+        uint64_t started = now_ns();
+        for (ParseJob *job = batch; job; job = job->next)
+        {
+            job->result = get_mp4_duration(job->path, job->dev, pool->opts);
+            if (job->result.found)
+                tally_add(&worker->tally, job->result.ticks, job->path, job->root_len, job->uid);
+        }
+        uint64_t finished = now_ns();
+
+        pthread_mutex_lock(&pool->lock);
+        // Массив очередей мог быть перевыделен, пока шёл разбор
+        for (size_t i = 0; i < pool->ndevices; i++)
+        {
+            dq = &pool->devices[i];
+            if (dq->dev != dev)
+                continue;
+            dq->active--;
+            dq->files += taken;
+            dq->bytes += ts->bytes_read - bytes_before;
+            dq->busy_ns += finished - started;
+            if (!dq->first_ns || started < dq->first_ns)
+                dq->first_ns = started;
+            if (finished > dq->last_ns)
+                dq->last_ns = finished;
+            if (pool->opts->adaptive)
+                device_adapt(pool, dq, taken, finished - started, finished);
+            break;
+        }
+        last->next = pool->done;
+        pool->done = batch;
+        pthread_cond_signal(&pool->has_done);
+        // Освободилось место в пределе устройства
+        pthread_cond_broadcast(&pool->has_work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+
+@brief Имя устройства для сообщений и --stats: «major:minor», а где их нет — номер.
+*/
+static void format_dev(uint64_t dev, char *buf, size_t size)
+{
+#ifndef _WIN32
+    snprintf(buf, size, "%u:%u", major((dev_t)dev), minor((dev_t)dev));
+#else
+    snprintf(buf, size, "%llu", (unsigned long long)dev);
+#endif
+}
+
+/**
+
+@brief Вращающийся ли диск у устройства (по /sys/dev/block).
+
+@return 1 — HDD, 0 — SSD/NVMe, -1 — неизвестно (сетевые и виртуальные ФС).
+*/
+static int device_rotational(uint64_t dev)
+{
+#ifdef __linux__
+    static const char *const paths[] = {"/sys/dev/block/%u:%u/queue/rotational",
+                                        "/sys/dev/block/%u:%u/../queue/rotational"};
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+    {
+        char path[96];
+        snprintf(path, sizeof(path), paths[i], major((dev_t)dev), minor((dev_t)dev));
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        track_handle(1);
+        int value = -1;
+        if (fscanf(f, "%d", &value) != 1)
+            value = -1;
+        fclose(f);
+        track_handle(-1);
+        if (value >= 0)
+            return value != 0;
+    }
+#else
+    (void)dev;
+#endif
+    return -1;
+}
+
+/**
+
+@brief Очередь устройства dev; создаётся при первом файле с устройства.
+
+Вызывается под блокировкой пула.
+*/
+static DeviceQueue *pool_device(ParsePool *pool, uint64_t dev)
+{
+    for (size_t i = 0; i < pool->ndevices; i++)
+        if (pool->devices[i].dev == dev)
+            return &pool->devices[i];
+
+    DeviceQueue *devices = realloc(pool->devices, (pool->ndevices + 1) * sizeof(*devices));
+    if (!devices)
+        return NULL;
+    pool->devices = devices;
+    DeviceQueue *dq = &devices[pool->ndevices++];
+    memset(dq, 0, sizeof(*dq));
+    dq->dev = dev;
+    dq->rotational = device_rotational(dev);
+    if (pool->opts->device_jobs > 0)
+        dq->limit = pool->opts->device_jobs;
+    else if (pool->opts->adaptive)
+        dq->limit = ADAPTIVE_START_JOBS;
+    else
+        dq->limit = dq->rotational == 1 ? ROTATIONAL_DEVICE_JOBS : pool->nthreads;
+    if (dq->limit > pool->nthreads)
+        dq->limit = pool->nthreads;
+    // Предел HDD по умолчанию ниже -j: не молча, а с подсказкой, как его снять
+    if (pool->opts->device_jobs <= 0 && !pool->opts->adaptive && dq->limit < pool->nthreads)
+    {
+        char name[24];
+        format_dev(dev, name, sizeof(name));
+        fprintf(stderr, "Device %s is rotational: parsing at most %d of %d files at once (--device-jobs N to change)\n",
+                name, dq->limit, pool->nthreads);
+    }
+    if (pool->opts->adaptive)
+    {
+        dq->win_start_ns = now_ns();
+        device_record_limit(dq, dq->win_start_ns, 0.0, 0.0);
+    }
+    return dq;
+}
+
+/**
+
+@brief Создаёт пул из nthreads рабочих потоков.
+*/
+static ParsePool *pool_create(int nthreads, const Options *opts)
+{
+    ParsePool *pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->workers = calloc((size_t)nthreads, sizeof(*pool->workers));
+    if (!pool->workers)
+    {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    pthread_cond_init(&pool->has_done, NULL);
+    pool->opts = opts;
+    for (int i = 0; i < nthreads; i++)
+    {
+        PoolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        tally_init(&worker->tally, opts);
+        if (pthread_create(&worker->thread, NULL, pool_worker, worker) != 0)
+            break;
+        pool->nthreads++;
+    }
+    if (pool->nthreads == 0)
+    {
+        free(pool->workers);
+        free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/**
+
+@brief Останавливает рабочие потоки, сливает их итоги по файлам в общие,
+забирает статистику устройств и освобождает пул.
+*/
+static void pool_destroy(WalkState *ws)
+{
+    ParsePool *pool = ws->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->nthreads; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+        tally_merge(&ws->tally, &pool->workers[i].tally);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->has_work);
+    pthread_cond_destroy(&pool->has_done);
+    free(ws->devices);
+    ws->devices = pool->devices;
+    ws->ndevices = pool->ndevices;
+    free(pool->workers);
+    free(pool);
+    ws->pool = NULL;
+}
+
+/**
+
+@brief Раскладывает накопленную пачку заданий по очередям устройств.
+*/
+static void pool_flush(WalkState *ws)
+{
+    if (!ws->batch)
+        return;
+    ParsePool *pool = ws->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    ParseJob *job = ws->batch;
+    DeviceQueue *dq = NULL;
+    while (job)
+    {
+        ParseJob *next = job->next;
+        if (!dq || dq->dev != job->dev)
+            dq = pool_device(pool, job->dev);
+        if (!dq)
+            dq = &pool->devices[0];
+        job->next = NULL;
+        if (dq->tail)
+            dq->tail->next = job;
+        else
+            dq->head = job;
+        dq->tail = job;
+        dq->queued++;
+        if (dq->queued > dq->max_queued)
+            dq->max_queued = dq->queued;
+        dq->depth_sum += dq->queued;
+        dq->depth_samples++;
+        job = next;
+    }
+    pool->queued += (size_t)ws->batch_len;
+    pool->in_flight += (size_t)ws->batch_len;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->lock);
+
+    ws->batch = NULL;
+    ws->batch_len = 0;
+}
+
+/**
+
+@brief Добавляет задание разбора файла в пачку пула.
+
+@return Задание (его ещё можно дополнить до pool_flush) или NULL, если
+не хватило памяти: файл тогда считается потерянным.
+*/
+static ParseJob *pool_job(WalkState *ws, DirNode *node, const char *path, uint32_t uid, uint64_t dev)
+{
+    size_t len = strlen(path);
+    ParseJob *job = malloc(sizeof(*job) + len + 1);
+    if (!job)
+    {
+        ws->lost_entries++;
+        return NULL;
+    }
+    job->node = node;
+    job->uid = uid;
+    job->root_len = ws->roots[node->root].path_len;
+    job->dev = dev;
+    job->model = NULL;
+    job->sample = 0;
+    memcpy(job->path, path, len + 1);
+    job->next = ws->batch;
+    ws->batch = job;
+    ws->batch_len++;
+    node->files_pending++;
+    return job;
+}
+
+/**
+
+@brief Разбор MP4-файла папки в потоке обхода.
+*/
+static MP4Duration parse_file_now(WalkState *ws, DirNode *node, const char *path, uint32_t uid, uint64_t dev)
+{
+    MP4Duration d = get_mp4_duration(path, dev, ws->opts);
+    account_file(ws, node, &d);
+    if (d.found)
+    {
+        tally_add(&ws->tally, d.ticks, path, ws->roots[node->root].path_len, uid);
+        if (ws->journal)
+            checkpoint_file(ws, node->root, d.ticks, uid, path);
+    }
+    return d;
+}
+
+/**
+
+@brief Решение модели битрейта, когда обучающие и проверочные файлы папки разобраны.
+
+Если битрейт обучающих файлов расходится больше чем на допуск, папка
+разбирается целиком. Иначе проверочные файлы сравниваются с моделью:
+разошедшийся файл считается выбросом, а больше MODEL_MAX_MISSES
+расхождений отменяют модель для всей папки. Файлы вне диапазона
+размеров тоже разбираются. Остальным длительность назначается как
+размер, делённый на битрейт. Такие длительности входят в итоги, но не в
+--top, --bottom, распределение и группы --group-by: там только
+разобранные файлы.
+
+Вызывается и из pool_drain, поэтому новые задания только добавляются в
+пачку, а не ставятся с ожиданием места в пуле.
+*/
+static void model_finish(WalkState *ws, ModelDir *md)
+{
+    ModelStats *ms = &ws->model;
+    DirNode *node = md->node;
+    SizedFile *files = md->files;
+    double tol = ws->opts->model_tolerance;
+    double bytes = 0, secs = 0, rates[MODEL_TRAIN];
+    unsigned trained = 0;
+    int fit = 1, misses = 0;
+
+    for (size_t i = 0; i < md->n; i++)
+    {
+        SizedFile *f = &files[i];
+        if (f->role != MODEL_TRAINING)
+            continue;
+        if (!f->result.found || f->result.ticks == 0)
+        {
+            fit = 0;
+            continue;
+        }
+        rates[trained++] = (double)f->size * TICKS_PER_SECOND / (double)f->result.ticks;
+        bytes += (double)f->size;
+        secs += (double)f->result.ticks / TICKS_PER_SECOND;
+    }
+    double rate = fit ? bytes / secs : 0;
+    for (unsigned k = 0; fit && k < trained; k++)
+        if (fabs(rates[k] / rate - 1) > tol)
+            fit = 0;
+
+    for (size_t i = 0; fit && i < md->n; i++)
+    {
+        SizedFile *f = &files[i];
+        if (f->role != MODEL_SPOT)
+            continue;
+        double predicted = (double)f->size / rate;
+        double actual = (double)f->result.ticks / TICKS_PER_SECOND;
+        if (!f->result.found || fabs(actual / predicted - 1) > tol)
+        {
+            ms->outliers++;
+            if (++misses > MODEL_MAX_MISSES)
+                fit = 0;
+            continue;
+        }
+        bytes += (double)f->size;
+        secs += actual;
+    }
+    if (fit)
+    {
+        ms->fitted++;
+        rate = bytes / secs;
+    }
+
+    for (size_t i = 0; i < md->n; i++)
+    {
+        SizedFile *f = &files[i];
+        if (f->role != MODEL_PENDING)
+            continue;
+        if (!fit || (double)f->size < md->lo || (double)f->size > md->hi)
+        {
+            if (fit)
+                ms->outliers++;
+            else
+                ms->unfit++;
+            if (ws->pool)
+                pool_job(ws, node, f->path, f->uid, f->dev);
+            else
+                parse_file_now(ws, node, f->path, f->uid, f->dev);
+            continue;
+        }
+        MP4Duration d = {0};
+        d.found = 1;
+        d.ticks = (uint64_t)llround((double)f->size / rate * TICKS_PER_SECOND);
+        d.duration_seconds = (double)d.ticks / TICKS_PER_SECOND;
+        account_file(ws, node, &d);
+        ms->estimated++;
+    }
+
+    for (size_t i = 0; i < md->n; i++)
+        free(files[i].path);
+    free(files);
+    free(md);
+}
+
+/**
+
+@brief Забирает готовые задания и учитывает их результаты.
+
+@param wait_for Сколько заданий в полёте допустимо оставить: координатор
+ждёт, пока их станет не больше этого числа.
+*/
+static void pool_drain(WalkState *ws, size_t wait_for)
+{
+    ParsePool *pool = ws->pool;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->done && pool->in_flight > wait_for)
+            pthread_cond_wait(&pool->has_done, &pool->lock);
+        ParseJob *done = pool->done;
+        pool->done = NULL;
+        size_t count = 0;
+        for (ParseJob *job = done; job; job = job->next)
+            count++;
+        pool->in_flight -= count;
+        size_t left = pool->in_flight;
+        pthread_mutex_unlock(&pool->lock);
+
+        while (done)
+        {
+            ParseJob *job = done;
+            done = job->next;
+            DirNode *node = job->node;
+            account_file(ws, node, &job->result);
+            if (ws->journal && job->result.found)
+                checkpoint_file(ws, node->root, job->result.ticks, job->uid, job->path);
+            // Решение модели может поставить файлы папки на разбор, поэтому
+            // оно принимается раньше, чем папка проверяется на завершение
+            if (job->model)
+            {
+                job->model->files[job->sample].result = job->result;
+                if (--job->model->pending == 0)
+                    model_finish(ws, job->model);
+            }
+            if (--node->files_pending == 0 && node->closed && node->children_pending == 0)
+                dir_done(ws, node);
+            free(job);
+        }
+        if (ws->batch)
+        {
+            left += (size_t)ws->batch_len;
+            pool_flush(ws);
+        }
+        if (count == 0 || left <= wait_for)
+            break;
+    }
+}
+
+/**
+
+@brief Раскладывает пачку по очередям, когда она набралась, и ждёт, пока
+заданий в полёте станет не больше окна.
+*/
+static void pool_throttle(WalkState *ws)
+{
+    if (ws->batch_len < POOL_BATCH)
+        return;
+    pool_flush(ws);
+    // Ограничение числа заданий в полёте держит память и буфер
+    // упорядочивания вывода в пределах окна.
+    size_t limit = (size_t)ws->pool->nthreads * POOL_INFLIGHT_PER_THREAD;
+    pool_drain(ws, limit);
+}
+
+/**
+
+@brief Разбор MP4-файла папки: сразу (-j 1) или через пул.
+*/
+static void submit_file(WalkState *ws, DirNode *node, const char *path, uint32_t uid, uint64_t dev)
+{
+    if (!ws->pool)
+    {
+        parse_file_now(ws, node, path, uid, dev);
+        return;
+    }
+    pool_job(ws, node, path, uid, dev);
+    pool_throttle(ws);
+}
+
+/**
+
+@brief Генератор псевдослучайных чисел xorshift64* (воспроизводим по seed).
+*/
+static uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+
+@brief Случайное число в диапазоне [0, 1).
+*/
+static double rng_unit(uint64_t *state)
+{
+    return (double)(rng_next(state) >> 11) / 9007199254740992.0;
+}
+
+/**
+
+@brief Память пути в выборке --estimate.
+*/
+static size_t estimate_path_cost(const char *path)
+{
+    return strlen(path) + 1 + sizeof(char *);
+}
+
+/**
+
+@brief Уменьшает на восьмую часть самую большую выборку слоя.
+
+Удаляются случайные пути, поэтому оставшиеся по-прежнему равномерная
+выборка слоя, и резервуар продолжается с новым пределом.
+
+@return 0, если уменьшать больше нечего.
+*/
+static int estimate_shrink(Estimator *est)
+{
+    Stratum *big = NULL;
+    for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+        if (est->strata[h].len > ESTIMATE_PILOT && (!big || est->strata[h].len > big->len))
+            big = &est->strata[h];
+    if (!big)
+        return 0;
+    big->limit = big->len - big->len / 8;
+    while (big->len > big->limit)
+    {
+        size_t j = (size_t)(rng_next(&est->rng) % big->len);
+        est->mem -= estimate_path_cost(big->paths[j]);
+        free(big->paths[j]);
+        big->paths[j] = big->paths[--big->len];
+    }
+    return 1;
+}
+
+/**
+
+@brief Добавляет файл .mp4 в его слой выборки --estimate.
+
+Слой с пределом работает как резервуар (алгоритм R): новый файл заменяет
+случайный путь с вероятностью limit/files, так что выборка остаётся
+равномерной, сколько бы файлов ни встретилось за обход.
+*/
+static void estimate_offer(Estimator *est, const char *path, uint64_t size)
+{
+    Stratum *st = &est->strata[hist_bucket_bits(size, ESTIMATE_SUB_BITS)];
+    size_t slot = st->len;
+
+    est->candidates++;
+    st->files++;
+    if (st->limit && st->len >= st->limit)
+    {
+        uint64_t j = rng_next(&est->rng) % st->files;
+        if (j >= st->limit)
+            return;
+        slot = (size_t)j;
+    }
+    else if (st->len == st->cap)
+    {
+        size_t cap = st->cap ? st->cap * 2 : 64;
+        char **grown = realloc(st->paths, cap * sizeof(*grown));
+        if (!grown)
+            return;
+        st->paths = grown;
+        st->cap = cap;
+    }
+    char *copy = strdup(path);
+    if (!copy)
+        return;
+    if (slot < st->len)
+    {
+        est->mem -= estimate_path_cost(st->paths[slot]);
+        free(st->paths[slot]);
+    }
+    else
+        st->len++;
+    st->paths[slot] = copy;
+    est->mem += estimate_path_cost(copy);
+    while (est->mem > est->mem_budget && estimate_shrink(est))
+        ;
+}
+
+/**
+
+@brief Выборочная дисперсия длительностей слоя (файлы без длительности
+считаются нулевыми).
+*/
+static double stratum_variance(const Stratum *st)
+{
+    if (st->parsed < 2)
+        return 0;
+    double n = (double)st->parsed;
+    double v = (st->sum_sq - st->sum * st->sum / n) / (double)(n - 1);
+    return v > 0 ? v : 0;
+}
+
+/**
+
+@brief Вклад слоя в дисперсию оценки итога: N²(1 − n/N)·s²/n.
+*/
+static double stratum_total_variance(const Stratum *st, double s2)
+{
+    double big_n = (double)st->files, n = (double)st->parsed;
+    return big_n * big_n * (1 - n / big_n) * s2 / n;
+}
+
+/**
+
+@brief Стратифицированные оценки числа файлов и длительности с 95%
+интервалами по уже разобранной выборке.
+*/
+static void estimate_compute(Estimator *est)
+{
+    double files = 0, files_var = 0, seconds = 0, seconds_var = 0;
+
+    for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+    {
+        const Stratum *st = &est->strata[h];
+        if (st->parsed == 0)
+            continue;
+        double n = (double)st->parsed;
+        double p = (double)st->found / n;
+        files += (double)st->files * p;
+        seconds += (double)st->files * st->sum / n;
+        if (st->parsed > 1)
+        {
+            files_var += stratum_total_variance(st, p * (1 - p) * n / (n - 1));
+            seconds_var += stratum_total_variance(st, stratum_variance(st));
+        }
+    }
+    est->files = files;
+    est->files_error = ESTIMATE_Z * sqrt(files_var);
+    est->seconds = seconds;
+    est->seconds_error = ESTIMATE_Z * sqrt(seconds_var);
+}
+
+/**
+
+@brief Достигнутая относительная погрешность оценки длительности.
+*/
+static double estimate_relative_error(const Estimator *est)
+{
+    if (est->seconds > 0)
+        return est->seconds_error / est->seconds;
+    return est->seconds_error > 0 ? INFINITY : 0;
+}
+
+/**
+
+@brief Размеры выборок слоёв для следующего раунда.
+
+Объём, нужный для целевой погрешности, распределяется между слоями
+по Нейману (пропорционально N·s) с поправкой на конечность слоя. За раунд
+выборка слоя растёт не больше чем вдвое, чтобы его разброс уточнялся
+по ходу. Если распределение ничего не добавило, пилотную порцию получает
+слой с наибольшим вкладом в дисперсию.
+*/
+static void estimate_plan(const Estimator *est, double target, size_t *want)
+{
+    double sum_ns = 0, sum_ns2 = 0, worst = 0;
+    int worst_h = -1, added = 0;
+
+    for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+    {
+        const Stratum *st = &est->strata[h];
+        want[h] = st->parsed;
+        if (st->parsed == 0)
+            continue;
+        double s2 = stratum_variance(st);
+        sum_ns += (double)st->files * sqrt(s2);
+        sum_ns2 += (double)st->files * s2;
+        double part = stratum_total_variance(st, s2);
+        if (st->parsed < st->len && part > worst)
+        {
+            worst = part;
+            worst_h = (int)h;
+        }
+    }
+    double v = target * est->seconds / ESTIMATE_Z;
+    double need = sum_ns > 0 ? sum_ns * sum_ns / (v * v + sum_ns2) : 0;
+
+    for (unsigned h = 0; h < ESTIMATE_STRATA && sum_ns > 0; h++)
+    {
+        const Stratum *st = &est->strata[h];
+        if (st->parsed == 0 || st->parsed >= st->len)
+            continue;
+        double goal = ceil(need * (double)st->files * sqrt(stratum_variance(st)) / sum_ns);
+        double cap = (double)st->parsed + (double)(st->parsed > ESTIMATE_PILOT ? st->parsed : ESTIMATE_PILOT);
+        if (goal > cap)
+            goal = cap;
+        if (goal > (double)st->len)
+            goal = (double)st->len;
+        if (goal > (double)st->parsed)
+        {
+            want[h] = (size_t)goal;
+            added = 1;
+        }
+    }
+    if (!added && worst_h >= 0)
+    {
+        const Stratum *st = &est->strata[worst_h];
+        want[worst_h] = st->len - st->parsed > ESTIMATE_PILOT ? st->parsed + ESTIMATE_PILOT : st->len;
+    }
+}
+
+/**
+
+@struct EstimateJob
+
+@brief Файл выборки, разбираемый в раунде --estimate.
+*/
+typedef struct
+{
+    const char *path;  /**< Путь файла */
+    unsigned stratum;  /**< Номер слоя */
+    int found;         /**< Длительность найдена */
+    uint64_t ticks;    /**< Длительность в микросекундах */
+} EstimateJob;
+
+/**
+
+@struct EstimateRound
+
+@brief Раунд разбора выборки: потоки берут задания по порядку.
+*/
+typedef struct
+{
+    EstimateJob *jobs;      /**< Задания раунда */
+    size_t njobs;           /**< Их количество */
+    _Atomic size_t next;    /**< Следующее задание */
+    uint64_t deadline_ns;   /**< Срок, после которого задания не берутся (0 — нет) */
+    const Options *opts;    /**< Опции разбора */
+} EstimateRound;
+
+/**
+
+@brief Разбирает задания раунда, пока они есть и срок не вышел.
+
+Срок проверяется до взятия задания, поэтому каждое взятое задание
+разобрано и разобранные пути каждого слоя остаются началом его выборки.
+*/
+static void estimate_parse(EstimateRound *round)
+{
+    while (!g_interrupted && !(round->deadline_ns && now_ns() >= round->deadline_ns))
+    {
+        size_t i = atomic_fetch_add(&round->next, 1);
+        if (i >= round->njobs)
+            break;
+        MP4Duration d = get_mp4_duration(round->jobs[i].path, 0, round->opts);
+        round->jobs[i].found = d.found;
+        round->jobs[i].ticks = d.ticks;
+    }
+}
+
+static void *estimate_worker(void *arg)
+{
+    EstimateRound *round = arg;
+    if (round->opts->idle)
+        enter_idle_priority(1);
+    estimate_parse(round);
+    return NULL;
+}
+
+/**
+
+@brief Разбирает задания раунда в -j потоках (включая вызывающий).
+
+@return Количество разобранных заданий (их начало в массиве).
+*/
+static size_t estimate_round(EstimateRound *round, int nthreads)
+{
+    pthread_t *threads = NULL;
+    int started = 0;
+
+    if (nthreads > 1 && (size_t)nthreads > round->njobs)
+        nthreads = (int)round->njobs;
+    if (nthreads > 1)
+        threads = calloc((size_t)nthreads - 1, sizeof(*threads));
+    for (int i = 0; threads && i < nthreads - 1; i++)
+        if (pthread_create(&threads[started], NULL, estimate_worker, round) == 0)
+            started++;
+    estimate_parse(round);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    size_t done = atomic_load(&round->next);
+    return done < round->njobs ? done : round->njobs;
+}
+
+/**
+
+@brief Разбор выборки после обхода: пилотный раунд и уточнение до
+целевой погрешности, бюджета времени или конца сохранённых кандидатов.
+
+Бюджет отсчитывается от начала сканирования; пилотный раунд (до
+ESTIMATE_PILOT файлов из каждого слоя) выполняется в любом случае.
+*/
+static void estimate_run(WalkState *ws)
+{
+    Estimator *est = ws->estimate;
+    const Options *opts = ws->opts;
+    uint64_t started = now_ns();
+    uint64_t deadline = opts->estimate_time_ms ? ws->started_ns + (uint64_t)opts->estimate_time_ms * 1000000ull : 0;
+    size_t want[ESTIMATE_STRATA];
+    EstimateJob *jobs = NULL;
+    size_t jobs_cap = 0;
+
+    // Резервуар сохраняет первые файлы слоя в порядке обхода
+    for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+    {
+        Stratum *st = &est->strata[h];
+        for (size_t i = st->len; i > 1; i--)
+        {
+            size_t j = (size_t)(rng_next(&est->rng) % i);
+            char *tmp = st->paths[i - 1];
+            st->paths[i - 1] = st->paths[j];
+            st->paths[j] = tmp;
+        }
+    }
+
+    est->stop = ESTIMATE_EXHAUSTED;
+    for (;;)
+    {
+        if (est->rounds == 0)
+        {
+            for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+                want[h] = est->strata[h].len < ESTIMATE_PILOT ? est->strata[h].len : ESTIMATE_PILOT;
+        }
+        else
+        {
+            estimate_compute(est);
+            if (estimate_relative_error(est) <= opts->estimate_error)
+            {
+                est->stop = ESTIMATE_TARGET;
+                break;
+            }
+            if (deadline && now_ns() >= deadline)
+            {
+                est->stop = ESTIMATE_BUDGET;
+                break;
+            }
+            estimate_plan(est, opts->estimate_error, want);
+        }
+
+        size_t njobs = 0, most = 0;
+        for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+        {
+            size_t extra = want[h] - est->strata[h].parsed;
+            njobs += extra;
+            if (extra > most)
+                most = extra;
+        }
+        if (njobs == 0)
+            break;
+        if (njobs > jobs_cap)
+        {
+            EstimateJob *grown = realloc(jobs, njobs * sizeof(*jobs));
+            if (!grown)
+                break;
+            jobs = grown;
+            jobs_cap = njobs;
+        }
+        // Слои чередуются, чтобы срок обрывал раунд во всех слоях поровну
+        size_t k = 0;
+        for (size_t step = 0; step < most; step++)
+            for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+            {
+                Stratum *st = &est->strata[h];
+                if (st->parsed + step < want[h])
+                {
+                    jobs[k].path = st->paths[st->parsed + step];
+                    jobs[k].stratum = h;
+                    k++;
+                }
+            }
+
+        EstimateRound round = {.jobs = jobs, .njobs = njobs, .deadline_ns = est->rounds ? deadline : 0, .opts = opts};
+        atomic_init(&round.next, 0);
+        size_t done = estimate_round(&round, opts->jobs);
+        for (size_t i = 0; i < done; i++)
+        {
+            Stratum *st = &est->strata[jobs[i].stratum];
+            st->parsed++;
+            if (jobs[i].found)
+            {
+                double x = (double)jobs[i].ticks / TICKS_PER_SECOND;
+                st->found++;
+                st->sum += x;
+                st->sum_sq += x * x;
+            }
+        }
+        est->sampled += done;
+        est->rounds++;
+        if (g_interrupted)
+        {
+            est->stop = ESTIMATE_INTERRUPTED;
+            break;
+        }
+    }
+    free(jobs);
+    estimate_compute(est);
+    est->sample_ns = now_ns() - started;
+}
+
+/**
+
+@brief Освобождает выборку --estimate.
+*/
+static void estimate_free(WalkState *ws)
+{
+    Estimator *est = ws->estimate;
+    if (!est)
+        return;
+    for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+    {
+        for (size_t i = 0; i < est->strata[h].len; i++)
+            free(est->strata[h].paths[i]);
+        free(est->strata[h].paths);
+    }
+    free(est);
+    ws->estimate = NULL;
+}
+
+/**
+
+@brief Сравнение файлов папки по размеру, затем по пути.
+*/
+static int cmp_sized_file(const void *a, const void *b)
+{
+    const SizedFile *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+/**
+
+@brief Ставит обучающий или проверочный файл на разбор: сразу (-j 1) или через пул.
+*/
+static void model_sample(WalkState *ws, ModelDir *md, size_t i)
+{
+    SizedFile *f = &md->files[i];
+    ws->model.parsed++;
+    if (!ws->pool)
+    {
+        f->result = parse_file_now(ws, md->node, f->path, f->uid, f->dev);
+        return;
+    }
+    ParseJob *job = pool_job(ws, md->node, f->path, f->uid, f->dev);
+    if (job)
+    {
+        job->model = md;
+        job->sample = i;
+        md->pending++;
+    }
+    pool_throttle(ws);
+}
+
+/**
+
+@brief Длительность MP4-файлов папки по модели байт в секунду (--bitrate-model).
+
+Файлы сортируются по размеру; MODEL_TRAIN из них на равных расстояниях
+по рангу разбираются, и по ним считается битрейт папки. Для проверки
+разбирается и каждый MODEL_SPOT_EVERY-й из остальных файлов, размер
+которых не выходит за диапазон обучающих больше чем в MODEL_SIZE_RANGE
+раз. Выбор зависит только от размеров, поэтому все эти файлы сразу
+уходят в пул, и обход продолжается, не дожидаясь их; решение по папке
+принимает model_finish. Массив files переходит модели.
+*/
+static void model_dir(WalkState *ws, DirNode *node, SizedFile *files, size_t n)
+{
+    ModelDir *md = n < MODEL_MIN_FILES ? NULL : malloc(sizeof(*md));
+    if (!md)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            submit_file(ws, node, files[i].path, files[i].uid, files[i].dev);
+            free(files[i].path);
+        }
+        free(files);
+        return;
+    }
+    ws->model.dirs++;
+    qsort(files, n, sizeof(*files), cmp_sized_file);
+    md->node = node;
+    md->files = files;
+    md->n = n;
+    md->lo = (double)files[n / (2 * MODEL_TRAIN)].size / MODEL_SIZE_RANGE;
+    md->hi = (double)files[(2 * MODEL_TRAIN - 1) * n / (2 * MODEL_TRAIN)].size * MODEL_SIZE_RANGE;
+    md->pending = 1;
+
+    for (unsigned k = 0; k < MODEL_TRAIN; k++)
+        files[(2 * k + 1) * n / (2 * MODEL_TRAIN)].role = MODEL_TRAINING;
+    size_t seen = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        SizedFile *f = &files[i];
+        if (f->role != MODEL_PENDING || (double)f->size < md->lo || (double)f->size > md->hi)
+            continue;
+        if (seen++ % MODEL_SPOT_EVERY == MODEL_SPOT_EVERY / 2)
+            f->role = MODEL_SPOT;
+    }
+    for (size_t i = 0; i < n; i++)
+        if (files[i].role != MODEL_PENDING)
+            model_sample(ws, md, i);
+    if (--md->pending == 0)
+        model_finish(ws, md);
+}
+
+/**
+
+@brief Добавляет узел шаблона в автомат.
+
+@return Номер узла или UINT32_MAX при нехватке памяти.
+*/
+static uint32_t match_node(Matcher *m, MatchNodeKind kind, uint8_t ch, uint32_t cls)
+{
+    if (m->nnodes == m->nodes_cap)
+    {
+        size_t cap = m->nodes_cap ? m->nodes_cap * 2 : 64;
+        MatchNode *nodes = realloc(m->nodes, cap * sizeof(*nodes));
+        uint32_t *mark = realloc(m->mark, cap * sizeof(*mark));
+        if (nodes)
+            m->nodes = nodes;
+        if (mark)
+        {
+            m->mark = mark;
+            memset(mark + m->nodes_cap, 0, (cap - m->nodes_cap) * sizeof(*mark));
+        }
+        if (!nodes || !mark)
+            return UINT32_MAX;
+        m->nodes_cap = cap;
+    }
+    MatchNode *node = &m->nodes[m->nnodes];
+    node->kind = (uint8_t)kind;
+    node->ch = ch;
+    node->rule = (uint32_t)m->nrules;
+    node->cls = cls;
+    return (uint32_t)m->nnodes++;
+}
+
+/**
+
+@brief Разбор набора символов [...] в шаблоне.
+
+@return Длина набора вместе со скобками или 0, если скобка не закрыта.
+*/
+static size_t match_class(const char *p, size_t n, uint8_t *bits)
+{
+    size_t i = 1;
+    int negate = 0;
+
+    memset(bits, 0, 32);
+    if (i < n && (p[i] == '!' || p[i] == '^'))
+    {
+        negate = 1;
+        i++;
+    }
+    for (size_t first = i; i < n && (p[i] != ']' || i == first); i++)
+    {
+        uint8_t lo = (uint8_t)p[i];
+        if (lo == '\\' && i + 1 < n)
+            lo = (uint8_t)p[++i];
+        uint8_t hi = lo;
+        if (i + 2 < n && p[i + 1] == '-' && p[i + 2] != ']')
+        {
+            i += 2;
+            hi = (uint8_t)p[i];
+            if (hi == '\\' && i + 1 < n)
+                hi = (uint8_t)p[++i];
+        }
+        for (unsigned c = lo; c <= hi; c++)
+            bits[c >> 3] |= (uint8_t)(1u << (c & 7));
+    }
+    if (i >= n)
+        return 0;
+    if (negate)
+        for (unsigned k = 0; k < 32; k++)
+            bits[k] = (uint8_t)~bits[k];
+    bits['/' >> 3] &= (uint8_t) ~(1u << ('/' & 7));
+    return i + 1;
+}
+
+/**
+
+@brief Компилирует строку в синтаксисе .gitignore в правило автомата.
+
+Пустые строки и комментарии (#) пропускаются; ! отрицает правило,
+/ в конце ограничивает его папками. Шаблон без / внутри сравнивается
+с именем на любой глубине, с / — с путём от папки правила.
+
+@param start Номер первого узла правила.
+@return 1 — правило добавлено, 0 — строка не содержит правила, -1 — нет памяти.
+*/
+static int match_compile(Matcher *m, const char *p, size_t n, uint32_t priority, uint32_t *start)
+{
+    MatchRule rule = {priority, 0, 0};
+
+    while (n > 0 && (p[n - 1] == '\r' || (p[n - 1] == ' ' && !(n > 1 && p[n - 2] == '\\'))))
+        n--;
+    if (n == 0 || p[0] == '#')
+        return 0;
+    if (p[0] == '!')
+    {
+        rule.negate = 1;
+        p++;
+        n--;
+    }
+    if (n > 0 && p[n - 1] == '/')
+    {
+        rule.dir_only = 1;
+        n--;
+    }
+    int anchored = n > 0 && memchr(p, '/', n) != NULL;
+    if (n > 0 && p[0] == '/')
+    {
+        p++;
+        n--;
+    }
+    if (n == 0)
+        return 0;
+    if (m->nrules == m->rules_cap)
+    {
+        size_t cap = m->rules_cap ? m->rules_cap * 2 : 16;
+        MatchRule *rules = realloc(m->rules, cap * sizeof(*rules));
+        if (!rules)
+            return -1;
+        m->rules = rules;
+        m->rules_cap = cap;
+    }
+
+    size_t first = m->nnodes;
+    int ok = 1;
+    if (!anchored)
+        ok = match_node(m, MN_DSEG, 0, 0) != UINT32_MAX && match_node(m, MN_DSEG_IN, 0, 0) != UINT32_MAX;
+    for (size_t i = 0; ok && i < n;)
+    {
+        char c = p[i];
+        if (c == '*' && i + 1 < n && p[i + 1] == '*' && (i == 0 || p[i - 1] == '/') && (i + 2 == n || p[i + 2] == '/'))
+        {
+            if (i + 2 == n)
+                ok = match_node(m, MN_ANYSTR, 0, 0) != UINT32_MAX;
+            else
+                ok = match_node(m, MN_DSEG, 0, 0) != UINT32_MAX && match_node(m, MN_DSEG_IN, 0, 0) != UINT32_MAX;
+            i += 3;
+            continue;
+        }
+        if (c == '*')
+        {
+            ok = match_node(m, MN_STAR, 0, 0) != UINT32_MAX;
+            while (i < n && p[i] == '*')
+                i++;
+            continue;
+        }
+        if (c == '?')
+        {
+            ok = match_node(m, MN_ANY, 0, 0) != UINT32_MAX;
+            i++;
+            continue;
+        }
+        if (c == '[')
+        {
+            uint8_t bits[32];
+            size_t used = match_class(p + i, n - i, bits);
+            if (used)
+            {
+                if (m->nclasses == m->classes_cap)
+                {
+                    size_t cap = m->classes_cap ? m->classes_cap * 2 : 8;
+                    uint8_t(*classes)[32] = realloc(m->classes, cap * sizeof(*classes));
+                    if (!classes)
+                        return -1;
+                    m->classes = classes;
+                    m->classes_cap = cap;
+                }
+                memcpy(m->classes[m->nclasses], bits, 32);
+                ok = match_node(m, MN_CLASS, 0, (uint32_t)m->nclasses++) != UINT32_MAX;
+                i += used;
+                continue;
+            }
+        }
+        if (c == '\\' && i + 1 < n)
+            c = p[++i];
+        ok = match_node(m, MN_CHAR, (uint8_t)c, 0) != UINT32_MAX;
+        i++;
+    }
+    if (!ok || match_node(m, MN_ACCEPT, 0, 0) == UINT32_MAX)
+    {
+        m->nnodes = first;
+        return -1;
+    }
+    m->rules[m->nrules++] = rule;
+    *start = (uint32_t)first;
+    return 1;
+}
+
+/**
+
+@brief Добавляет узел и его ε-замыкание в строящееся множество.
+*/
+static void match_add(Matcher *m, uint32_t n)
+{
+    for (;;)
+    {
+        if (m->mark[n] == m->gen)
+            return;
+        m->mark[n] = m->gen;
+        if (m->set_len == m->set_cap)
+        {
+            size_t cap = m->set_cap ? m->set_cap * 2 : 64;
+            uint32_t *set = realloc(m->set, cap * sizeof(*set));
+            if (!set)
+                return;
+            m->set = set;
+            m->set_cap = cap;
+        }
+        m->set[m->set_len++] = n;
+        // * и ** / могут совпасть с пустой строкой
+        if (m->nodes[n].kind == MN_STAR)
+            n += 1;
+        else if (m->nodes[n].kind == MN_DSEG)
+            n += 2;
+        else
+            return;
+    }
+}
+
+/**
+
+@brief Начинает построение нового множества узлов.
+*/
+static void match_begin(Matcher *m)
+{
+    m->set_len = 0;
+    if (++m->gen == 0)
+    {
+        memset(m->mark, 0, m->nodes_cap * sizeof(*m->mark));
+        m->gen = 1;
+    }
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+
+@brief Находит или создаёт состояние для построенного множества.
+
+@return Номер состояния; при нехватке памяти — 0 (правила не действуют).
+*/
+static uint32_t match_intern(Matcher *m)
+{
+    if (m->set_len == 0)
+        return 0;
+    qsort(m->set, m->set_len, sizeof(*m->set), cmp_u32);
+    uint64_t h = group_hash((const char *)m->set, m->set_len * sizeof(*m->set));
+
+    if (m->nstates * 2 >= m->index_cap)
+    {
+        size_t cap = m->index_cap ? m->index_cap * 2 : 256;
+        uint32_t *index = calloc(cap, sizeof(*index));
+        if (!index)
+            return 0;
+        for (size_t i = 1; i < m->nstates; i++)
+        {
+            const MatchState *st = &m->states[i];
+            size_t j = group_hash((const char *)st->nodes, st->len * sizeof(*st->nodes)) & (cap - 1);
+            while (index[j])
+                j = (j + 1) & (cap - 1);
+            index[j] = (uint32_t)i + 1;
+        }
+        free(m->index);
+        m->index = index;
+        m->index_cap = cap;
+    }
+    size_t j = h & (m->index_cap - 1);
+    for (; m->index[j]; j = (j + 1) & (m->index_cap - 1))
+    {
+        const MatchState *st = &m->states[m->index[j] - 1];
+        if (st->len == m->set_len && memcmp(st->nodes, m->set, m->set_len * sizeof(*m->set)) == 0)
+            return m->index[j] - 1;
+    }
+
+    if (m->nstates == m->states_cap)
+    {
+        size_t cap = m->states_cap * 2;
+        MatchState *states = realloc(m->states, cap * sizeof(*states));
+        if (!states)
+            return 0;
+        m->states = states;
+        m->states_cap = cap;
+    }
+    MatchState *st = &m->states[m->nstates];
+    memset(st, 0, sizeof(*st));
+    if (!(st->nodes = malloc(m->set_len * sizeof(*st->nodes))))
+        return 0;
+    memcpy(st->nodes, m->set, m->set_len * sizeof(*st->nodes));
+    st->len = (uint32_t)m->set_len;
+
+    // Из совпавших правил действует правило с наибольшим приоритетом
+    int64_t file_best = -1, dir_best = -1;
+    for (uint32_t i = 0; i < st->len; i++)
+    {
+        const MatchNode *node = &m->nodes[st->nodes[i]];
+        if (node->kind != MN_ACCEPT && node->kind != MN_ANYSTR)
+            continue;
+        const MatchRule *rule = &m->rules[node->rule];
+        if ((int64_t)rule->priority > dir_best)
+        {
+            dir_best = rule->priority;
+            st->exclude_dir = !rule->negate;
+        }
+        if (!rule->dir_only && (int64_t)rule->priority > file_best)
+        {
+            file_best = rule->priority;
+            st->exclude_file = !rule->negate;
+        }
+    }
+    m->index[j] = (uint32_t)m->nstates + 1;
+    return (uint32_t)m->nstates++;
+}
+
+/**
+
+@brief Переход автомата по одному байту пути.
+*/
+static uint32_t match_step(Matcher *m, uint32_t s, uint8_t c)
+{
+    if (s == 0)
+        return 0;
+    if (m->states[s].next && m->states[s].next[c] != MATCH_UNKNOWN)
+        return m->states[s].next[c];
+    if (!m->states[s].next)
+    {
+        uint32_t *next = malloc(256 * sizeof(*next));
+        if (!next)
+            return 0;
+        for (unsigned k = 0; k < 256; k++)
+            next[k] = MATCH_UNKNOWN;
+        m->states[s].next = next;
+    }
+
+    match_begin(m);
+    for (uint32_t i = 0; i < m->states[s].len; i++)
+    {
+        uint32_t n = m->states[s].nodes[i];
+        const MatchNode *node = &m->nodes[n];
+        switch ((MatchNodeKind)node->kind)
+        {
+        case MN_CHAR:
+            if (c == node->ch)
+                match_add(m, n + 1);
+            break;
+        case MN_ANY:
+            if (c != '/')
+                match_add(m, n + 1);
+            break;
+        case MN_CLASS:
+            if (m->classes[node->cls][c >> 3] & (1u << (c & 7)))
+                match_add(m, n + 1);
+            break;
+        case MN_STAR:
+            if (c != '/')
+                match_add(m, n);
+            break;
+        case MN_DSEG:
+            if (c != '/')
+                match_add(m, n + 1);
+            break;
+        case MN_DSEG_IN:
+            match_add(m, c == '/' ? n - 1 : n);
+            break;
+        case MN_ANYSTR:
+            match_add(m, n);
+            break;
+        case MN_ACCEPT:
+            break;
+        }
+    }
+    uint32_t t = match_intern(m);
+    m->states[s].next[c] = t;
+    return t;
+}
+
+/**
+
+@brief Состояние автомата после имени записи папки.
+*/
+static uint32_t match_name(Matcher *m, uint32_t s, const char *name)
+{
+    for (const char *p = name; *p && s != 0; p++)
+        s = match_step(m, s, (uint8_t)*p);
+    return s;
+}
+
+/**
+
+@brief Добавляет к состоянию начальные узлы новых правил.
+*/
+static uint32_t match_extend(Matcher *m, uint32_t s, const uint32_t *starts, size_t n)
+{
+    if (n == 0)
+        return s;
+    match_begin(m);
+    for (uint32_t i = 0; s && i < m->states[s].len; i++)
+        match_add(m, m->states[s].nodes[i]);
+    for (size_t i = 0; i < n; i++)
+        match_add(m, starts[i]);
+    return match_intern(m);
+}
+
+/**
+
+@brief Компилирует правила из текста (.scanignore или командная строка)
+и добавляет их к состоянию папки.
+*/
+static uint32_t match_load(Matcher *m, uint32_t s, const char *text, size_t len)
+{
+    uint32_t *starts = NULL;
+    size_t nstarts = 0, cap = 0;
+
+    for (size_t pos = 0; pos < len;)
+    {
+        const char *line = text + pos;
+        const char *end = memchr(line, '\n', len - pos);
+        size_t n = end ? (size_t)(end - line) : len - pos;
+        pos += n + 1;
+        uint32_t start;
+        if (match_compile(m, line, n, m->next_priority, &start) != 1)
+            continue;
+        m->next_priority++;
+        if (nstarts == cap)
+        {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *grown = realloc(starts, cap * sizeof(*grown));
+            if (!grown)
+                break;
+            starts = grown;
+        }
+        starts[nstarts++] = start;
+    }
+    s = match_extend(m, s, starts, nstarts);
+    free(starts);
+    return s;
+}
+
+/**
+
+@brief Создаёт автомат с правилами --exclude и --include.
+
+@return NULL, если правил нет и .scanignore не читаются.
+*/
+static Matcher *matcher_new(const Options *opts)
+{
+    if (opts->nmatch_rules == 0 && opts->no_scanignore)
+        return NULL;
+    Matcher *m = calloc(1, sizeof(*m));
+    if (!m || !(m->states = calloc(16, sizeof(*m->states))))
+    {
+        free(m);
+        return NULL;
+    }
+    m->states_cap = 16;
+    m->nstates = 1; // 0 — пустое множество: правил нет, переходов не нужно
+
+    // Правила командной строки важнее любого .scanignore, среди них —
+    // последнее, как внутри одного файла
+    m->next_priority = MATCH_CLI_PRIORITY;
+    for (size_t i = 0; i < opts->nmatch_rules; i++)
+        m->root = match_load(m, m->root, opts->match_rules[i], strlen(opts->match_rules[i]));
+    m->next_priority = 0;
+    return m;
+}
+
+/**
+
+@brief Освобождает автомат правил исключения.
+*/
+static void matcher_free(Matcher *m)
+{
+    if (!m)
+        return;
+    for (size_t i = 1; i < m->nstates; i++)
+    {
+        free(m->states[i].nodes);
+        free(m->states[i].next);
+    }
+    free(m->states);
+    free(m->index);
+    free(m->nodes);
+    free(m->mark);
+    free(m->rules);
+    free(m->classes);
+    free(m->set);
+    free(m);
+}
+
+/**
+
+@brief Читает .scanignore папки и добавляет его правила к её состоянию.
+*/
+static void scanignore_load(WalkState *ws, DirNode *node)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/.scanignore", node->path) >= (int)sizeof(path))
+        return;
+    rate_limit_acquire(&g_limit_meta, 1);
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return;
+    track_handle(1);
+    char *text = malloc(SCANIGNORE_MAX);
+    size_t len = text ? fread(text, 1, SCANIGNORE_MAX, f) : 0;
+    fclose(f);
+    track_handle(-1);
+    if (text)
+    {
+        node->match_state = match_load(ws->matcher, node->match_state, text, len);
+        ws->scanignore_files++;
+    }
+    free(text);
+}
+
+/**
+
+@brief Состояние автомата для подпапки: её имя и разделитель / после
+состояния родителя.
+*/
+static uint32_t match_child(Matcher *m, uint32_t parent, const char *path)
+{
+    if (!m || parent == 0)
+        return 0;
+    const char *name = strrchr(path, '/');
+    return match_step(m, match_name(m, parent, name ? name + 1 : path), '/');
+}
+
+/**
+
+@struct FileMeta
+
+@brief Метаданные записи каталога, нужные сканеру.
+*/
+typedef struct
+{
+    mode_t mode;    /**< Тип файла */
+    uint64_t size;  /**< Размер в байтах */
+    int64_t mtime;  /**< Время изменения (секунды) */
+    uint64_t ino;   /**< Номер inode */
+    uint64_t dev;   /**< Устройство */
+    uint32_t uid;   /**< Владелец (только если запрошен) */
+    uint32_t nlink; /**< Количество жёстких ссылок (только если запрошено) */
+} FileMeta;
+
+/**
+
+@brief Проверяет, находится ли открытая папка на сетевой ФС.
+
+На NFS, SMB/CIFS, FUSE и подобных ФС каждый stat() может требовать
+обращения к серверу; для них в режиме auto включается AT_STATX_DONT_SYNC.
+*/
+static int dir_is_network_fs(DIR *dir)
+{
+#ifdef __linux__
+    struct statfs sfs;
+    if (fstatfs(dirfd(dir), &sfs) != 0)
+        return 0;
+    switch ((unsigned long)sfs.f_type)
+    {
+    case 0x6969UL:     // NFS
+    case 0x517BUL:     // SMB
+    case 0xFF534D42UL: // CIFS
+    case 0xFE534D42UL: // SMB2
+    case 0x65735546UL: // FUSE
+    case 0x00C36400UL: // Ceph
+    case 0x01021997UL: // 9P
+    case 0x47504653UL: // GPFS
+    case 0x0BD00BD0UL: // Lustre
+        return 1;
+    default:
+        return 0;
+    }
+#else
+    (void)dir;
+    return 0;
+#endif
+}
+
+/**
+
+@brief Получение метаданных записи каталога.
+
+Если доступен statx(), запрашиваются только тип, размер, mtime и inode
+(и дополнительные поля extra) относительно дескриптора папки; с nofollow
+символическая ссылка описывается сама, а не её цель; с dont_sync
+NFS/CIFS/FUSE могут ответить из кэша атрибутов без обращения к серверу.
+Иначе используется stat().
+
+@return 0 при успехе, -1 при ошибке.
+*/
+static int entry_stat(DIR *dir, const char *name, const char *full_path, int dont_sync, int nofollow,
+                      unsigned extra, FileMeta *meta)
+{
+    OpTimer t;
+    int rc;
+
+    rate_limit_acquire(&g_limit_meta, 1);
+    op_begin(&t);
+#if defined(__linux__) && defined(STATX_TYPE)
+    struct statx stx;
+    (void)full_path;
+    rc = statx(dirfd(dir), name,
+               (dont_sync ? AT_STATX_DONT_SYNC : AT_STATX_SYNC_AS_STAT) | (nofollow ? AT_SYMLINK_NOFOLLOW : 0),
+               STATX_TYPE | STATX_SIZE | STATX_MTIME | STATX_INO | extra, &stx);
+    op_end(PH_STAT, &t);
+    if (rc != 0)
+        return -1;
+    if (dont_sync)
+        thread_stats()->stats_dont_sync++;
+    meta->mode = stx.stx_mode;
+    meta->size = stx.stx_size;
+    meta->mtime = stx.stx_mtime.tv_sec;
+    meta->ino = stx.stx_ino;
+    meta->dev = (uint64_t)makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    meta->uid = stx.stx_uid;
+    meta->nlink = stx.stx_nlink;
+#else
+    struct stat st;
+    (void)dir;
+    (void)name;
+    (void)dont_sync;
+    (void)extra;
+#ifdef _WIN32
+    (void)nofollow;
+    rc = stat(full_path, &st);
+#else
+    rc = nofollow ? lstat(full_path, &st) : stat(full_path, &st);
+#endif
+    op_end(PH_STAT, &t);
+    if (rc != 0)
+        return -1;
+    meta->mode = st.st_mode;
+    meta->size = (uint64_t)st.st_size;
+    meta->mtime = (int64_t)st.st_mtime;
+    meta->ino = (uint64_t)st.st_ino;
+    meta->dev = (uint64_t)st.st_dev;
+    meta->uid = (uint32_t)st.st_uid;
+    meta->nlink = (uint32_t)st.st_nlink;
+#endif
+    return 0;
+}
+
+/**
+
+@brief Является ли запись папки символической ссылкой (без разыменования).
+*/
+static int entry_is_symlink(DIR *dir, const struct dirent *entry)
+{
+#ifdef _DIRENT_HAVE_D_TYPE
+    if (entry->d_type != DT_UNKNOWN)
+        return entry->d_type == DT_LNK;
+#endif
+#ifndef _WIN32
+    struct stat lst;
+    return fstatat(dirfd(dir), entry->d_name, &lst, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(lst.st_mode);
+#else
+    (void)dir;
+    (void)entry;
+    return 0;
+#endif
+}
+
+/**
+
+@brief Запоминает пройденную папку; новая заносится и в журнал.
+
+@return 0, если папка уже была пройдена.
+*/
+static int seen_dir_add(WalkState *ws, uint64_t dev, uint64_t ino, const char *path)
+{
+    if (!devino_insert(ws->seen_dirs, dev, ino))
+        return 0;
+    if (ws->journal)
+        checkpoint_seen(ws, 'S', dev, ino, path);
+    return 1;
+}
+
+/**
+
+@brief Пройдена ли уже подпапка; непройденная запоминается, если нужно.
+
+При нескольких корнях запоминаются все папки. При одном корне с -L
+множество (dev, ino) ведётся только для папок, достигнутых через
+символическую ссылку, и их потомков, а создаётся при первой такой
+ссылке: без ссылок обход не тратит на него память. Ссылка, цель которой
+лежит внутри корня, пропускается — эта папка и так пройдена по
+настоящему пути, а циклы ссылок внутри дерева разрываются здесь же.
+
+@param via_link На входе — признак родителя, на выходе — признак подпапки.
+
+@return 1, если папку обходить не нужно.
+*/
+static int dir_seen(WalkState *ws, DIR *dir, const struct dirent *entry, const char *full_path, const FileMeta *st,
+                    int *via_link)
+{
+    if (!ws->root_real)
+        return ws->seen_dirs && !seen_dir_add(ws, st->dev, st->ino, full_path);
+#ifndef _WIN32
+    if (entry_is_symlink(dir, entry))
+    {
+        char real[PATH_MAX];
+        size_t n = ws->root_real_len;
+        if (realpath(full_path, real) && strncmp(real, ws->root_real, n) == 0 &&
+            (real[n] == '\0' || real[n] == '/' || n == 1))
+            return 1;
+        *via_link = 1;
+    }
+#else
+    (void)dir;
+    (void)entry;
+    (void)full_path;
+#endif
+    if (!*via_link)
+        return 0;
+    if (!ws->seen_dirs && !(ws->seen_dirs = devino_set_new()))
+        return 0;
+    return !seen_dir_add(ws, st->dev, st->ino, full_path);
+}
+
+/**
+
+@brief Читает одну папку: считает MP4-файлы и ставит подпапки в очередь.
+
+Папка читается до конца и закрывается до перехода к подпапкам,
+поэтому одновременно открыт не более одного дескриптора каталога.
+*/
+static void visit_dir(WalkState *ws, DirNode *node)
+{
+    struct dirent *entry;
+    FileMeta st;
+    DirQueue *children = NULL;
+    ThreadStats *ts = thread_stats();
+    OpTimer t;
+
+    rate_limit_acquire(&g_limit_meta, 1);
+    op_begin(&t);
+    DIR *dir = opendir(node->path);
+    op_end(PH_DIR_OPEN, &t);
+
+    if (dir)
+    {
+        track_handle(1);
+        if (ws->matcher && !ws->opts->no_scanignore)
+            scanignore_load(ws, node);
+        int dont_sync = ws->opts->statx_sync == STATX_SYNC_OFF ||
+                        (ws->opts->statx_sync == STATX_SYNC_AUTO && dir_is_network_fs(dir));
+        unsigned extra = 0;
+#if defined(__linux__) && defined(STATX_TYPE)
+        if (ws->opts->group.kind == GROUP_UID)
+            extra |= STATX_UID;
+        if (ws->seen_files)
+            extra |= STATX_NLINK;
+#endif
+        if (ws->opts->walk_bfs)
+            children = ws->stack[0];
+        else
+            children = calloc(1, sizeof(*children));
+        int own_files = shard_owns_files(ws, node);
+        int offered = 0;
+        SizedFile *sized = NULL;
+        size_t nsized = 0, sized_cap = 0;
+
+        for (;;)
+        {
+            op_begin(&t);
+            entry = readdir(dir);
+            op_end(PH_READDIR, &t);
+            if (!entry)
+                break;
+            if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+                continue;
+            ts->entries++;
+
+            // Правила без / в конце решают по одному имени, ещё до stat()
+            const MatchState *match = NULL;
+            if (node->match_state)
+            {
+                uint32_t state = match_name(ws->matcher, node->match_state, entry->d_name);
+                match = &ws->matcher->states[state];
+                if (match->exclude_file && match->exclude_dir)
+                {
+                    ws->pruned_entries++;
+#ifdef _DIRENT_HAVE_D_TYPE
+                    if (entry->d_type == DT_DIR)
+                        ws->pruned_dirs++;
+#endif
+                    continue;
+                }
+            }
+
+            char full_path[PATH_MAX];
+            int n = snprintf(full_path, sizeof(full_path), "%s/%s", node->path, entry->d_name);
+            if (n < 0 || (size_t)n >= sizeof(full_path))
+                continue;
+
+            if (entry_stat(dir, entry->d_name, full_path, dont_sync, !ws->opts->follow_symlinks, extra, &st) == -1)
+                continue;
+
+            if (match && (S_ISDIR(st.mode) ? match->exclude_dir : match->exclude_file))
+            {
+                ws->pruned_entries++;
+                if (S_ISDIR(st.mode))
+                    ws->pruned_dirs++;
+                continue;
+            }
+
+            if (S_ISDIR(st.mode))
+            {
+                if (ws->opts->one_file_system && st.dev != ws->roots[node->root].dev)
+                {
+                    ws->roots[node->root].xdev_dirs++;
+                    continue;
+                }
+                // Папка из журнала уже есть во множестве пройденных (запись S),
+                // поэтому журнал проверяется раньше, чем повтор
+                int via_link = node->via_link;
+                int resumed = ws->journal && checkpoint_resume(ws, node, node->root, full_path, (size_t)n);
+                if (!resumed && dir_seen(ws, dir, entry, full_path, &st, &via_link))
+                {
+                    ws->roots[node->root].dup_dirs++;
+                    continue;
+                }
+                // Считаются и папки из журнала, чтобы разбиение --shard не
+                // зависело от того, продолжается ли прерванный запуск
+                node->subdirs++;
+                if (resumed)
+                    continue;
+                if (children && dir_queue_push(ws, children, node, via_link, full_path))
+                    node->pending++;
+                else
+                    ws->lost_entries++;
+            }
+            else if (S_ISREG(st.mode))
+            {
+                const char *ext = strrchr(entry->d_name, '.');
+                if (ext && strcasecmp(ext, ".mp4") == 0)
+                {
+                    if (!own_files)
+                    {
+                        ws->shard_files++;
+                        continue;
+                    }
+                    if (ws->seen_files && st.nlink > 1)
+                    {
+                        if (!devino_insert(ws->seen_files, st.dev, st.ino))
+                        {
+                            ws->roots[node->root].dup_files++;
+                            continue;
+                        }
+                        if (ws->journal)
+                            checkpoint_seen(ws, 'H', st.dev, st.ino, full_path);
+                    }
+                    if (ws->estimate)
+                    {
+                        estimate_offer(ws->estimate, full_path, st.size);
+                        offered = 1;
+                        continue;
+                    }
+                    if (ws->opts->bitrate_model)
+                    {
+                        if (nsized == sized_cap)
+                        {
+                            size_t cap = sized_cap ? sized_cap * 2 : 16;
+                            SizedFile *grown = realloc(sized, cap * sizeof(*sized));
+                            if (!grown)
+                                continue;
+                            sized = grown;
+                            sized_cap = cap;
+                        }
+                        SizedFile *f = &sized[nsized];
+                        if (!(f->path = strdup(full_path)))
+                            continue;
+                        f->size = st.size;
+                        f->dev = st.dev;
+                        f->uid = st.uid;
+                        f->role = MODEL_PENDING;
+                        memset(&f->result, 0, sizeof(f->result));
+                        nsized++;
+                        continue;
+                    }
+                    submit_file(ws, node, full_path, st.uid, st.dev);
+                    progress_tick(ws, 0);
+                }
+            }
+        }
+
+        op_begin(&t);
+        closedir(dir);
+        op_end(PH_CLOSE, &t);
+        track_handle(-1);
+        if (offered)
+            ws->estimate->folders++;
+        // Папка уже закрыта: модель разбирает файлы, не держа её дескриптор,
+        // и освобождает массив, когда примет решение
+        if (nsized)
+        {
+            model_dir(ws, node, sized, nsized);
+            progress_tick(ws, 0);
+        }
+        else
+            free(sized);
+
+        if (!ws->opts->walk_bfs && children)
+        {
+            if (children->count == 0 || !walk_push_queue(ws, children))
+                dir_queue_free(ws, children);
+        }
+    }
+
+    node->enumerated = 1;
+    finish_dir(ws, node);
+    if (ws->pool)
+    {
+        pool_flush(ws);
+        pool_drain(ws, SIZE_MAX);
+    }
+}
+
+/**
+
+@brief Начальное состояние сканирования.
+
+@param roots Корни сканирования (для списка файлов — один условный корень).
+*/
+static int walk_init(WalkState *ws, Stats *stats, Options *opts, const char *const *roots, int nroots)
+{
+    memset(ws, 0, sizeof(*ws));
+    ws->stats = stats;
+    ws->opts = opts;
+    ws->started_ns = now_ns();
+    ws->next_progress_ns = ws->started_ns + (uint64_t)opts->progress_ms * 1000000ull;
+    tally_init(&ws->tally, opts);
+
+    ws->roots = calloc((size_t)nroots, sizeof(*ws->roots));
+    if (!ws->roots)
+        return 0;
+    ws->nroots = nroots;
+    for (int i = 0; i < nroots; i++)
+    {
+        ws->roots[i].path = roots[i];
+        ws->roots[i].path_len = strlen(roots[i]);
+        struct stat st;
+        if (opts->one_file_system && stat(roots[i], &st) == 0)
+            ws->roots[i].dev = (uint64_t)st.st_dev;
+    }
+    if (opts->estimate)
+    {
+        if (!(ws->estimate = calloc(1, sizeof(*ws->estimate))))
+        {
+            free(ws->roots);
+            ws->roots = NULL;
+            ws->nroots = 0;
+            return 0;
+        }
+        ws->estimate->rng = now_ns() | 1;
+        ws->estimate->mem_budget = opts->mem_budget;
+    }
+    // Пересекающиеся корни: каждая папка обходится один раз. При одном
+    // корне с -L повтор возможен только через ссылку, и множество папок
+    // заводится лишь при первой ссылке на папку вне корня (dir_seen()).
+    // Если путь корня не разрешается, запоминаются все папки, как раньше.
+#ifndef _WIN32
+    if (nroots == 1 && opts->follow_symlinks && (ws->root_real = realpath(roots[0], NULL)) != NULL)
+        ws->root_real_len = strlen(ws->root_real);
+#endif
+    if (nroots > 1 || (opts->follow_symlinks && !ws->root_real))
+        ws->seen_dirs = devino_set_new();
+    if (nroots > 1 || opts->dedupe_hardlinks)
+        ws->seen_files = devino_set_new();
+    ws->folders.active = opts->partial != NULL;
+    ws->matcher = matcher_new(opts);
+    if (opts->checkpoint && !checkpoint_open(ws, opts->checkpoint))
+    {
+        devino_set_free(ws->seen_dirs);
+        devino_set_free(ws->seen_files);
+        ws->seen_dirs = ws->seen_files = NULL;
+        free(ws->root_real);
+        ws->root_real = NULL;
+        group_free(&ws->done_dirs);
+        estimate_free(ws);
+        matcher_free(ws->matcher);
+        ws->matcher = NULL;
+        free(ws->roots);
+        ws->roots = NULL;
+        ws->nroots = 0;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+
+@brief Запускает пул разбора, если задано -j больше 1, и при --idle
+понижает приоритет координатора.
+*/
+static void walk_start_pool(WalkState *ws)
+{
+    // С пулом координатор сам почти не нагружает процессор и остаётся с
+    // обычным приоритетом, чтобы вовремя раздавать задания; фоновым
+    // становится только его ввод-вывод (обход папок).
+    if (ws->opts->idle)
+        enter_idle_priority(ws->opts->jobs <= 1 && !ws->opts->adaptive);
+    // Выборку --estimate разбирают собственные потоки после обхода
+    if (ws->estimate)
+        return;
+    if (ws->opts->jobs > 1)
+        ws->pool = pool_create(ws->opts->jobs, ws->opts);
+    else if (ws->opts->adaptive)
+        ws->pool = pool_create(ADAPTIVE_MAX_JOBS, ws->opts);
+}
+
+/**
+
+@brief Дожидается разбора всех файлов, останавливает пул и печатает
+последнюю строку прогресса.
+*/
+static void walk_finish(WalkState *ws)
+{
+    if (ws->pool)
+    {
+        pool_flush(ws);
+        pool_drain(ws, 0);
+        pool_destroy(ws);
+    }
+    free(ws->out);
+    ws->out = NULL;
+    progress_tick(ws, 1);
+    devino_set_free(ws->seen_dirs);
+    devino_set_free(ws->seen_files);
+    ws->seen_dirs = ws->seen_files = NULL;
+    free(ws->root_real);
+    ws->root_real = NULL;
+    if (ws->journal)
+    {
+        checkpoint_sync(ws);
+        fclose(ws->journal);
+        track_handle(-1);
+        ws->journal = NULL;
+    }
+    group_free(&ws->done_dirs);
+    matcher_free(ws->matcher);
+    ws->matcher = NULL;
+}
+
+/**
+
+@brief Освобождает итоги сканирования после того, как они напечатаны.
+*/
+static void walk_release(WalkState *ws)
+{
+    tally_free(&ws->tally);
+    folder_sink_free(ws);
+    estimate_free(ws);
+    free(ws->roots);
+    ws->roots = NULL;
+    ws->nroots = 0;
+    for (size_t i = 0; i < ws->ndevices; i++)
+        free(ws->devices[i].timeline);
+    free(ws->devices);
+    ws->devices = NULL;
+    ws->ndevices = 0;
+}
+
+/**
+
+@brief Чтение одного пути из списка, разделённого символом delim.
+
+@return Длина пути или -1 в конце списка.
+*/
+static long read_list_entry(FILE *in, int delim, char *buf, size_t size)
+{
+    size_t len = 0;
+    int c;
+
+    while ((c = getc(in)) != EOF && c != delim)
+    {
+        if (len + 1 < size)
+            buf[len] = (char)c;
+        len++;
+    }
+    if (c == EOF && len == 0)
+        return -1;
+    if (len + 1 > size)
+    {
+        // Слишком длинный путь пропускается целиком
+        buf[0] = '\0';
+        return 0;
+    }
+    if (delim == '\n' && len > 0 && buf[len - 1] == '\r')
+        len--;
+    buf[len] = '\0';
+    return (long)len;
+}
+
+/**
+
+@brief Разбор MP4-файлов по готовому списку путей, без обхода папок.
+
+Пути берутся из списка в исходном порядке и проходят через тот же
+движок разбора и учёта, что и при обходе. Идущие подряд файлы одной
+папки объединяются в один узел DirNode, поэтому -v, --du и количество
+папок совпадают с обходом, если список отсортирован по пути.
+*/
+void scan_file_list(FILE *list, int delim, Stats *stats, Options *opts, WalkState *ws)
+{
+    char path[PATH_MAX];
+    DirNode *node = NULL;
+    long len;
+
+    const char *root = "";
+    if (!walk_init(ws, stats, opts, &root, 1))
+        return;
+    walk_start_pool(ws);
+
+    while (!g_interrupted && (len = read_list_entry(list, delim, path, sizeof(path))) >= 0)
+    {
+        if (len == 0)
+            continue;
+        const char *slash = strrchr(path, '/');
+        const char *name = slash ? slash + 1 : path;
+        const char *ext = strrchr(name, '.');
+        if (!ext || strcasecmp(ext, ".mp4") != 0)
+            continue;
+        thread_stats()->entries++;
+
+        size_t dir_len = slash ? (size_t)(slash - path) : 1;
+        const char *dir = slash ? path : ".";
+        if (slash == path)
+            dir_len = 1; // Файл в корне ФС: папка «/»
+        if (!node || strlen(node->path) != dir_len || strncmp(node->path, dir, dir_len) != 0)
+        {
+            if (node)
+            {
+                node->enumerated = 1;
+                finish_dir(ws, node);
+            }
+            node = calloc(1, sizeof(*node));
+            if (!node || !(node->path = malloc(dir_len + 1)))
+            {
+                free(node);
+                node = NULL;
+                continue;
+            }
+            memcpy(node->path, dir, dir_len);
+            node->path[dir_len] = '\0';
+            dir_attach(ws, node, NULL);
+        }
+        if (!shard_owns_files(ws, node))
+        {
+            ws->shard_files++;
+            continue;
+        }
+
+        uint32_t uid = 0;
+        uint64_t dev = 0;
+        // Устройство нужно пулу, чтобы поставить файл в очередь своего диска
+        if (opts->group.kind == GROUP_UID || ws->seen_files || ws->pool)
+        {
+            struct stat st;
+            rate_limit_acquire(&g_limit_meta, 1);
+            if (stat(path, &st) == 0)
+            {
+                uid = (uint32_t)st.st_uid;
+                dev = (uint64_t)st.st_dev;
+                if (ws->seen_files && !devino_insert(ws->seen_files, (uint64_t)st.st_dev, (uint64_t)st.st_ino))
+                {
+                    ws->roots[0].dup_files++;
+                    continue;
+                }
+            }
+        }
+        submit_file(ws, node, path, uid, dev);
+        progress_tick(ws, 0);
+        if (ws->pool)
+            pool_drain(ws, SIZE_MAX);
+    }
+    if (node)
+    {
+        node->enumerated = 1;
+        finish_dir(ws, node);
+    }
+
+    walk_finish(ws);
+}
+
+/**
+
+@brief Итеративное сканирование нескольких корней.
+
+Вместо рекурсии используется явный стек очередей ожидающих папок
+(или одна очередь в режиме обхода в ширину). Глубина дерева не
+влияет ни на стек вызовов, ни на число открытых дескрипторов, а
+список ожидающих папок сверх бюджета памяти вытесняется на диск.
+
+Корни обходятся по очереди одним обходчиком, а разбор файлов всех
+корней идёт в общем пуле, поэтому пул не простаивает, когда маленький
+том закончился раньше. При нескольких корнях папка (и файл с
+несколькими жёсткими ссылками), уже встреченная под другим корнем,
+пропускается и засчитывается первому корню.
+*/
+void scan_roots(const char *const *roots, int nroots, Stats *stats, Options *opts, WalkState *ws)
+{
+    if (!walk_init(ws, stats, opts, roots, nroots))
+        return;
+    // Прямой порядок --tree даёт только обход в глубину
+    if (opts->rollup == ROLLUP_TREE)
+        opts->walk_bfs = 0;
+
+    if (opts->walk_bfs)
+    {
+        DirQueue *q = calloc(1, sizeof(*q));
+        if (!q || !walk_push_queue(ws, q))
+        {
+            free(q);
+            walk_finish(ws);
+            return;
+        }
+    }
+
+    walk_start_pool(ws);
+    for (int r = 0; r < nroots && !g_interrupted; r++)
+    {
+        if (ws->journal && checkpoint_resume(ws, NULL, r, roots[r], strlen(roots[r])))
+            continue;
+        if (ws->seen_dirs)
+        {
+            struct stat st;
+            if (stat(roots[r], &st) == 0 && !seen_dir_add(ws, (uint64_t)st.st_dev, (uint64_t)st.st_ino, roots[r]))
+            {
+                ws->roots[r].dup_dirs++;
+                continue;
+            }
+        }
+
+        DirNode *node = calloc(1, sizeof(*node));
+        if (!node || !(node->path = strdup(roots[r])))
+        {
+            free(node);
+            continue;
+        }
+        node->root = r;
+        if (ws->matcher)
+            node->match_state = ws->matcher->root;
+        dir_attach(ws, node, NULL);
+        visit_dir(ws, node);
+
+        DirItem *item;
+        while (!g_interrupted && (item = walk_next(ws)) != NULL)
+        {
+            // Подпапка другой части: не открывается, как будто её нет
+            int shard = -1;
+            if (opts->shard_count && shard_splits(ws, item->parent) &&
+                (shard = shard_of(ws, item->parent->root, item->path)) != opts->shard_index)
+            {
+                ws->shard_dirs++;
+                item->parent->pending--;
+                finish_dir(ws, item->parent);
+                free(item);
+                continue;
+            }
+            node = calloc(1, sizeof(*node));
+            if (!node || !(node->path = strdup(item->path)))
+            {
+                free(node);
+                item->parent->pending--;
+                finish_dir(ws, item->parent);
+                free(item);
+                continue;
+            }
+            dir_attach(ws, node, item->parent);
+            node->via_link = item->via_link;
+            if (shard >= 0)
+                node->shard_owned = 1;
+            node->match_state = match_child(ws->matcher, item->parent->match_state, node->path);
+            free(item);
+            visit_dir(ws, node);
+        }
+    }
+
+    if (ws->estimate)
+    {
+        if (g_interrupted)
+            ws->estimate->stop = ESTIMATE_INTERRUPTED;
+        else
+            estimate_run(ws);
+    }
+    walk_finish(ws);
+
+    while (ws->depth > 0)
+        dir_queue_free(ws, ws->stack[--ws->depth]);
+    free(ws->stack);
+    ws->stack = NULL;
+    if (ws->spill)
+    {
+        fclose(ws->spill);
+        track_handle(-1);
+        ws->spill = NULL;
+    }
+}
+
+/**
+
+@brief Сканирование одной директории.
+*/
+void scan_directory(const char *path, Stats *stats, Options *opts, WalkState *ws)
+{
+    scan_roots(&path, 1, stats, opts, ws);
+}
+
+/**
+
+@brief Количество открытых дескрипторов процесса.
+
+@return Число дескрипторов или -1, если его нельзя определить.
+*/
+static int count_open_fds(void)
+{
+#ifdef __linux__
+    DIR *dir = opendir("/proc/self/fd");
+    struct dirent *entry;
+    int count = 0;
+
+    if (!dir)
+        return -1;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (entry->d_name[0] != '.')
+            count++;
+    }
+    closedir(dir);
+    return count - 1; // Без дескриптора самого /proc/self/fd
+#else
+    return -1;
+#endif
+}
+
+/**
+
+@brief Пиковое потребление памяти процессом в килобайтах.
+
+@return Пиковый RSS или -1, если его нельзя определить.
+*/
+static long peak_rss_kb(void)
+{
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+    {
+#ifdef __APPLE__
+        return ru.ru_maxrss / 1024;
+#else
+        return ru.ru_maxrss;
+#endif
+    }
+#endif
+    return -1;
+}
+
+/**
+
+@brief Сравнение для списка --top: длиннее — выше, затем по пути.
+*/
+static int cmp_ranked_longest(const void *a, const void *b)
+{
+    const RankedFile *x = a, *y = b;
+    if (x->ticks != y->ticks)
+        return x->ticks > y->ticks ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+/**
+
+@brief Сравнение для списка --bottom: короче — выше, затем по пути.
+*/
+static int cmp_ranked_shortest(const void *a, const void *b)
+{
+    const RankedFile *x = a, *y = b;
+    if (x->ticks != y->ticks)
+        return x->ticks < y->ticks ? -1 : 1;
+    return strcmp(x->path, y->path);
+}
+
+/**
+
+@brief Сортирует список --top или --bottom по месту в списке.
+*/
+static void rank_sort(RankHeap *heap)
+{
+    if (heap->len > 1)
+        qsort(heap->items, heap->len, sizeof(*heap->items),
+              heap->longest ? cmp_ranked_longest : cmp_ranked_shortest);
+}
+
+/**
+
+@brief Печатает отсортированный список --top или --bottom.
+*/
+static void print_ranked(const RankHeap *heap, const char *title)
+{
+    if (heap->limit == 0)
+        return;
+
+    printf("\n%s (%zu):\n", title, heap->len);
+    for (size_t i = 0; i < heap->len; i++)
+    {
+        char time_str[48];
+        format_ticks(heap->items[i].ticks, time_str, sizeof(time_str));
+        printf("%5zu. %s %s\n", i + 1, time_str, heap->items[i].path);
+    }
+}
+
+/**
+
+@brief Печать распределения длительностей: перцентили, t-digest и
+поминутная гистограмма (--histogram).
+*/
+static void print_duration_report(DurationDist *dist, const Options *opts)
+{
+    static const double pcts[] = {50, 90, 99};
+    char buf[48];
+
+    if (dist->count == 0)
+        return;
+
+    printf("\xF0\x9F\x93\x88 Durations:");
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+    {
+        format_ticks(dist_percentile(dist, pcts[i]), buf, sizeof(buf));
+        printf(" p%.0f " COLOR_YELLOW "%s" COLOR_RESET ",", pcts[i], buf);
+    }
+    format_ticks(dist->max, buf, sizeof(buf));
+    printf(" max " COLOR_YELLOW "%s" COLOR_RESET "\n", buf);
+
+    if (dist->sketch)
+    {
+        printf("   t-digest:");
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+        {
+            double v = tdigest_quantile(dist->sketch, pcts[i] / 100.0);
+            format_ticks((uint64_t)(v * TICKS_PER_SECOND + 0.5), buf, sizeof(buf));
+            printf(" p%.0f %s%s", pcts[i], buf, i + 1 < sizeof(pcts) / sizeof(pcts[0]) ? "," : "\n");
+        }
+    }
+
+    if (opts->histogram)
+    {
+        uint64_t peak = 0;
+        for (unsigned i = 0; i < DUR_MINUTE_BUCKETS; i++)
+            if (dist->minutes[i] > peak)
+                peak = dist->minutes[i];
+        printf("\n   minutes      files\n");
+        for (unsigned i = 0; i < DUR_MINUTE_BUCKETS; i++)
+        {
+            if (dist->minutes[i] == 0)
+                continue;
+            char label[16];
+            if (i + 1 < DUR_MINUTE_BUCKETS)
+                snprintf(label, sizeof(label), "%u-%u", i, i + 1);
+            else
+                snprintf(label, sizeof(label), "%u+", i);
+            int width = (int)((dist->minutes[i] * 40 + peak - 1) / peak);
+            printf("   %-9s %8llu %.*s\n", label, (unsigned long long)dist->minutes[i], width,
+                   "########################################");
+        }
+    }
+}
+
+/**
+
+@brief Итог --estimate: размер выборки, оценки и их 95% интервалы.
+*/
+static void print_estimate(const WalkState *ws)
+{
+    const Estimator *est = ws->estimate;
+    char total[48], error[48];
+    unsigned strata = 0;
+
+    for (unsigned h = 0; h < ESTIMATE_STRATA; h++)
+        strata += est->strata[h].files > 0;
+    format_ticks((uint64_t)llround(est->seconds * TICKS_PER_SECOND), total, sizeof(total));
+    format_ticks((uint64_t)llround(est->seconds_error * TICKS_PER_SECOND), error, sizeof(error));
+
+    printf("\xF0\x9F\x8E\xB2 Sample: " COLOR_YELLOW "%llu" COLOR_RESET " of %llu .mp4 files in %llu folders parsed "
+           "(size strata: %u, rounds: %u, %.2f s)\n",
+           (unsigned long long)est->sampled, (unsigned long long)est->candidates, (unsigned long long)est->folders,
+           strata, est->rounds, (double)est->sample_ns / 1e9);
+    printf("\xF0\x9F\x91\x8C About " COLOR_YELLOW "%.0f" COLOR_RESET " \xC2\xB1 %.0f MP4 files.\n", est->files,
+           est->files_error);
+    printf("\xF0\x9F\x8F\x81 Total duration: " COLOR_YELLOW "%s" COLOR_RESET " \xC2\xB1 %s (\xC2\xB1%.2f%%, 95%% confidence)\n",
+           total, error, 100 * estimate_relative_error(est));
+    switch (est->stop)
+    {
+    case ESTIMATE_TARGET:
+        printf("\xE2\x9C\x85 Target error \xC2\xB1%g%% reached\n", 100 * ws->opts->estimate_error);
+        break;
+    case ESTIMATE_BUDGET:
+        printf("\xE2\x8F\xB1 Time budget ran out before the target error \xC2\xB1%g%%\n",
+               100 * ws->opts->estimate_error);
+        break;
+    case ESTIMATE_EXHAUSTED:
+        if (est->candidates)
+            printf("\xF0\x9F\x93\xA6 Every sampled path kept within --mem-budget parsed before the target error "
+                   "\xC2\xB1%g%%\n",
+                   100 * ws->opts->estimate_error);
+        break;
+    case ESTIMATE_INTERRUPTED:
+        break;
+    }
+}
+
+/**
+
+@brief Сколько длительностей назначено моделью битрейта, а сколько разобрано.
+*/
+static void print_model(const WalkState *ws)
+{
+    const ModelStats *ms = &ws->model;
+    if (!ws->opts->bitrate_model)
+        return;
+    printf("\xF0\x9F\x93\x8F Bitrate model: %llu files estimated from size in %llu of %llu folders "
+           "(tolerance \xC2\xB1%g%%)\n",
+           (unsigned long long)ms->estimated, (unsigned long long)ms->fitted, (unsigned long long)ms->dirs,
+           100 * ws->opts->model_tolerance);
+    printf("   parsed: %llu to train and spot-check, %llu outliers, %llu in folders the model did not fit\n",
+           (unsigned long long)ms->parsed, (unsigned long long)ms->outliers, (unsigned long long)ms->unfit);
+    if (ms->estimated)
+        printf("   estimated files count in the totals only: durations, groups and --top/--bottom list parsed files\n");
+}
+
+/**
+
+@brief Итоги по корням (если корней несколько) и пропущенные повторы.
+*/
+static void print_roots(const WalkState *ws)
+{
+    uint64_t dup_dirs = 0, dup_files = 0, xdev_dirs = 0;
+
+    for (int r = 0; r < ws->nroots; r++)
+    {
+        dup_dirs += ws->roots[r].dup_dirs;
+        dup_files += ws->roots[r].dup_files;
+        xdev_dirs += ws->roots[r].xdev_dirs;
+    }
+    if (ws->nroots > 1 && !ws->estimate)
+    {
+        printf("\n\xF0\x9F\x93\x81 Roots:\n");
+        for (int r = 0; r < ws->nroots; r++)
+        {
+            const RootTotal *root = &ws->roots[r];
+            char time_str[48];
+            format_ticks(root->ticks, time_str, sizeof(time_str));
+            printf("%16s %8llu files %6llu folders  %s\n", time_str, (unsigned long long)root->files,
+                   (unsigned long long)root->folders, root->path);
+        }
+    }
+    if (dup_dirs || dup_files)
+        printf("\xE2\x99\xBB Skipped already visited: %llu folders (overlaps, symlink loops), %llu hard-linked files\n",
+               (unsigned long long)dup_dirs, (unsigned long long)dup_files);
+    if (xdev_dirs)
+        printf("\xE2\x9B\x94 Skipped mount points of other file systems: %llu\n", (unsigned long long)xdev_dirs);
+    if (ws->resumed_dirs)
+        printf("\xE2\x8F\xA9 Resumed from checkpoint: %llu finished subtrees not rescanned\n",
+               (unsigned long long)ws->resumed_dirs);
+    if (ws->pruned_entries)
+        printf("\xF0\x9F\x9A\xAB Pruned by exclude rules: %llu entries, %llu of them folders never opened "
+               "(%llu .scanignore files)\n",
+               (unsigned long long)ws->pruned_entries, (unsigned long long)ws->pruned_dirs,
+               (unsigned long long)ws->scanignore_files);
+    if (ws->opts->shard_count)
+        printf("\xF0\x9F\xA7\xA9 Shard %d/%d: %llu subtrees and %llu files in shared folders left to other shards\n",
+               ws->opts->shard_index, ws->opts->shard_count, (unsigned long long)ws->shard_dirs,
+               (unsigned long long)ws->shard_files);
+}
+
+/**
+
+@brief Сравнение групп по ключу.
+*/
+static int cmp_group_key(const void *a, const void *b)
+{
+    const GroupEntry *x = a, *y = b;
+    return strcmp(x->key, y->key);
+}
+
+/**
+
+@brief Собирает занятые ячейки карты групп в массив, отсортированный по ключу.
+
+Ячейки переставляются на месте, после вызова карта пригодна только для
+освобождения.
+*/
+static size_t group_sorted(GroupMap *map)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < map->cap; i++)
+        if (map->slots[i].hash)
+            map->slots[n++] = map->slots[i];
+    if (n > 1)
+        qsort(map->slots, n, sizeof(*map->slots), cmp_group_key);
+    return n;
+}
+
+/**
+
+@brief Печать итогов по группам (--group-by).
+*/
+static void print_groups(GroupMap *map, const GroupBy *group)
+{
+    if (group->kind == GROUP_NONE)
+        return;
+
+    size_t n = group_sorted(map);
+    printf("\n\xF0\x9F\x97\x82 Groups by %s (%zu):\n", group->spec, n);
+    for (size_t i = 0; i < n; i++)
+    {
+        char time_str[48];
+        format_ticks(map->slots[i].ticks, time_str, sizeof(time_str));
+        printf("%16s %8llu files  %s\n", time_str, (unsigned long long)map->slots[i].files, map->slots[i].key);
+    }
+}
+
+/**
+
+@brief Печать списка --top или --bottom в JSON.
+*/
+static void json_print_ranked(const RankHeap *heap)
+{
+    printf("[");
+    for (size_t i = 0; i < heap->len; i++)
+    {
+        printf("%s\n    {\"seconds\": %.6f, \"path\": ", i ? "," : "",
+               (double)heap->items[i].ticks / TICKS_PER_SECOND);
+        json_print_string(stdout, heap->items[i].path);
+        printf("}");
+    }
+    printf("%s]", heap->len ? "\n  " : "");
+}
+
+/**
+
+@brief Итог сканирования в JSON (--format json).
+
+Суммарная длительность выводится и в целых микросекундах, чтобы
+результаты можно было складывать без ошибок округления.
+*/
+static void print_summary_json(const char *root, const Stats *stats, WalkState *ws)
+{
+    DurationDist *dist = &ws->tally.dist;
+    static const double pcts[] = {50, 90, 99};
+
+    printf("{\n  \"root\": ");
+    json_print_string(stdout, root);
+    printf(",\n  \"roots\": [");
+    for (int r = 0; r < ws->nroots; r++)
+    {
+        const RootTotal *root = &ws->roots[r];
+        printf("%s\n    {\"path\": ", r ? "," : "");
+        json_print_string(stdout, root->path);
+        printf(", \"files\": %llu, \"folders\": %llu, \"total_us\": %llu, "
+               "\"skipped_folders\": %llu, \"skipped_hardlinks\": %llu}",
+               (unsigned long long)root->files, (unsigned long long)root->folders, (unsigned long long)root->ticks,
+               (unsigned long long)root->dup_dirs, (unsigned long long)root->dup_files);
+    }
+    printf("\n  ],\n  \"files\": %llu,\n  \"folders\": %llu,\n", (unsigned long long)stats->total_files,
+           (unsigned long long)stats->total_folders_with_mp4);
+    printf("  \"total_us\": %llu,\n  \"total_seconds\": %.6f,\n",
+           (unsigned long long)stats->total_ticks, (double)stats->total_ticks / TICKS_PER_SECOND);
+    printf("  \"interrupted\": %s,\n  \"resumed_folders\": %llu,\n", g_interrupted ? "true" : "false",
+           (unsigned long long)ws->resumed_dirs);
+    printf("  \"pruned_entries\": %llu,\n  \"pruned_folders\": %llu,\n  \"scanignore_files\": %llu,\n",
+           (unsigned long long)ws->pruned_entries, (unsigned long long)ws->pruned_dirs,
+           (unsigned long long)ws->scanignore_files);
+
+    printf("  \"durations\": {\"count\": %llu, \"min_seconds\": %.6f, \"max_seconds\": %.6f",
+           (unsigned long long)dist->count, (double)dist->min / TICKS_PER_SECOND,
+           (double)dist->max / TICKS_PER_SECOND);
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+        printf(", \"p%.0f_seconds\": %.6f", pcts[i], (double)dist_percentile(dist, pcts[i]) / TICKS_PER_SECOND);
+    if (dist->sketch)
+    {
+        printf(",\n    \"tdigest\": {");
+        for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+            printf("%s\"p%.0f_seconds\": %.6f", i ? ", " : "", pcts[i],
+                   tdigest_quantile(dist->sketch, pcts[i] / 100.0));
+        printf("}");
+    }
+    // Поминутные корзины без хвоста из нулей
+    unsigned used = DUR_MINUTE_BUCKETS;
+    while (used > 0 && dist->minutes[used - 1] == 0)
+        used--;
+    printf(",\n    \"minute_buckets\": [");
+    for (unsigned i = 0; i < used; i++)
+        printf("%s%llu", i ? ", " : "", (unsigned long long)dist->minutes[i]);
+    printf("]},\n");
+
+    if (ws->tally.top.limit)
+    {
+        printf("  \"top\": ");
+        json_print_ranked(&ws->tally.top);
+        printf(",\n");
+    }
+    if (ws->tally.bottom.limit)
+    {
+        printf("  \"bottom\": ");
+        json_print_ranked(&ws->tally.bottom);
+        printf(",\n");
+    }
+    if (ws->opts->group.kind != GROUP_NONE)
+    {
+        GroupMap *map = &ws->tally.groups;
+        size_t n = group_sorted(map);
+        printf("  \"group_by\": ");
+        json_print_string(stdout, ws->opts->group.spec);
+        printf(",\n  \"groups\": [");
+        for (size_t i = 0; i < n; i++)
+        {
+            printf("%s\n    {\"key\": ", i ? "," : "");
+            json_print_string(stdout, map->slots[i].key);
+            printf(", \"files\": %llu, \"total_us\": %llu}", (unsigned long long)map->slots[i].files,
+                   (unsigned long long)map->slots[i].ticks);
+        }
+        printf("%s],\n", n ? "\n  " : "");
+    }
+    if (ws->estimate)
+    {
+        const Estimator *est = ws->estimate;
+        static const char *const stops[] = {"target", "budget", "exhausted", "interrupted"};
+        printf("  \"estimate\": {\"confidence\": 0.95, \"target_error\": %g, \"candidates\": %llu, "
+               "\"folders\": %llu, \"sample_files\": %llu, \"rounds\": %u, \"sample_seconds\": %.3f,\n"
+               "    \"files\": %.1f, \"files_error\": %.1f, \"total_seconds\": %.3f, \"error_seconds\": %.3f, "
+               "\"relative_error\": %.6f, \"stop\": \"%s\"},\n",
+               ws->opts->estimate_error, (unsigned long long)est->candidates, (unsigned long long)est->folders,
+               (unsigned long long)est->sampled, est->rounds, (double)est->sample_ns / 1e9, est->files,
+               est->files_error, est->seconds, est->seconds_error, estimate_relative_error(est), stops[est->stop]);
+    }
+    if (ws->opts->bitrate_model)
+    {
+        const ModelStats *ms = &ws->model;
+        printf("  \"bitrate_model\": {\"tolerance\": %g, \"folders\": %llu, \"fitted_folders\": %llu, "
+               "\"estimated_files\": %llu, \"parsed_files\": %llu, \"outliers\": %llu, \"unfit_files\": %llu},\n",
+               ws->opts->model_tolerance, (unsigned long long)ms->dirs, (unsigned long long)ms->fitted,
+               (unsigned long long)ms->estimated, (unsigned long long)ms->parsed, (unsigned long long)ms->outliers,
+               (unsigned long long)ms->unfit);
+    }
+    printf("  \"spilled_folders\": %lld,\n  \"peak_rss_kb\": %ld\n}\n", ws->spilled_items, peak_rss_kb());
+}
+
+/**
+
+@struct FolderSource
+
+@brief Источник итогов папок для слияния: частичный результат или серия.
+*/
+typedef struct
+{
+    FILE *f;          /**< Открытый файл */
+    const char *name; /**< Имя для сообщений об ошибках */
+    FolderRec rec;    /**< Текущая запись */
+    size_t rec_cap;   /**< Ёмкость буфера пути записи */
+    int live;         /**< Текущая запись есть (не дошли до «end») */
+} FolderSource;
+
+/**
+
+@brief Разбирает запись «F» после ключевого слова.
+
+@return 1 при успехе, 0 если запись испорчена.
+*/
+static int folder_parse(FolderSource *src)
+{
+    unsigned long long files, ticks;
+    size_t len;
+
+    src->live = 0;
+    if (fscanf(src->f, "%llu %llu %zu", &files, &ticks, &len) != 3 || getc(src->f) != ' ')
+        return 0;
+    if (len + 1 > src->rec_cap)
+    {
+        char *path = realloc(src->rec.path, len + 1);
+        if (!path)
+            return 0;
+        src->rec.path = path;
+        src->rec_cap = len + 1;
+    }
+    if (fread(src->rec.path, 1, len, src->f) != len || getc(src->f) != '\n')
+        return 0;
+    src->rec.path[len] = '\0';
+    src->rec.files = files;
+    src->rec.ticks = ticks;
+    src->live = 1;
+    return 1;
+}
+
+/**
+
+@brief Читает следующую запись «F» или конец списка «end».
+
+@return 1 при успехе, 0 если файл испорчен.
+*/
+static int folder_next(FolderSource *src)
+{
+    char key[8];
+
+    src->live = 0;
+    if (fscanf(src->f, "%7s", key) != 1)
+        return 0;
+    if (strcmp(key, "end") == 0)
+        return 1;
+    return strcmp(key, "F") == 0 && folder_parse(src);
+}
+
+/**
+
+@brief Просеивание вниз в куче источников, упорядоченной по пути текущей записи.
+*/
+static void folder_heap_down(FolderSource **heap, size_t len, size_t i)
+{
+    for (;;)
+    {
+        size_t min = i, l = 2 * i + 1, r = l + 1;
+        if (l < len && strcmp(heap[l]->rec.path, heap[min]->rec.path) < 0)
+            min = l;
+        if (r < len && strcmp(heap[r]->rec.path, heap[min]->rec.path) < 0)
+            min = r;
+        if (min == i)
+            return;
+        FolderSource *tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+/**
+
+@brief k-путевое слияние отсортированных по пути итогов папок.
+
+Записи об одной папке из разных источников складываются, и emit
+получает каждую папку один раз, в порядке путей. В памяти одновременно
+только по одной записи на источник.
+
+@return 1 при успехе, 0 при испорченном источнике или ошибке emit.
+*/
+static int folder_merge(FolderSource *srcs, size_t n, int (*emit)(const FolderRec *rec, void *ctx), void *ctx)
+{
+    FolderSource **heap = malloc((n ? n : 1) * sizeof(*heap));
+    if (!heap)
+        return 0;
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++)
+        if (srcs[i].live)
+            heap[len++] = &srcs[i];
+    for (size_t i = len / 2; i-- > 0;)
+        folder_heap_down(heap, len, i);
+
+    FolderRec cur = {NULL, 0, 0};
+    size_t cur_cap = 0;
+    int have = 0, ok = 1;
+    while (len > 0)
+    {
+        FolderSource *top = heap[0];
+        if (!have || strcmp(top->rec.path, cur.path) != 0)
+        {
+            if (have && !emit(&cur, ctx))
+            {
+                ok = 0;
+                break;
+            }
+            size_t plen = strlen(top->rec.path);
+            if (plen + 1 > cur_cap)
+            {
+                char *path = realloc(cur.path, plen + 1);
+                if (!path)
+                {
+                    ok = 0;
+                    break;
+                }
+                cur.path = path;
+                cur_cap = plen + 1;
+            }
+            memcpy(cur.path, top->rec.path, plen + 1);
+            cur.files = cur.ticks = 0;
+            have = 1;
+        }
+        cur.files += top->rec.files;
+        cur.ticks += top->rec.ticks;
+
+        if (!folder_next(top))
+        {
+            fprintf(stderr, "%s: malformed folder record\n", top->name);
+            ok = 0;
+            break;
+        }
+        if (!top->live)
+            heap[0] = heap[--len];
+        folder_heap_down(heap, len, 0);
+    }
+    if (ok && have)
+        ok = emit(&cur, ctx);
+    free(cur.path);
+    free(heap);
+    return ok;
+}
+
+/**
+
+@brief Записывает итог папки в файл результата (emit для folder_merge).
+*/
+static int folder_emit_file(const FolderRec *rec, void *ctx)
+{
+    folder_write(ctx, rec);
+    return 1;
+}
+
+/**
+
+@brief Выводит отсортированные итоги папок из памяти и серий в файл f.
+*/
+static int folder_sink_write(WalkState *ws, FILE *f)
+{
+    FolderSink *sink = &ws->folders;
+    if (sink->nruns == 0)
+    {
+        qsort(sink->recs, sink->len, sizeof(*sink->recs), cmp_folder_path);
+        for (size_t i = 0; i < sink->len; i++)
+            folder_write(f, &sink->recs[i]);
+        return 1;
+    }
+
+    if (sink->len > 0)
+        folder_sink_spill(ws);
+    FolderSource *srcs = calloc(sink->nruns, sizeof(*srcs));
+    if (!srcs)
+        return 0;
+    int ok = 1;
+    for (size_t i = 0; i < sink->nruns && ok; i++)
+    {
+        srcs[i].f = sink->runs[i];
+        srcs[i].name = "folder run";
+        rewind(srcs[i].f);
+        ok = folder_next(&srcs[i]);
+    }
+    ok = ok && folder_merge(srcs, sink->nruns, folder_emit_file, f);
+    for (size_t i = 0; i < sink->nruns; i++)
+        free(srcs[i].rec.path);
+    free(srcs);
+    return ok;
+}
+
+/**
+
+@struct PartialHeader
+
+@brief Заголовок частичного результата (всё до итогов папок).
+*/
+typedef struct
+{
+    int shard;             /**< Номер части */
+    int nshards;           /**< Количество частей */
+    const unsigned char *shard_set; /**< Части объединённого результата (merge) или NULL */
+    int interrupted;       /**< Сканирование было прервано */
+    uint64_t unlisted;     /**< Папок, учтённых в итогах без записи «F» */
+    const Stats *stats;    /**< Итоги файлов */
+    const RootTotal *roots; /**< Итоги корней */
+    int nroots;            /**< Количество корней */
+    DurationDist *dist;    /**< Распределение длительностей */
+} PartialHeader;
+
+/**
+
+@brief Пишет заголовок частичного результата.
+
+Формат текстовый, все итоги — целые числа, поэтому результаты
+складываются без потерь:
+
+    mp4_scanner partial 2
+    shard I N                                    (у объединённого — по строке на часть)
+    interrupted 0|1
+    files N
+    total_us N
+    unlisted_folders N
+    R файлы папки микросекунды длина_пути путь   (по корню)
+    D количество минимум максимум                (распределение, мкс)
+    B корзина количество                         (ненулевые логарифмические корзины)
+    M минута количество                          (ненулевые поминутные корзины)
+    T среднее вес                                (центроиды t-digest, с --sketch)
+    F файлы микросекунды длина_пути путь         (по папке, по возрастанию пути)
+    end
+
+Количество папок — число записей «F» плюс unlisted_folders (папки из
+журнала --checkpoint, для которых известны только итоги поддерева).
+*/
+static void partial_write_header(FILE *f, const PartialHeader *hdr)
+{
+    fputs(PARTIAL_MAGIC, f);
+    if (hdr->shard_set)
+    {
+        for (int i = 0; i < hdr->nshards; i++)
+            if (hdr->shard_set[i])
+                fprintf(f, "shard %d %d\n", i, hdr->nshards);
+    }
+    else
+        fprintf(f, "shard %d %d\n", hdr->shard, hdr->nshards);
+    fprintf(f, "interrupted %d\n", hdr->interrupted);
+    fprintf(f, "files %llu\ntotal_us %llu\nunlisted_folders %llu\n", (unsigned long long)hdr->stats->total_files,
+            (unsigned long long)hdr->stats->total_ticks, (unsigned long long)hdr->unlisted);
+    for (int r = 0; r < hdr->nroots; r++)
+    {
+        const RootTotal *root = &hdr->roots[r];
+        fprintf(f, "R %llu %llu %llu %zu %s\n", (unsigned long long)root->files, (unsigned long long)root->folders,
+                (unsigned long long)root->ticks, strlen(root->path), root->path);
+    }
+
+    DurationDist *dist = hdr->dist;
+    if (dist->count == 0)
+        return;
+    fprintf(f, "D %llu %llu %llu\n", (unsigned long long)dist->count, (unsigned long long)dist->min,
+            (unsigned long long)dist->max);
+    for (unsigned i = 0; i < DUR_BUCKETS; i++)
+        if (dist->buckets[i])
+            fprintf(f, "B %u %llu\n", i, (unsigned long long)dist->buckets[i]);
+    for (unsigned i = 0; i < DUR_MINUTE_BUCKETS; i++)
+        if (dist->minutes[i])
+            fprintf(f, "M %u %llu\n", i, (unsigned long long)dist->minutes[i]);
+    if (dist->sketch)
+    {
+        tdigest_compress(dist->sketch);
+        for (size_t i = 0; i < dist->sketch->ncentroids; i++)
+            fprintf(f, "T %.17g %.17g\n", dist->sketch->centroids[i].mean, dist->sketch->centroids[i].weight);
+    }
+}
+
+/**
+
+@brief Открывает временный файл рядом с path для атомарной записи результата.
+*/
+static FILE *partial_create(const char *path, char *tmp, size_t tmp_size)
+{
+    if (snprintf(tmp, tmp_size, "%s.tmp", path) >= (int)tmp_size)
+        return NULL;
+    FILE *f = fopen(tmp, "wb");
+    if (!f)
+        perror(tmp);
+    return f;
+}
+
+/**
+
+@brief Дописывает «end», сбрасывает файл на диск и переименовывает его в path.
+
+@return 1 при успехе, 0 при ошибке (временный файл удаляется).
+*/
+static int partial_commit(FILE *f, const char *tmp, const char *path, int ok)
+{
+    fputs("end\n", f);
+    ok = ok && fflush(f) == 0 && !ferror(f);
+#ifndef _WIN32
+    ok = ok && fsync(fileno(f)) == 0;
+#endif
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0)
+    {
+        perror(path);
+        remove(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+
+@brief Записывает частичный результат сканирования (--partial, --shard) в файл path.
+
+@return 1 при успехе, 0 при ошибке.
+*/
+static int write_partial_result(const char *path, const Stats *stats, WalkState *ws)
+{
+    char tmp[PATH_MAX];
+    FILE *f = partial_create(path, tmp, sizeof(tmp));
+    if (!f)
+        return 0;
+
+    const Options *opts = ws->opts;
+    uint64_t folders = stats->total_folders_with_mp4;
+    PartialHeader hdr = {opts->shard_count ? opts->shard_index : 0,
+                         opts->shard_count ? opts->shard_count : 1,
+                         NULL,
+                         g_interrupted || ws->lost_entries ? 1 : 0,
+                         folders > ws->folders.count ? folders - ws->folders.count : 0,
+                         stats,
+                         ws->roots,
+                         ws->nroots,
+                         &ws->tally.dist};
+    partial_write_header(f, &hdr);
+    int ok = folder_sink_write(ws, f);
+    return partial_commit(f, tmp, path, ok);
+}
+
+/**
+
+@brief Печать подробной статистики ввода-вывода (--stats).
+*/
+static void print_stats_report(const WalkState *ws)
+{
+    ThreadStats total;
+    collect_thread_stats(&total);
+    double elapsed = (double)(now_ns() - ws->started_ns) / 1e9;
+
+    printf("\n\xF0\x9F\x93\x88 I/O statistics:\n");
+    printf("  %-8s %10s %10s %10s %9s %9s %9s %9s\n",
+           "phase", "count", "wall ms", "cpu ms", "p50 us", "p90 us", "p99 us", "max us");
+    for (int p = 0; p < PH_COUNT; p++)
+    {
+        const Histogram *h = &total.lat[p];
+        printf("  %-8s %10llu %10.1f %10.1f %9.1f %9.1f %9.1f %9.1f\n",
+               phase_names[p], (unsigned long long)total.ops[p],
+               total.wall_ns[p] / 1e6, total.cpu_ns[p] / 1e6,
+               hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+               hist_percentile(h, 99) / 1e3, h->max / 1e3);
+    }
+
+    double files = total.files_probed ? (double)total.files_probed : 1.0;
+    printf("  entries: %llu, files probed: %llu, bytes read: %llu (%.0f per file), "
+           "seeks: %llu, box hops: %llu (%.1f per file)\n",
+           (unsigned long long)total.entries, (unsigned long long)total.files_probed,
+           (unsigned long long)total.bytes_read, (double)total.bytes_read / files,
+           (unsigned long long)total.ops[PH_SEEK], (unsigned long long)total.box_hops,
+           (double)total.box_hops / files);
+
+    printf("  stat calls served without sync: %llu of %llu\n",
+           (unsigned long long)total.stats_dont_sync, (unsigned long long)total.ops[PH_STAT]);
+    printf("  opens: %llu with O_NOATIME, %llu fell back after EPERM, %llu plain, "
+           "%llu symlinks refused\n",
+           (unsigned long long)total.opens_noatime, (unsigned long long)total.opens_fallback,
+           (unsigned long long)total.opens_plain, (unsigned long long)total.opens_symlink_refused);
+    if (ws->opts->max_iops > 0 || ws->opts->max_opens > 0 || ws->opts->max_bw)
+    {
+        printf("  rate limits:");
+        if (ws->opts->max_iops > 0)
+            printf(" %.0f metadata ops/s (%.0f achieved)", ws->opts->max_iops,
+                   (double)(total.ops[PH_DIR_OPEN] + total.ops[PH_STAT]) / elapsed);
+        if (ws->opts->max_opens > 0)
+            printf(" %.0f opens/s (%.0f achieved)", ws->opts->max_opens, (double)total.ops[PH_FILE_OPEN] / elapsed);
+        if (ws->opts->max_bw)
+            printf(" %.2f MiB/s from storage (%.2f achieved)", (double)ws->opts->max_bw / (1024.0 * 1024.0),
+                   (double)total.bytes_storage / elapsed / (1024.0 * 1024.0));
+        printf("; %llu waits, %.3f s waited\n", (unsigned long long)total.throttle_waits, total.throttle_ns / 1e9);
+    }
+
+    if (ws->ndevices)
+    {
+        printf("  %-12s %5s %4s %10s %10s %10s %9s %9s %8s\n",
+               "device", "limit", "rot", "files", "files/s", "MiB/s", "queue max", "queue avg", "busy s");
+        for (size_t i = 0; i < ws->ndevices; i++)
+        {
+            const DeviceQueue *dq = &ws->devices[i];
+            char name[24];
+            format_dev(dq->dev, name, sizeof(name));
+            // Пропускная способность — по времени, пока с устройством шла работа
+            double span = dq->last_ns > dq->first_ns ? (double)(dq->last_ns - dq->first_ns) / 1e9 : 0.0;
+            double avg = dq->depth_samples ? (double)dq->depth_sum / (double)dq->depth_samples : 0.0;
+            printf("  %-12s %5d %4s %10llu %10.0f %10.2f %9zu %9.1f %8.2f\n", name, dq->limit,
+                   dq->rotational == 1 ? "hdd" : dq->rotational == 0 ? "ssd" : "?",
+                   (unsigned long long)dq->files, span > 0 ? (double)dq->files / span : 0.0,
+                   span > 0 ? (double)dq->bytes / span / (1024.0 * 1024.0) : 0.0, dq->max_queued, avg,
+                   (double)dq->busy_ns / 1e9);
+        }
+        for (size_t i = 0; i < ws->ndevices; i++)
+        {
+            const DeviceQueue *dq = &ws->devices[i];
+            if (!dq->timeline_len)
+                continue;
+            char name[24];
+            format_dev(dq->dev, name, sizeof(name));
+            printf("  concurrency of %s over time:\n", name);
+            for (size_t k = 0; k < dq->timeline_len; k++)
+            {
+                const AdaptPoint *point = &dq->timeline[k];
+                printf("    %8.2f s  limit %3d", (double)(point->at_ns - ws->started_ns) / 1e9, point->limit);
+                if (point->rate > 0.0)
+                    printf("  %10.0f files/s  %9.1f us/file", point->rate, point->latency_us);
+                printf("\n");
+            }
+            if (dq->timeline_dropped)
+                printf("    ... %llu more changes\n", (unsigned long long)dq->timeline_dropped);
+        }
+    }
+
+#ifndef _WIN32
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0)
+        printf("  run time: %.3f s wall, %.3f s user, %.3f s sys\n", elapsed,
+               ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+               ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+#else
+    printf("  run time: %.3f s wall\n", elapsed);
+#endif
+}
+
+/**
+
+@brief Значения опций по умолчанию.
+*/
+static void init_options(Options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->mem_budget = (size_t)DEFAULT_MEM_BUDGET_MB * 1024 * 1024;
+    opts->jobs = 1;
+    opts->max_depth = -1;
+    opts->follow_symlinks = 1;
+    opts->estimate_error = 0.01;
+    opts->model_tolerance = 0.05;
+}
+
+/**
+
+@brief Разбор размера с необязательным суффиксом K, M, G или T.
+
+@return 1 при успехе, 0 при ошибке.
+*/
+static int parse_size(const char *text, unsigned long long *out)
+{
+    char *end;
+    unsigned long long v = strtoull(text, &end, 10);
+    if (end == text)
+        return 0;
+    switch (toupper((unsigned char)*end))
+    {
+    case 'T':
+        v <<= 10;
+        /* fallthrough */
+    case 'G':
+        v <<= 10;
+        /* fallthrough */
+    case 'M':
+        v <<= 10;
+        /* fallthrough */
+    case 'K':
+        v <<= 10;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if (*end != '\0')
+        return 0;
+    *out = v;
+    return 1;
+}
+
+/**
+
+@brief Разбор имени бэкенда ввода-вывода.
+
+@return 1 при успехе, 0 если бэкенд неизвестен или недоступен на платформе.
+*/
+static int parse_io_backend(const char *name, IoBackend *out)
+{
+    for (int b = 0; b < IO_COUNT; b++)
+    {
+        if (strcmp(name, io_backend_names[b]) == 0)
+        {
+#ifdef _WIN32
+            if (b != IO_STDIO)
+                return 0;
+#endif
+            *out = (IoBackend)b;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+
+@brief Разбор списка подсказок ядру через запятую (random, dontneed, readahead, none).
+
+@return 1 при успехе, 0 при ошибке.
+*/
+static int parse_io_hints(const char *list, unsigned *out)
+{
+    char buf[64];
+    unsigned hints = 0;
+
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ","))
+    {
+        if (!strcmp(tok, "random"))
+            hints |= IO_HINT_RANDOM;
+        else if (!strcmp(tok, "dontneed"))
+            hints |= IO_HINT_DONTNEED;
+        else if (!strcmp(tok, "readahead"))
+            hints |= IO_HINT_READAHEAD;
+        else if (strcmp(tok, "none") != 0)
+            return 0;
+    }
+    *out = hints;
+    return 1;
+}
+
+/**
+
+@brief Освобождает ресурсы, захваченные при разборе опций.
+*/
+static void free_options(Options *opts)
+{
+    for (size_t i = 0; i < opts->nmatch_rules; i++)
+        free(opts->match_rules[i]);
+    free(opts->match_rules);
+    opts->match_rules = NULL;
+    opts->nmatch_rules = 0;
+#ifndef _WIN32
+    if (opts->group.kind == GROUP_REGEX)
+        regfree(&opts->group.re);
+#endif
+    opts->group.kind = GROUP_NONE;
+}
+
+/**
+
+@brief Разбор --group-by: depth:N, regex:ВЫРАЖЕНИЕ или uid.
+
+@return 1 при успехе, 0 при ошибке.
+*/
+static int parse_group_by(const char *spec, GroupBy *group)
+{
+    group->spec = spec;
+    if (strncmp(spec, "depth:", 6) == 0)
+    {
+        char *end;
+        long depth = strtol(spec + 6, &end, 10);
+        if (*end != '\0' || depth < 1 || depth > 255)
+            return 0;
+        group->kind = GROUP_DEPTH;
+        group->depth = (int)depth;
+        return 1;
+    }
+#ifndef _WIN32
+    if (strncmp(spec, "regex:", 6) == 0)
+    {
+        int rc = regcomp(&group->re, spec + 6, REG_EXTENDED);
+        if (rc != 0)
+        {
+            char msg[256];
+            regerror(rc, &group->re, msg, sizeof(msg));
+            fprintf(stderr, "--group-by: %s\n", msg);
+            return 0;
+        }
+        group->kind = GROUP_REGEX;
+        return 1;
+    }
+    if (strcmp(spec, "uid") == 0)
+    {
+        group->kind = GROUP_UID;
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/**
+
+@brief Разбор одной опции сканирования.
+
+Используется и основным режимом, и подкомандой bench, чтобы
+замеры проводились с теми же настройками, что и обычный запуск.
+
+@return 1 — опция разобрана, 0 — позиционный аргумент, -1 — ошибка.
+*/
+static int parse_scan_option(int argc, char *argv[], int *i, Options *opts)
+{
+    const char *arg = argv[*i];
+
+    if (strcmp(arg, "-v") == 0)
+    {
+        opts->verbose = 1;
+    }
+    else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--jobs") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        long jobs = strtol(argv[++*i], &end, 10);
+        if (*end != '\0' || jobs < 0 || jobs > 1024)
+            return -1;
+        if (jobs == 0)
+        {
+#ifdef _SC_NPROCESSORS_ONLN
+            jobs = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+            if (jobs < 1)
+                jobs = 1;
+        }
+        opts->jobs = (int)jobs;
+    }
+    else if (strcmp(arg, "--top") == 0 || strcmp(arg, "--bottom") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        unsigned long long n = strtoull(argv[++*i], &end, 10);
+        if (*end != '\0' || argv[*i][0] == '-' || n > 10000000ull)
+            return -1;
+        if (strcmp(arg, "--top") == 0)
+            opts->top_n = (size_t)n;
+        else
+            opts->bottom_n = (size_t)n;
+    }
+    else if (strcmp(arg, "--group-by") == 0)
+    {
+        if (*i + 1 >= argc || opts->group.kind != GROUP_NONE)
+            return -1;
+        return parse_group_by(argv[++*i], &opts->group) ? 1 : -1;
+    }
+    else if (strcmp(arg, "--files-from") == 0)
+    {
+        if (*i + 1 >= argc)
+            return -1;
+        opts->files_from = argv[++*i];
+    }
+    else if (strcmp(arg, "-0") == 0 || strcmp(arg, "--null") == 0)
+        opts->list_nul = 1;
+    else if (strcmp(arg, "-L") == 0)
+        opts->follow_symlinks = 1;
+    else if (strcmp(arg, "-P") == 0)
+        opts->follow_symlinks = 0;
+    else if (strcmp(arg, "--dedupe-hardlinks") == 0)
+        opts->dedupe_hardlinks = 1;
+    else if (strcmp(arg, "--adaptive") == 0)
+        opts->adaptive = 1;
+    else if (strcmp(arg, "--max-iops") == 0 || strcmp(arg, "--max-opens") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        double rate = strtod(argv[++*i], &end);
+        if (*end || !(rate > 0))
+            return -1;
+        if (strcmp(arg, "--max-iops") == 0)
+            opts->max_iops = rate;
+        else
+            opts->max_opens = rate;
+    }
+    else if (strcmp(arg, "--idle") == 0)
+        opts->idle = 1;
+    else if (strcmp(arg, "--shard") == 0)
+    {
+        int index, count, used = 0;
+        if (*i + 1 >= argc || sscanf(argv[++*i], "%d/%d%n", &index, &count, &used) != 2 || argv[*i][used] ||
+            count < 1 || index < 0 || index >= count)
+            return -1;
+        opts->shard_index = index;
+        opts->shard_count = count;
+    }
+    else if (strcmp(arg, "--shard-depth") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        const char *value = argv[++*i];
+        long depth = strcmp(value, "auto") == 0 ? 0 : strtol(value, &end, 10);
+        if (strcmp(value, "auto") != 0 && (*end || depth < 1 || depth > INT_MAX))
+            return -1;
+        opts->shard_depth = (int)depth;
+    }
+    else if (strcmp(arg, "--partial") == 0)
+    {
+        if (*i + 1 >= argc)
+            return -1;
+        opts->partial = argv[++*i];
+    }
+    else if (strcmp(arg, "--estimate") == 0)
+        opts->estimate = 1;
+    else if (strcmp(arg, "--estimate-error") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        double pct = strtod(argv[++*i], &end);
+        if (*end != '\0' || !(pct > 0 && pct < 100))
+            return -1;
+        opts->estimate = 1;
+        opts->estimate_error = pct / 100;
+    }
+    else if (strcmp(arg, "--estimate-time") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        double sec = strtod(argv[++*i], &end);
+        if (*end != '\0' || !(sec > 0 && sec < 1e6))
+            return -1;
+        opts->estimate = 1;
+        opts->estimate_time_ms = (unsigned)(sec * 1000);
+        if (opts->estimate_time_ms == 0)
+            opts->estimate_time_ms = 1;
+    }
+    else if (strcmp(arg, "--bitrate-model") == 0)
+        opts->bitrate_model = 1;
+    else if (strncmp(arg, "--bitrate-model=", 16) == 0)
+    {
+        char *end;
+        double pct = strtod(arg + 16, &end);
+        if (*end != '\0' || !(pct > 0 && pct < 100))
+            return -1;
+        opts->bitrate_model = 1;
+        opts->model_tolerance = pct / 100;
+    }
+    else if (strcmp(arg, "--exclude") == 0 || strcmp(arg, "--include") == 0)
+    {
+        if (*i + 1 >= argc || !*argv[*i + 1])
+            return -1;
+        const char *glob = argv[++*i];
+        char **grown = realloc(opts->match_rules, (opts->nmatch_rules + 1) * sizeof(*grown));
+        if (!grown)
+            return -1;
+        opts->match_rules = grown;
+        // --include — то же правило с отрицанием, как !ШАБЛОН в .scanignore
+        int include = strcmp(arg, "--include") == 0;
+        size_t len = strlen(glob);
+        char *rule = malloc(len + 2);
+        if (!rule)
+            return -1;
+        rule[0] = '!';
+        memcpy(rule + include, glob, len + 1);
+        opts->match_rules[opts->nmatch_rules++] = rule;
+    }
+    else if (strcmp(arg, "--no-scanignore") == 0)
+        opts->no_scanignore = 1;
+    else if (strcmp(arg, "--checkpoint") == 0)
+    {
+        if (*i + 1 >= argc)
+            return -1;
+        opts->checkpoint = argv[++*i];
+    }
+    else if (strcmp(arg, "--max-bw") == 0)
+    {
+        if (*i + 1 >= argc || !parse_size(argv[++*i], &opts->max_bw) || !opts->max_bw)
+            return -1;
+    }
+    else if (strcmp(arg, "-x") == 0 || strcmp(arg, "--one-file-system") == 0)
+        opts->one_file_system = 1;
+    else if (strcmp(arg, "--device-jobs") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        long n = strtol(argv[++*i], &end, 10);
+        if (*end || n < 1 || n > 1024)
+            return -1;
+        opts->device_jobs = (int)n;
+    }
+    else if (strcmp(arg, "--du") == 0)
+        opts->rollup = ROLLUP_DU;
+    else if (strcmp(arg, "--tree") == 0)
+        opts->rollup = ROLLUP_TREE;
+    else if (strcmp(arg, "--max-depth") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        long depth = strtol(argv[++*i], &end, 10);
+        if (*end != '\0' || depth < 0 || depth > INT_MAX)
+            return -1;
+        opts->max_depth = (int)depth;
+    }
+    else if (strcmp(arg, "--histogram") == 0)
+        opts->histogram = 1;
+    else if (strcmp(arg, "--sketch") == 0)
+        opts->sketch = 1;
+    else if (strcmp(arg, "--format") == 0)
+    {
+        if (*i + 1 >= argc)
+            return -1;
+        const char *fmt = argv[++*i];
+        if (strcmp(fmt, "json") == 0)
+            opts->format_json = 1;
+        else if (strcmp(fmt, "text") == 0)
+            opts->format_json = 0;
+        else
+            return -1;
+    }
+    else if (strcmp(arg, "--bfs") == 0)
+    {
+        opts->walk_bfs = 1;
+    }
+    else if (strcmp(arg, "--mem-budget") == 0)
+    {
+        char *end;
+        if (*i + 1 >= argc)
+            return -1;
+        unsigned long long mb = strtoull(argv[++*i], &end, 10);
+        if (*end != '\0')
+            return -1;
+        opts->mem_budget = (size_t)mb * 1024 * 1024;
+    }
+    else if (strcmp(arg, "--stats") == 0)
+    {
+        opts->stats = 1;
+    }
+    else if (strcmp(arg, "--statx-sync") == 0)
+    {
+        const char *mode = *i + 1 < argc ? argv[++*i] : "";
+        if (!strcmp(mode, "auto"))
+            opts->statx_sync = STATX_SYNC_AUTO;
+        else if (!strcmp(mode, "sync"))
+            opts->statx_sync = STATX_SYNC_ON;
+        else if (!strcmp(mode, "dontsync"))
+            opts->statx_sync = STATX_SYNC_OFF;
+        else
+            return -1;
+    }
+    else if (strcmp(arg, "--nofollow") == 0)
+    {
+        opts->nofollow = 1;
+    }
+    else if (strcmp(arg, "--io-hints") == 0)
+    {
+        if (*i + 1 >= argc || !parse_io_hints(argv[++*i], &opts->io_hints))
+            return -1;
+    }
+    else if (strcmp(arg, "--io") == 0)
+    {
+        if (*i + 1 >= argc || !parse_io_backend(argv[++*i], &opts->io_backend))
+            return -1;
+    }
+    else if (strcmp(arg, "--progress") == 0)
+    {
+        opts->progress_ms = 1000;
+    }
+    else if (strncmp(arg, "--progress=", 11) == 0)
+    {
+        char *end;
+        double sec = strtod(arg + 11, &end);
+        if (*end != '\0' || sec <= 0)
+            return -1;
+        opts->progress_ms = (unsigned)(sec * 1000);
+        if (opts->progress_ms == 0)
+            opts->progress_ms = 1;
+    }
+    else if (arg[0] == '-' && arg[1] != '\0')
+    {
+        return -1;
+    }
+    else
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+
+@struct ProcIo
+
+@brief Счётчики ввода-вывода процесса из /proc/self/io.
+*/
+typedef struct
+{
+    unsigned long long rchar;      /**< Байт, возвращённых read() и аналогами */
+    unsigned long long syscr;      /**< Количество системных вызовов чтения */
+    unsigned long long read_bytes; /**< Байт, реально прочитанных с устройства */
+} ProcIo;
+
+/**
+
+@brief Чтение /proc/self/io.
+
+@return 1 при успехе, 0 если счётчики недоступны.
+*/
+static int read_proc_io(ProcIo *io)
+{
+    memset(io, 0, sizeof(*io));
+#ifdef __linux__
+    FILE *f = fopen("/proc/self/io", "r");
+    char line[128];
+    int found = 0;
+
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        found += sscanf(line, "rchar: %llu", &io->rchar);
+        found += sscanf(line, "syscr: %llu", &io->syscr);
+        found += sscanf(line, "read_bytes: %llu", &io->read_bytes);
+    }
+    fclose(f);
+    return found == 3;
+#else
+    return 0;
+#endif
+}
+
+/**
+
+@struct GenOptions
+
+@brief Параметры синтетического дерева для бенчмарка.
+*/
+typedef struct
+{
+    int depth;                    /**< Глубина дерева */
+    int fanout;                   /**< Подпапок в каждой папке */
+    int files;                    /**< Файлов в каждой папке */
+    double mp4_ratio;             /**< Доля MP4 среди файлов */
+    double moov_end_ratio;        /**< Доля MP4 с moov после mdat */
+    double fragmented_ratio;      /**< Доля фрагментированных MP4 */
+    double largesize_ratio;       /**< Доля MP4 с 64-битным размером mdat */
+    double corrupt_ratio;         /**< Доля повреждённых MP4 */
+    unsigned long long mdat_size; /**< Размер mdat (создаётся дыркой) */
+    unsigned long long moov_size; /**< Примерный размер moov */
+    unsigned long long bitrate;   /**< Байт в секунду (0 — mdat постоянного размера) */
+    uint64_t seed;                /**< Начальное значение генератора */
+} GenOptions;
+
+/**
+
+@struct GenTotals
+
+@brief Что было создано генератором.
+*/
+typedef struct
+{
+    long long dirs;
+    long long mp4;
+    long long faststart;
+    long long moov_end;
+    long long fragmented;
+    long long largesize;
+    long long corrupt;
+    long long other;
+    double duration_seconds; /**< Ожидаемая сумма по неповреждённым MP4 */
+} GenTotals;
+
+/**
+
+@brief Запись 32-битного big-endian значения в буфер.
+*/
+static void put_u32_be(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/**
+
+@brief Запись 64-битного big-endian значения в буфер.
+*/
+static void put_u64_be(uint8_t *p, uint64_t v)
+{
+    put_u32_be(p, (uint32_t)(v >> 32));
+    put_u32_be(p + 4, (uint32_t)v);
+}
+
+/**
+
+@brief Запись заголовка атома в буфер.
+
+@return Длина заголовка (8 или 16 байт).
+*/
+static size_t put_box_header(uint8_t *p, const char *type, uint64_t size, int largesize)
+{
+    if (largesize)
+    {
+        put_u32_be(p, 1);
+        memcpy(p + 4, type, 4);
+        put_u64_be(p + 8, size);
+        return 16;
+    }
+    put_u32_be(p, (uint32_t)size);
+    memcpy(p + 4, type, 4);
+    return 8;
+}
+
+/**
+
+@brief Собирает атом moov в буфер.
+
+@return Размер атома.
+*/
+static size_t build_moov(uint8_t *buf, size_t cap, uint32_t timescale, uint64_t duration,
+                         int version, int fragmented, size_t pad)
+{
+    size_t mvhd_size = version == 1 ? 8 + 4 + 28 + 80 : 8 + 4 + 16 + 80;
+    size_t mvex_size = fragmented ? 8 + 8 + 4 + 4 : 0;
+    size_t moov_size = 8 + mvhd_size + mvex_size;
+    size_t pos;
+
+    if (pad > 8 && moov_size + pad <= cap)
+        moov_size += pad;
+    else
+        pad = 0;
+    if (moov_size > cap)
+        return 0;
+
+    memset(buf, 0, moov_size);
+    pos = put_box_header(buf, "moov", moov_size, 0);
+    pos += put_box_header(buf + pos, "mvhd", mvhd_size, 0);
+    buf[pos] = (uint8_t)version;
+    pos += 4;
+    if (version == 1)
+    {
+        pos += 16; // creation/modification time
+        put_u32_be(buf + pos, timescale);
+        put_u64_be(buf + pos + 4, fragmented ? 0 : duration);
+        pos += 12;
+    }
+    else
+    {
+        pos += 8;
+        put_u32_be(buf + pos, timescale);
+        put_u32_be(buf + pos + 4, fragmented ? 0 : (uint32_t)duration);
+        pos += 8;
+    }
+    pos += 80; // rate, volume, matrix, next_track_id
+    if (fragmented)
+    {
+        pos += put_box_header(buf + pos, "mvex", mvex_size, 0);
+        pos += put_box_header(buf + pos, "mehd", 16, 0);
+        pos += 4;
+        put_u32_be(buf + pos, (uint32_t)duration);
+        pos += 4;
+    }
+    if (pad)
+        put_box_header(buf + pos, "free", pad, 0);
+    return moov_size;
+}
+
+/**
+
+@brief Создаёт один синтетический MP4-файл.
+
+Содержимое mdat не записывается: файл расширяется через
+ftruncate()/fseeko(), поэтому mdat любого размера занимает только
+дырку в разреженном файле.
+*/
+static int gen_mp4(const char *path, const GenOptions *g, uint64_t *rng, GenTotals *totals)
+{
+    static uint8_t moov[1 << 20];
+    static const uint32_t timescales[] = {600, 1000, 90000};
+    uint8_t head[64];
+    size_t pos = 0;
+
+    FILE *f = fopen(path, "wb");
+    if (!f)
+        return 0;
+
+    uint32_t timescale = timescales[rng_next(rng) % 3];
+    uint64_t seconds = 1 + rng_next(rng) % 7200;
+    uint64_t duration = seconds * timescale;
+    uint64_t mdat_size = g->bitrate ? seconds * g->bitrate : g->mdat_size;
+    // mdat больше 4 ГиБ описывается только 64-битным размером
+    int largesize = rng_unit(rng) < g->largesize_ratio || mdat_size + 8 > UINT32_MAX;
+    int fragmented = !largesize && rng_unit(rng) < g->fragmented_ratio;
+    int moov_end = !fragmented && rng_unit(rng) < g->moov_end_ratio;
+    int corrupt = rng_unit(rng) < g->corrupt_ratio;
+    int version = (largesize || duration > UINT32_MAX) ? 1 : (int)(rng_next(rng) & 1);
+    size_t moov_size = build_moov(moov, sizeof(moov), timescale, duration, version, fragmented,
+                                  (size_t)g->moov_size);
+
+    pos += put_box_header(head + pos, "ftyp", 24, 0);
+    memcpy(head + pos, "isom\0\0\x02\0isomiso2", 16);
+    pos += 16;
+
+    if (corrupt)
+    {
+        // Повреждения: атом нулевой длины, размер меньше заголовка или
+        // moov, обрезанный на середине.
+        switch (rng_next(rng) % 3)
+        {
+        case 0:
+            put_box_header(head + pos, "wide", 0, 0);
+            pos += 8;
+            break;
+        case 1:
+            put_box_header(head + pos, "junk", 3, 0);
+            pos += 8;
+            break;
+        default:
+            moov_size = 8 + 8 + 4; // обрыв внутри mvhd
+            break;
+        }
+        fwrite(head, 1, pos, f);
+        fwrite(moov, 1, moov_size, f);
+        totals->corrupt++;
+    }
+    else if (fragmented)
+    {
+        // ftyp, moov с mvex/mehd, затем пары moof + mdat
+        fwrite(head, 1, pos, f);
+        fwrite(moov, 1, moov_size, f);
+        uint64_t chunk = mdat_size / 4 + 8;
+        for (int k = 0; k < 4; k++)
+        {
+            uint8_t frag[32];
+            size_t n = put_box_header(frag, "moof", 16, 0);
+            n += put_box_header(frag + n, "mfhd", 8, 0);
+            n += put_box_header(frag + n, "mdat", chunk, 0);
+            fwrite(frag, 1, n, f);
+            fseeko(f, (off_t)(chunk - 8), SEEK_CUR);
+        }
+        totals->fragmented++;
+    }
+    else
+    {
+        uint64_t mdat_total = mdat_size + (largesize ? 16 : 8);
+        if (!moov_end)
+        {
+            fwrite(head, 1, pos, f);
+            fwrite(moov, 1, moov_size, f);
+        }
+        else
+        {
+            fwrite(head, 1, pos, f);
+        }
+        uint8_t mdat[16];
+        fwrite(mdat, 1, put_box_header(mdat, "mdat", mdat_total, largesize), f);
+        fseeko(f, (off_t)mdat_size, SEEK_CUR);
+        if (moov_end)
+            fwrite(moov, 1, moov_size, f);
+        if (moov_end)
+            totals->moov_end++;
+        else
+            totals->faststart++;
+        if (largesize)
+            totals->largesize++;
+    }
+
+    // Для файлов, заканчивающихся дыркой, длина задаётся явно
+    fflush(f);
+    off_t end = ftello(f);
+    if (ftruncate(fileno(f), end) != 0)
+    {
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    totals->mp4++;
+    if (!corrupt)
+        totals->duration_seconds += fragmented ? 0.0 : (double)seconds;
+    return 1;
+}
+
+/**
+
+@brief Рекурсивно создаёт папку синтетического дерева.
+*/
+static int gen_dir(const char *path, int level, const GenOptions *g, uint64_t *rng, GenTotals *totals)
+{
+    char child[PATH_MAX];
+    GenOptions folder = *g;
+
+    // Своя камера или пресет в каждой папке: битрейт от половины до двойного
+    if (g->bitrate)
+        folder.bitrate = (unsigned long long)((double)g->bitrate * (0.5 + 1.5 * rng_unit(rng)));
+
+#ifdef _WIN32
+    if (mkdir(path) != 0 && errno != EEXIST)
+#else
+    if (mkdir(path, 0755) != 0 && errno != EEXIST)
+#endif
+    {
+        perror(path);
+        return 0;
+    }
+    totals->dirs++;
+
+    for (int i = 0; i < g->files; i++)
+    {
+        if (rng_unit(rng) < g->mp4_ratio)
+        {
+            snprintf(child, sizeof(child), "%s/clip_%04d.mp4", path, i);
+            if (!gen_mp4(child, &folder, rng, totals))
+            {
+                perror(child);
+                return 0;
+            }
+        }
+        else
+        {
+            snprintf(child, sizeof(child), "%s/note_%04d.txt", path, i);
+            FILE *f = fopen(child, "w");
+            if (!f)
+            {
+                perror(child);
+                return 0;
+            }
+            fputs("not a video\n", f);
+            fclose(f);
+            totals->other++;
+        }
+    }
+
+    if (level < g->depth)
+    {
+        for (int i = 0; i < g->fanout; i++)
+        {
+            snprintf(child, sizeof(child), "%s/dir_%03d", path, i);
+            if (!gen_dir(child, level + 1, g, rng, totals))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+
+@brief Разбор доли в диапазоне [0, 1].
+*/
+static int parse_ratio(const char *text, double *out)
+{
+    char *end;
+    double v = strtod(text, &end);
+    if (*end != '\0' || v < 0 || v > 1)
+        return 0;
+    *out = v;
+    return 1;
+}
+
+/**
+
+@brief Подкоманда gentree: создание синтетического дерева MP4-файлов.
+
+Печатает в stdout JSON с описанием созданного дерева, включая
+ожидаемую суммарную длительность.
+
+@param prog Имя программы для текста справки (argv[0] — имя подкоманды).
+*/
+static int gentree_main(const char *prog, int argc, char *argv[])
+{
+    GenOptions g = {3, 4, 10, 0.8, 0.5, 0.1, 0.05, 0.02, 64 * 1024, 4096, 0, 1};
+    GenTotals totals = {0};
+    const char *root = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *val = i + 1 < argc ? argv[i + 1] : NULL;
+        int ok = 1;
+        unsigned long long n;
+
+        if (arg[0] != '-')
+        {
+            root = arg;
+            continue;
+        }
+        if (!val)
+            ok = 0;
+        else if (!strcmp(arg, "--depth"))
+            g.depth = atoi(val);
+        else if (!strcmp(arg, "--fanout"))
+            g.fanout = atoi(val);
+        else if (!strcmp(arg, "--files"))
+            g.files = atoi(val);
+        else if (!strcmp(arg, "--mp4-ratio"))
+            ok = parse_ratio(val, &g.mp4_ratio);
+        else if (!strcmp(arg, "--moov-end"))
+            ok = parse_ratio(val, &g.moov_end_ratio);
+        else if (!strcmp(arg, "--fragmented"))
+            ok = parse_ratio(val, &g.fragmented_ratio);
+        else if (!strcmp(arg, "--largesize"))
+            ok = parse_ratio(val, &g.largesize_ratio);
+        else if (!strcmp(arg, "--corrupt"))
+            ok = parse_ratio(val, &g.corrupt_ratio);
+        else if (!strcmp(arg, "--mdat-size") && (ok = parse_size(val, &n)))
+            g.mdat_size = n;
+        else if (!strcmp(arg, "--moov-size") && (ok = parse_size(val, &n)))
+            g.moov_size = n;
+        else if (!strcmp(arg, "--bitrate") && (ok = parse_size(val, &n)))
+            g.bitrate = n;
+        else if (!strcmp(arg, "--seed"))
+            g.seed = strtoull(val, NULL, 10);
+        else
+            ok = 0;
+
+        if (!ok || g.depth < 0 || g.fanout < 0 || g.files < 0)
+        {
+            fprintf(stderr,
+                    "Usage: %s gentree DIR [--depth N] [--fanout N] [--files N]\n"
+                    "       [--mp4-ratio F] [--moov-end F] [--fragmented F] [--largesize F]\n"
+                    "       [--corrupt F] [--mdat-size SIZE] [--moov-size SIZE] [--bitrate SIZE]\n"
+                    "       [--seed N]\n",
+                    prog);
+            return 1;
+        }
+        i++;
+    }
+    if (!root)
+    {
+        fprintf(stderr, "gentree: target folder is required\n");
+        return 1;
+    }
+
+    uint64_t rng = g.seed ? g.seed : 1;
+    if (!gen_dir(root, 0, &g, &rng, &totals))
+        return 1;
+
+    printf("{\n  \"root\": ");
+    json_print_string(stdout, root);
+    printf(",\n"
+           "  \"seed\": %llu,\n"
+           "  \"depth\": %d,\n"
+           "  \"fanout\": %d,\n"
+           "  \"files_per_dir\": %d,\n"
+           "  \"mdat_size\": %llu,\n"
+           "  \"bitrate\": %llu,\n"
+           "  \"dirs\": %lld,\n"
+           "  \"mp4_files\": %lld,\n"
+           "  \"faststart\": %lld,\n"
+           "  \"moov_at_end\": %lld,\n"
+           "  \"fragmented\": %lld,\n"
+           "  \"largesize\": %lld,\n"
+           "  \"corrupt\": %lld,\n"
+           "  \"other_files\": %lld,\n"
+           "  \"expected_duration_seconds\": %.0f\n"
+           "}\n",
+           (unsigned long long)g.seed, g.depth, g.fanout, g.files,
+           g.mdat_size, g.bitrate, totals.dirs, totals.mp4, totals.faststart, totals.moov_end,
+           totals.fragmented, totals.largesize, totals.corrupt, totals.other,
+           totals.duration_seconds);
+    return 0;
+}
+
+/**
+
+@enum EvictMode
+
+@brief Способ вытеснения дерева из кэша перед холодным прогоном.
+*/
+typedef enum
+{
+    EVICT_AUTO,    /**< drop_caches при наличии прав, иначе fadvise */
+    EVICT_FADVISE, /**< posix_fadvise(DONTNEED) для каждого файла и папки */
+    EVICT_DROP     /**< Запись в /proc/sys/vm/drop_caches (нужны права root) */
+} EvictMode;
+
+static const char *evict_mode_names[] = {"auto", "fadvise", "drop_caches"};
+
+#ifdef POSIX_FADV_DONTNEED
+/**
+
+@brief Вытесняет из кэша страниц файл или папку дерева (posix_fadvise DONTNEED).
+*/
+static int evict_file_cb(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    (void)ftw;
+    if ((type == FTW_F && S_ISREG(st->st_mode)) || type == FTW_D)
+    {
+        int fd = open(path, O_RDONLY | (type == FTW_D ? O_DIRECTORY : 0));
+        if (fd >= 0)
+        {
+            if (type == FTW_F)
+                fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+#endif
+
+/**
+
+@brief Сбрасывает весь кэш страниц, dentry и inode через drop_caches.
+
+@return 1 при успехе, 0 если нет прав или интерфейс недоступен.
+*/
+static int drop_all_caches(void)
+{
+#ifdef __linux__
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0)
+        return 0;
+    int ok = write(fd, "3\n", 2) == 2;
+    close(fd);
+    return ok;
+#else
+    return 0;
+#endif
+}
+
+/**
+
+@brief Вытесняет дерево из кэша выбранным способом.
+
+При EVICT_AUTO первая неудача drop_caches переключает режим на
+fadvise до конца бенчмарка.
+
+@return Фактически использованный способ.
+*/
+static EvictMode evict_tree(const char *root, EvictMode *mode)
+{
+    if (*mode != EVICT_FADVISE)
+    {
+        if (drop_all_caches())
+            return EVICT_DROP;
+        if (*mode == EVICT_DROP)
+            fprintf(stderr, "bench: drop_caches is not permitted, falling back to fadvise\n");
+        *mode = EVICT_FADVISE;
+    }
+#ifdef POSIX_FADV_DONTNEED
+    nftw(root, evict_file_cb, 16, FTW_PHYS);
+#else
+    (void)root;
+#endif
+    return EVICT_FADVISE;
+}
+
+/**
+
+@struct BenchRun
+
+@brief Результат одного прогона бенчмарка.
+*/
+typedef struct
+{
+    int cold;            /**< Прогон с холодным кэшем */
+    IoBackend backend;   /**< Бэкенд чтения заголовков */
+    EvictMode evicted;   /**< Способ вытеснения (для холодных прогонов) */
+    double seconds;      /**< Реальное время прогона */
+    Stats stats;         /**< Итог сканирования */
+    ThreadStats delta;   /**< Счётчики прогона */
+    ProcIo io;           /**< Разница /proc/self/io за прогон */
+} BenchRun;
+
+/** Размер файла фоновой нагрузки бенчмарка. */
+#define BENCH_LOAD_FILE_SIZE (64ull * 1024 * 1024)
+/** Размер блока фоновой нагрузки. */
+#define BENCH_LOAD_BLOCK (64 * 1024)
+
+/**
+
+@struct BenchLoad
+
+@brief Фоновая нагрузка бенчмарка (--load): потоки случайного чтения и записи.
+
+Имитирует конкурирующую задачу вроде fio randrw на том же устройстве,
+чтобы сравнить скорость сканирования с --idle и без него. Файл
+создаётся в сканируемой папке и сразу удаляется, поэтому в обход не
+попадает.
+*/
+typedef struct
+{
+    int fd;                    /**< Общий файл нагрузки */
+    int nthreads;              /**< Запущено потоков */
+    pthread_t *threads;
+    atomic_int stop;           /**< Просьба остановиться */
+    _Atomic uint64_t ops;      /**< Выполнено операций */
+    uint64_t started_ns;       /**< Начало нагрузки */
+} BenchLoad;
+
+/**
+
+@brief Поток нагрузки: случайные чтения мимо кэша и записи с fdatasync().
+*/
+static void *bench_load_worker(void *arg)
+{
+    BenchLoad *load = arg;
+    uint64_t rng = now_ns() | 1;
+    char *block = malloc(BENCH_LOAD_BLOCK);
+    if (!block)
+        return NULL;
+    memset(block, 0x5A, BENCH_LOAD_BLOCK);
+
+    while (!atomic_load_explicit(&load->stop, memory_order_relaxed))
+    {
+        off_t off = (off_t)(rng_next(&rng) % (BENCH_LOAD_FILE_SIZE / BENCH_LOAD_BLOCK)) * BENCH_LOAD_BLOCK;
+        if (rng_next(&rng) % 4 == 0)
+        {
+            if (pwrite(load->fd, block, BENCH_LOAD_BLOCK, off) < 0 || fdatasync(load->fd) != 0)
+                break;
+        }
+        else
+        {
+#ifdef POSIX_FADV_DONTNEED
+            posix_fadvise(load->fd, off, BENCH_LOAD_BLOCK, POSIX_FADV_DONTNEED);
+#endif
+            if (pread(load->fd, block, BENCH_LOAD_BLOCK, off) < 0)
+                break;
+        }
+        atomic_fetch_add_explicit(&load->ops, 1, memory_order_relaxed);
+    }
+    free(block);
+    return NULL;
+}
+
+/**
+
+@brief Создаёт файл нагрузки в папке root и запускает nthreads потоков.
+
+Потоки создаются до того, как --idle понизит приоритет сканера, и
+наследуют обычный приоритет.
+
+@return 1 при успехе, 0 при ошибке.
+*/
+static int bench_load_start(BenchLoad *load, const char *root, int nthreads)
+{
+    char path[PATH_MAX];
+    memset(load, 0, sizeof(*load));
+    snprintf(path, sizeof(path), "%s/.mp4_scanner-load-XXXXXX", root);
+    load->fd = mkstemp(path);
+    if (load->fd < 0)
+    {
+        perror("bench: cannot create load file");
+        return 0;
+    }
+    unlink(path);
+
+    char *chunk = calloc(1, BENCH_LOAD_BLOCK);
+    int ok = chunk != NULL;
+    for (uint64_t off = 0; ok && off < BENCH_LOAD_FILE_SIZE; off += BENCH_LOAD_BLOCK)
+        ok = pwrite(load->fd, chunk, BENCH_LOAD_BLOCK, (off_t)off) == BENCH_LOAD_BLOCK;
+    free(chunk);
+    load->threads = calloc((size_t)nthreads, sizeof(*load->threads));
+    if (!ok || !load->threads || fsync(load->fd) != 0)
+    {
+        fprintf(stderr, "bench: cannot prepare load file\n");
+        free(load->threads);
+        close(load->fd);
+        return 0;
+    }
+    load->started_ns = now_ns();
+    for (int i = 0; i < nthreads; i++)
+    {
+        if (pthread_create(&load->threads[i], NULL, bench_load_worker, load) != 0)
+            break;
+        load->nthreads++;
+    }
+    return 1;
+}
+
+/**
+
+@brief Останавливает нагрузку.
+
+@return Операций нагрузки в секунду за всё время её работы.
+*/
+static double bench_load_stop(BenchLoad *load)
+{
+    atomic_store(&load->stop, 1);
+    for (int i = 0; i < load->nthreads; i++)
+        pthread_join(load->threads[i], NULL);
+    double seconds = (double)(now_ns() - load->started_ns) / 1e9;
+    free(load->threads);
+    close(load->fd);
+    return seconds > 0 ? (double)atomic_load(&load->ops) / seconds : 0.0;
+}
+
+/**
+
+@brief Один прогон сканирования для бенчмарка.
+*/
+static void bench_run(const char *root, Options *opts, EvictMode *evict, int cold, BenchRun *run)
+{
+    ThreadStats before, after;
+    ProcIo io_before, io_after;
+    WalkState walk;
+
+    memset(run, 0, sizeof(*run));
+    run->cold = cold;
+    run->backend = opts->io_backend;
+    if (cold)
+        run->evicted = evict_tree(root, evict);
+
+    collect_thread_stats(&before);
+    read_proc_io(&io_before);
+    uint64_t t0 = now_ns();
+
+    scan_directory(root, &run->stats, opts, &walk);
+
+    run->seconds = (double)(now_ns() - t0) / 1e9;
+    walk_release(&walk);
+    read_proc_io(&io_after);
+    collect_thread_stats(&after);
+
+    for (int p = 0; p < PH_COUNT; p++)
+        run->delta.ops[p] = after.ops[p] - before.ops[p];
+    run->delta.entries = after.entries - before.entries;
+    run->delta.files_probed = after.files_probed - before.files_probed;
+    run->delta.bytes_read = after.bytes_read - before.bytes_read;
+    run->delta.box_hops = after.box_hops - before.box_hops;
+    run->io.rchar = io_after.rchar - io_before.rchar;
+    run->io.syscr = io_after.syscr - io_before.syscr;
+    run->io.read_bytes = io_after.read_bytes - io_before.read_bytes;
+}
+
+/**
+
+@brief Сравнение для сортировки прогонов по скорости.
+*/
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+
+@brief Печать прогона бенчмарка в JSON.
+*/
+static void bench_print_run(const BenchRun *run, int iteration, int last)
+{
+    double files = run->delta.files_probed ? (double)run->delta.files_probed : 1.0;
+    uint64_t calls = 0;
+    for (int p = 0; p < PH_COUNT; p++)
+        calls += run->delta.ops[p];
+
+    printf("    {\"backend\": \"%s\", \"cache\": \"%s\", \"eviction\": %s%s%s, "
+           "\"iteration\": %d, \"seconds\": %.6f, "
+           "\"files\": %llu, \"folders\": %llu, \"total_duration_seconds\": %.3f, "
+           "\"files_per_sec\": %.1f, \"io_calls_per_file\": %.2f, "
+           "\"read_syscalls_per_file\": %.2f, \"bytes_read_per_file\": %.1f, "
+           "\"header_bytes_per_file\": %.1f, \"device_bytes_per_file\": %.1f, "
+           "\"box_hops_per_file\": %.2f}%s\n",
+           io_backend_names[run->backend], run->cold ? "cold" : "warm",
+           run->cold ? "\"" : "", run->cold ? evict_mode_names[run->evicted] : "null",
+           run->cold ? "\"" : "", iteration, run->seconds,
+           (unsigned long long)run->stats.total_files, (unsigned long long)run->stats.total_folders_with_mp4,
+           (double)run->stats.total_ticks / TICKS_PER_SECOND,
+           run->seconds > 0 ? run->delta.files_probed / run->seconds : 0.0,
+           calls / files, run->io.syscr / files, run->io.rchar / files,
+           run->delta.bytes_read / files, run->io.read_bytes / files,
+           run->delta.box_hops / files, last ? "" : ",");
+}
+
+/**
+
+@brief Медиана и лучшее значение files/s для прогонов одного вида.
+*/
+static void bench_print_summary(const char *name, const BenchRun *runs, int count,
+                                IoBackend backend, int cold, int last)
+{
+    double rates[count > 0 ? count : 1];
+    int n = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (runs[i].backend == backend && runs[i].cold == cold && runs[i].seconds > 0)
+            rates[n++] = runs[i].delta.files_probed / runs[i].seconds;
+    }
+    qsort(rates, (size_t)n, sizeof(rates[0]), cmp_double);
+    if (n == 0)
+        printf("      \"%s\": null%s\n", name, last ? "" : ",");
+    else
+        printf("      \"%s\": {\"runs\": %d, \"median_files_per_sec\": %.1f, \"best_files_per_sec\": %.1f}%s\n",
+               name, n, rates[n / 2], rates[n - 1], last ? "" : ",");
+}
+
+/**
+
+@brief Разбор списка бэкендов через запятую.
+
+@return Битовая маска бэкендов или 0 при ошибке.
+*/
+static unsigned parse_backend_list(const char *list)
+{
+    unsigned mask = 0;
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", list);
+    for (char *tok = strtok(buf, ","); tok; tok = strtok(NULL, ","))
+    {
+        IoBackend b;
+        if (!parse_io_backend(tok, &b))
+            return 0;
+        mask |= 1u << b;
+    }
+    return mask;
+}
+
+/**
+
+@brief Подкоманда bench: замер скорости сканирования дерева.
+
+Для каждого бэкенда чтения заголовков дерево сканируется несколько
+раз с прогретым кэшем и, при --cold, столько же раз после вытеснения
+дерева из кэша. Результат печатается в stdout в виде JSON.
+
+@param prog Имя программы для текста справки (argv[0] — имя подкоманды).
+*/
+static int bench_main(const char *prog, int argc, char *argv[])
+{
+    Options opts;
+    const char *root = NULL;
+    int iterations = 5;
+    int cold = 0;
+    int load_threads = 0;
+    unsigned backends = 0;
+    EvictMode evict = EVICT_AUTO;
+
+    init_options(&opts);
+    for (int i = 1; i < argc; i++)
+    {
+        int rc = 1;
+        if (!strcmp(argv[i], "--iterations") && i + 1 < argc)
+        {
+            iterations = atoi(argv[++i]);
+            rc = iterations > 0 ? 1 : -1;
+        }
+        else if (!strcmp(argv[i], "--cold"))
+        {
+            cold = 1;
+        }
+        else if (!strcmp(argv[i], "--load") && i + 1 < argc)
+        {
+            load_threads = atoi(argv[++i]);
+            rc = load_threads > 0 && load_threads <= 256 ? 1 : -1;
+        }
+        else if (!strcmp(argv[i], "--backends") && i + 1 < argc)
+        {
+            backends = parse_backend_list(argv[++i]);
+            rc = backends ? 1 : -1;
+        }
+        else if (!strcmp(argv[i], "--evict") && i + 1 < argc)
+        {
+            const char *mode = argv[++i];
+            if (!strcmp(mode, "auto"))
+                evict = EVICT_AUTO;
+            else if (!strcmp(mode, "fadvise"))
+                evict = EVICT_FADVISE;
+            else if (!strcmp(mode, "drop"))
+                evict = EVICT_DROP;
+            else
+                rc = -1;
+            cold = 1;
+        }
+        else
+        {
+            int arg = i;
+            rc = parse_scan_option(argc, argv, &i, &opts);
+            if (rc > 0 && !strcmp(argv[arg], "--io"))
+                backends = 1u << opts.io_backend;
+        }
+        if (rc < 0)
+        {
+            fprintf(stderr,
+                    "Usage: %s bench DIR [--iterations N] [--cold] [--evict auto|fadvise|drop]\n"
+                    "       [--backends stdio,pread,mmap] [--load N] [scan options]\n",
+                    prog);
+            return 1;
+        }
+        if (rc == 0)
+            root = argv[i];
+    }
+    if (!root)
+    {
+        fprintf(stderr, "bench: target folder is required\n");
+        return 1;
+    }
+    if (!backends)
+    {
+        for (int b = 0; b < IO_COUNT; b++)
+        {
+            IoBackend tmp;
+            if (parse_io_backend(io_backend_names[b], &tmp))
+                backends |= 1u << b;
+        }
+    }
+
+    opts.verbose = 0;
+    opts.progress_ms = 0;
+    g_timing_enabled = opts.stats;
+    rate_limits_apply(&opts);
+
+    int per_iter = 0;
+    for (int b = 0; b < IO_COUNT; b++)
+        per_iter += (backends >> b & 1) * (cold ? 2 : 1);
+    BenchRun *runs = calloc((size_t)(iterations * per_iter), sizeof(*runs));
+    if (!runs)
+        return 1;
+
+    BenchLoad load;
+    if (load_threads && !bench_load_start(&load, root, load_threads))
+    {
+        free(runs);
+        return 1;
+    }
+
+    // Первый прогон прогревает кэш и в результаты не входит
+    BenchRun warmup;
+    bench_run(root, &opts, &evict, 0, &warmup);
+
+    // Бэкенды чередуются внутри итерации, чтобы фоновые помехи
+    // распределялись между ними поровну.
+    int n = 0;
+    for (int i = 0; i < iterations; i++)
+    {
+        for (int b = 0; b < IO_COUNT; b++)
+        {
+            if (!(backends >> b & 1))
+                continue;
+            opts.io_backend = (IoBackend)b;
+            bench_run(root, &opts, &evict, 0, &runs[n++]);
+            if (cold)
+                bench_run(root, &opts, &evict, 1, &runs[n++]);
+        }
+        fprintf(stderr, "bench: iteration %d/%d done\n", i + 1, iterations);
+    }
+    double load_rate = load_threads ? bench_load_stop(&load) : 0.0;
+
+    time_t now = time(NULL);
+    printf("{\n  \"benchmark\": \"scan\",\n  \"format_version\": 2,\n");
+    printf("  \"timestamp\": %lld,\n  \"root\": ", (long long)now);
+    json_print_string(stdout, root);
+    printf(",\n");
+    static const char *hint_names[] = {"random", "dontneed", "readahead"};
+    printf("  \"options\": {\"bfs\": %s, \"mem_budget\": %llu, \"jobs\": %d, \"iterations\": %d, "
+           "\"idle\": %s, \"load_threads\": %d, \"io_hints\": [",
+           opts.walk_bfs ? "true" : "false", (unsigned long long)opts.mem_budget, opts.jobs, iterations,
+           opts.idle ? "true" : "false", load_threads);
+    for (int h = 0, first = 1; h < 3; h++)
+    {
+        if (opts.io_hints & (1u << h))
+        {
+            printf("%s\"%s\"", first ? "" : ", ", hint_names[h]);
+            first = 0;
+        }
+    }
+    printf("]},\n");
+    if (load_threads)
+        printf("  \"load\": {\"threads\": %d, \"ops_per_sec\": %.1f},\n", load_threads, load_rate);
+    printf("  \"runs\": [\n");
+    for (int i = 0; i < n; i++)
+        bench_print_run(&runs[i], i / per_iter + 1, i == n - 1);
+    printf("  ],\n  \"summary\": {\n");
+    int printed = 0, total = __builtin_popcount(backends);
+    for (int b = 0; b < IO_COUNT; b++)
+    {
+        if (!(backends >> b & 1))
+            continue;
+        printf("    \"%s\": {\n", io_backend_names[b]);
+        bench_print_summary("warm", runs, n, (IoBackend)b, 0, 0);
+        bench_print_summary("cold", runs, n, (IoBackend)b, 1, 1);
+        printf("    }%s\n", ++printed == total ? "" : ",");
+    }
+    printf("  }\n}\n");
+
+    free(runs);
+    free_options(&opts);
+    return 0;
+}
+
+/**
+
+@struct MergeState
+
+@brief Накопленные итоги подкоманды merge.
+*/
+typedef struct
+{
+    Stats stats;          /**< Сумма итогов файлов */
+    WalkState ws;         /**< Корни и распределение (для печати общими функциями) */
+    uint64_t unlisted;    /**< Сумма unlisted_folders */
+    uint64_t folders;     /**< Различных папок в записях «F» */
+    int interrupted;      /**< Хоть один вход от прерванного сканирования */
+    int nshards;          /**< Количество частей во входах (0 — без частей) */
+    unsigned char *shard_seen; /**< Части, уже прочитанные из входов */
+    int input_sharded;    /**< Текущий вход — одна из нескольких частей */
+    unsigned char *root_whole; /**< Корень пришёл из входа без разбиения (по корням) */
+    int sketched;         /**< Входов с t-digest */
+    int with_durations;   /**< Входов с распределением */
+    FILE *out;            /**< Файл объединённого результата или NULL */
+} MergeState;
+
+/**
+
+@brief Прибавляет итоги корня, объединяя корни с одинаковым путём.
+*/
+static int merge_root(MergeState *m, const char *path, uint64_t files, uint64_t folders, uint64_t ticks)
+{
+    WalkState *ws = &m->ws;
+    for (int r = 0; r < ws->nroots; r++)
+    {
+        RootTotal *root = &ws->roots[r];
+        if (strcmp(root->path, path) == 0)
+        {
+            // Один корень складывается только из разных частей разбиения
+            if (!m->input_sharded || m->root_whole[r])
+            {
+                fprintf(stderr, "merge: root %s is already in another input\n", path);
+                return 0;
+            }
+            root->files += files;
+            root->folders += folders;
+            root->ticks += ticks;
+            return 1;
+        }
+    }
+    RootTotal *roots = realloc(ws->roots, (size_t)(ws->nroots + 1) * sizeof(*roots));
+    if (!roots)
+        return 0;
+    ws->roots = roots;
+    unsigned char *whole = realloc(m->root_whole, (size_t)(ws->nroots + 1));
+    if (!whole)
+        return 0;
+    m->root_whole = whole;
+    whole[ws->nroots] = !m->input_sharded;
+    RootTotal *root = &roots[ws->nroots];
+    memset(root, 0, sizeof(*root));
+    if (!(root->path = strdup(path)))
+        return 0;
+    ws->nroots++;
+    root->path_len = strlen(path);
+    root->files = files;
+    root->folders = folders;
+    root->ticks = ticks;
+    return 1;
+}
+
+/**
+
+@brief Читает заголовок частичного результата и прибавляет его итоги.
+
+Останавливается на первой записи «F» (она становится текущей записью
+источника) или на «end». Понимает и версию 1 без итогов папок.
+
+@return 1 при успехе, 0 если файл не частичный результат или испорчен.
+*/
+static int merge_read_header(MergeState *m, FolderSource *src)
+{
+    char line[64], key[32];
+    DurationDist *dist = &m->ws.tally.dist;
+    uint64_t count = 0, min = 0, max = 0;
+    int sketched = 0;
+
+    m->input_sharded = 0;
+    if (!fgets(line, sizeof(line), src->f) ||
+        (strcmp(line, PARTIAL_MAGIC) != 0 && strcmp(line, "mp4_scanner partial 1\n") != 0))
+    {
+        fprintf(stderr, "%s: not a partial result\n", src->name);
+        return 0;
+    }
+    for (;;)
+    {
+        unsigned long long a, b, c;
+        size_t len;
+        int shard, nshards;
+
+        if (fscanf(src->f, "%31s", key) != 1)
+            break;
+        if (strcmp(key, "F") == 0 || strcmp(key, "end") == 0)
+        {
+            if (strcmp(key, "F") == 0 && !folder_parse(src))
+                break;
+            if (count)
+            {
+                if (m->with_durations++ == 0 || min < dist->min)
+                    dist->min = min;
+                if (max > dist->max)
+                    dist->max = max;
+                dist->count += count;
+                m->sketched += sketched;
+            }
+            return 1;
+        }
+        else if (strcmp(key, "shard") == 0 && fscanf(src->f, "%d %d", &shard, &nshards) == 2)
+        {
+            if (nshards < 1 || shard < 0 || shard >= nshards)
+                break;
+            if (nshards > 1)
+            {
+                // Части разных разбиений пересекаются, а повторённую часть
+                // из суммы уже не вычесть: такие входы не складываются
+                if (m->nshards && m->nshards != nshards)
+                {
+                    fprintf(stderr, "merge: %s is shard %d/%d, others are of %d\n", src->name, shard, nshards,
+                            m->nshards);
+                    return 0;
+                }
+                if (!m->shard_seen && !(m->shard_seen = calloc((size_t)nshards, 1)))
+                    return 0;
+                m->nshards = nshards;
+                if (m->shard_seen[shard])
+                {
+                    fprintf(stderr, "merge: %s repeats shard %d/%d\n", src->name, shard, nshards);
+                    return 0;
+                }
+                m->shard_seen[shard] = 1;
+                m->input_sharded = 1;
+            }
+        }
+        else if (strcmp(key, "interrupted") == 0 && fscanf(src->f, "%llu", &a) == 1)
+            m->interrupted |= a != 0;
+        else if (strcmp(key, "files") == 0 && fscanf(src->f, "%llu", &a) == 1)
+            m->stats.total_files += a;
+        else if (strcmp(key, "total_us") == 0 && fscanf(src->f, "%llu", &a) == 1)
+            m->stats.total_ticks += a;
+        else if ((strcmp(key, "unlisted_folders") == 0 || strcmp(key, "folders") == 0) &&
+                 fscanf(src->f, "%llu", &a) == 1)
+            m->unlisted += a; // В версии 1 записей «F» нет, и все папки без записей
+        else if (strcmp(key, "R") == 0 && fscanf(src->f, "%llu %llu %llu %zu", &a, &b, &c, &len) == 4 &&
+                 getc(src->f) == ' ' && len < PATH_MAX)
+        {
+            char path[PATH_MAX];
+            if (fread(path, 1, len, src->f) != len || getc(src->f) != '\n')
+                break;
+            path[len] = '\0';
+            if (!merge_root(m, path, a, b, c))
+                return 0;
+        }
+        else if (strcmp(key, "D") == 0 && fscanf(src->f, "%llu %llu %llu", &a, &b, &c) == 3)
+        {
+            count = a;
+            min = b;
+            max = c;
+        }
+        else if (strcmp(key, "B") == 0 && fscanf(src->f, "%llu %llu", &a, &b) == 2 && a < DUR_BUCKETS)
+            dist->buckets[a] += b;
+        else if (strcmp(key, "M") == 0 && fscanf(src->f, "%llu %llu", &a, &b) == 2 && a < DUR_MINUTE_BUCKETS)
+            dist->minutes[a] += b;
+        else if (strcmp(key, "T") == 0)
+        {
+            double mean, weight;
+            if (fscanf(src->f, "%lf %lf", &mean, &weight) != 2)
+                break;
+            if (!dist->sketch && !(dist->sketch = calloc(1, sizeof(*dist->sketch))))
+                return 0;
+            tdigest_add(dist->sketch, mean, weight);
+            sketched = 1;
+        }
+        else
+            break;
+    }
+    fprintf(stderr, "%s: malformed partial result near \"%s\"\n", src->name, key);
+    return 0;
+}
+
+/**
+
+@brief Учитывает папку объединённого результата (emit для folder_merge).
+*/
+static int merge_emit(const FolderRec *rec, void *ctx)
+{
+    MergeState *m = ctx;
+    m->folders++;
+    if (m->ws.opts->verbose)
+    {
+        DirNode node;
+        memset(&node, 0, sizeof(node));
+        node.path = rec->path;
+        node.local_mp4_count = rec->files;
+        node.local_ticks = rec->ticks;
+        char *line = dir_line(&m->ws, &node);
+        if (line)
+            fputs(line, stdout);
+        free(line);
+    }
+    if (m->out)
+        folder_write(m->out, rec);
+    return 1;
+}
+
+/**
+
+@brief Подкоманда merge: объединяет частичные результаты.
+
+Заголовки всех входов читаются и складываются сразу, а итоги папок
+сливаются потоково k-путевым слиянием, поэтому память зависит от
+числа входов, а не от числа папок. Объединённый результат можно снова
+записать частичным (--partial) и сливать дальше по дереву: в нём
+остаётся список вошедших частей.
+
+@return 0 при успехе, 2 если не хватает частей (итог напечатан и записан),
+1 при ошибке или повторённой части.
+
+@param prog Имя программы для текста справки (argv[0] — имя подкоманды).
+*/
+static int merge_main(const char *prog, int argc, char *argv[])
+{
+    Options opts;
+    MergeState m;
+    const char **inputs = calloc((size_t)argc, sizeof(*inputs));
+    int ninputs = 0, rc = 0;
+
+    if (!inputs)
+        return 1;
+    init_options(&opts);
+    memset(&m, 0, sizeof(m));
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-v"))
+            opts.verbose = 1;
+        else if (!strcmp(argv[i], "--histogram"))
+            opts.histogram = 1;
+        else if (!strcmp(argv[i], "--partial") && i + 1 < argc)
+            opts.partial = argv[++i];
+        else if (argv[i][0] == '-')
+        {
+            fprintf(stderr, "Usage: %s merge [-v] [--histogram] [--partial OUT] FILE...\n", prog);
+            free(inputs);
+            return 1;
+        }
+        else
+            inputs[ninputs++] = argv[i];
+    }
+    if (ninputs == 0)
+    {
+        fprintf(stderr, "merge: at least one partial result is required\n");
+        free(inputs);
+        return 1;
+    }
+
+    m.ws.opts = &opts;
+    m.ws.stats = &m.stats;
+    FolderSource *srcs = calloc((size_t)ninputs, sizeof(*srcs));
+    if (!srcs)
+    {
+        free(inputs);
+        return 1;
+    }
+    for (int i = 0; i < ninputs && rc == 0; i++)
+    {
+        srcs[i].name = inputs[i];
+        if (!(srcs[i].f = fopen(inputs[i], "rb")))
+        {
+            perror(inputs[i]);
+            rc = 1;
+        }
+        else if (!merge_read_header(&m, &srcs[i]))
+            rc = 1;
+    }
+    // Квантили t-digest верны, только если дайджест был у каждого входа
+    if (m.ws.tally.dist.sketch && m.sketched != m.with_durations)
+    {
+        free(m.ws.tally.dist.sketch);
+        m.ws.tally.dist.sketch = NULL;
+    }
+
+    char tmp[PATH_MAX];
+    if (rc == 0 && opts.partial)
+    {
+        if (!(m.out = partial_create(opts.partial, tmp, sizeof(tmp))))
+            rc = 1;
+        else
+        {
+            PartialHeader hdr = {0, m.nshards ? m.nshards : 1, m.shard_seen, m.interrupted, m.unlisted, &m.stats,
+                                 m.ws.roots, m.ws.nroots, &m.ws.tally.dist};
+            partial_write_header(m.out, &hdr);
+        }
+    }
+    if (rc == 0 && !folder_merge(srcs, (size_t)ninputs, merge_emit, &m))
+        rc = 1;
+    if (m.out && !partial_commit(m.out, tmp, opts.partial, rc == 0))
+        rc = 1;
+
+    if (rc == 0)
+    {
+        uint64_t folders = m.folders + m.unlisted;
+        m.stats.total_folders_with_mp4 = folders;
+        int h, mi, s;
+        format_duration((double)m.stats.total_ticks / TICKS_PER_SECOND, &h, &mi, &s);
+        printf("\n\xF0\x9F\x93\x8A Result (%d partial results merged):\n", ninputs);
+        if (m.interrupted)
+            printf("\xE2\x9A\xA0 Some inputs come from interrupted scans: totals are partial\n");
+        // Неполный набор частей — не ошибка, но итог неполный: код 2
+        for (int i = 0; i < m.nshards; i++)
+            if (!m.shard_seen[i])
+            {
+                printf("\xE2\x9A\xA0 Shard %d/%d is missing\n", i, m.nshards);
+                rc = 2;
+            }
+        printf("\xF0\x9F\x91\x8C Found " COLOR_YELLOW "%llu" COLOR_RESET " MP4 files in " COLOR_YELLOW "%llu" COLOR_RESET
+               " folders.\n",
+               (unsigned long long)m.stats.total_files, (unsigned long long)folders);
+        printf("\xF0\x9F\x8F\x81 Total duration: " COLOR_YELLOW "%d:%02d:%02d" COLOR_RESET "\n", h, mi, s);
+        print_duration_report(&m.ws.tally.dist, &opts);
+        print_roots(&m.ws);
+    }
+
+    for (int i = 0; i < ninputs; i++)
+    {
+        if (srcs[i].f)
+            fclose(srcs[i].f);
+        free(srcs[i].rec.path);
+    }
+    for (int r = 0; r < m.ws.nroots; r++)
+        free((char *)m.ws.roots[r].path);
+    free(m.ws.roots);
+    free(m.ws.tally.dist.sketch);
+    free(m.shard_seen);
+    free(m.root_whole);
+    free(srcs);
+    free(inputs);
+    return rc;
+}
+
+/**
+
+@brief Обработчик SIGINT и SIGTERM: просит обход остановиться.
+
+Повторный сигнал завершает программу сразу (SA_RESETHAND).
+*/
+static void on_interrupt(int sig)
+{
+    (void)sig;
+    g_interrupted = 1;
+}
+
+/**
+
+@brief Устанавливает обработчик SIGINT и SIGTERM.
+*/
+static void install_interrupt_handler(void)
+{
+#ifdef _WIN32
+    signal(SIGINT, on_interrupt);
+    signal(SIGTERM, on_interrupt);
+#else
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_interrupt;
+    sa.sa_flags = SA_RESETHAND;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+#endif
+}
+
+/**
+
+@brief Печать краткой справки по использованию.
+*/
+static void print_usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [folder...] [-v] [--bfs] [--mem-budget MB] [--stats] [--progress[=SEC]]\n"
+            "  -v               print duration of every folder with MP4 files\n"
+            "  -j, --jobs N     parse MP4 headers in N threads (0 = one per CPU);\n"
+            "                   -v output keeps the single-threaded order\n"
+            "  --top N          list the N longest files after the summary\n"
+            "  --bottom N       list the N shortest files after the summary\n"
+            "  --group-by SPEC  totals per group: depth:N (first N path components\n"
+            "                   below the root), regex:RE (first capture group or\n"
+            "                   the whole match) or uid (file owner)\n"
+            "  --files-from F   parse the MP4 files listed in F (- for stdin)\n"
+            "                   instead of walking a folder, one path per line\n"
+            "  -0, --null       paths in the --files-from list end with NUL\n"
+            "  -L               follow symbolic links (default); folders already\n"
+            "                   visited, including symlink loops, are skipped\n"
+            "  -P               never follow symbolic links\n"
+            "  --dedupe-hardlinks  count hard-linked MP4 files once\n"
+            "  -x, --one-file-system  do not descend into other file systems\n"
+            "  --device-jobs N  parse at most N files at once per device\n"
+            "                   (default: 2 on HDD, -j otherwise)\n"
+            "  --adaptive       tune the per-device limit from observed parse\n"
+            "                   latency and throughput, up to -j (default 64)\n"
+            "  --max-iops N     at most N opendir/stat calls per second\n"
+            "  --max-opens N    at most N MP4 file opens per second\n"
+            "  --max-bw SIZE    read at most SIZE bytes per second from storage\n"
+            "                   (K/M/G; counts whole buffer refills and pages)\n"
+            "  --idle           idle I/O priority class and SCHED_IDLE for parse\n"
+            "                   threads: yield to any other workload\n"
+            "  --exclude GLOB   skip entries matching GLOB (.gitignore syntax,\n"
+            "                   relative to each root); excluded folders are\n"
+            "                   never opened\n"
+            "  --include GLOB   re-include entries excluded by earlier rules\n"
+            "                   (same as !GLOB)\n"
+            "  --no-scanignore  ignore .scanignore files (.gitignore rules read\n"
+            "                   in every folder; command-line rules win)\n"
+            "  --checkpoint F   journal finished folders to F; a rerun with the\n"
+            "                   same F, folders and scan options skips them\n"
+            "                   (Ctrl-C prints partial totals)\n"
+            "  --shard I/N      scan only part I (0..N-1) of N: subtrees are split\n"
+            "                   by a hash of their path relative to the root\n"
+            "  --shard-depth D  split subtrees at depth D (default auto: the first\n"
+            "                   folders with at least 4*N subfolders)\n"
+            "  --partial F      write exact totals to F for merging (default with\n"
+            "                   --shard: shard-I-of-N.part)\n"
+            "  --estimate       walk all folders but parse only a random sample\n"
+            "                   stratified by file size; print totals with 95%%\n"
+            "                   confidence intervals\n"
+            "  --estimate-error PCT  refine the sample until the duration is\n"
+            "                   within +-PCT%% (default 1; implies --estimate)\n"
+            "  --estimate-time SEC  stop refining SEC seconds after the start\n"
+            "                   (implies --estimate)\n"
+            "  --bitrate-model[=PCT]  learn bytes per second of each folder from\n"
+            "                   a few parsed files and estimate the rest from\n"
+            "                   their size; spot checks off by more than PCT%%\n"
+            "                   (default 5) fall back to parsing\n"
+            "  --du             print subtree totals of every folder, children\n"
+            "                   before parents (like du)\n"
+            "  --tree           print subtree totals as an indented tree\n"
+            "                   (always depth-first)\n"
+            "  --max-depth N    print folder lines only down to depth N\n"
+            "  --histogram      per-minute histogram of file durations\n"
+            "  --sketch         also estimate duration quantiles with a t-digest\n"
+            "  --format F       summary format: text (default) or json; json\n"
+            "                   prints only the JSON object (no -v lines)\n"
+            "  --bfs            breadth-first traversal instead of depth-first\n"
+            "  --mem-budget MB  memory for the pending-folder list and --partial\n"
+            "                   folder records before they spill to a temporary\n"
+            "                   file, and for --estimate sample paths (default %d)\n"
+            "  --stats          per-phase timing, counters and latency percentiles\n"
+            "  --io BACKEND     header reader: stdio (default), pread or mmap\n"
+            "  --io-hints LIST  per-file kernel hints: random, dontneed, readahead\n"
+            "  --nofollow       do not open MP4 files through symbolic links\n"
+            "  --statx-sync M   attribute sync for statx(): auto (skip on network\n"
+            "                   file systems, default), sync or dontsync\n"
+            "  --progress[=SEC] periodic progress line on stderr (default every 1 s)\n"
+            "\n"
+            "       %s gentree DIR [options]   create a synthetic MP4 tree\n"
+            "       %s bench DIR [options]     benchmark scanning, JSON on stdout\n"
+            "       %s merge FILE... [options]  combine --partial results\n",
+            prog, DEFAULT_MEM_BUDGET_MB, prog, prog, prog);
+}
+
+/**
+
+@brief Точка входа в программу.
+*/
+int main(int argc, char *argv[])
+{
+#ifdef _WIN32
+    SetConsoleOutputCP(CP_UTF8);
+#endif
+
+    Stats stats = {0, 0, 0};
+    Options opts = {0};
+    WalkState walk;
+    char path[PATH_MAX] = {0};
+    const char *target_dir = NULL;
+    const char **roots = NULL;
+    int nroots = 0;
+
+    if (argc > 1 && strcmp(argv[1], "gentree") == 0)
+        return gentree_main(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+        return bench_main(argv[0], argc - 1, argv + 1);
+    if (argc > 1 && strcmp(argv[1], "merge") == 0)
+        return merge_main(argv[0], argc - 1, argv + 1);
+
+    init_options(&opts);
+    roots = calloc((size_t)argc, sizeof(*roots));
+    if (!roots)
+        return 1;
+
+    // Обработка аргументов командной строки
+    for (int i = 1; i < argc; ++i)
+    {
+        int rc = parse_scan_option(argc, argv, &i, &opts);
+        if (rc < 0)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        if (rc == 0)
+            roots[nroots++] = argv[i];
+    }
+    if (nroots > 0)
+        target_dir = roots[0];
+
+    // Выборка не даёт итогов папок для журнала и частичного результата
+    if (opts.estimate)
+    {
+        const char *with[] = {opts.files_from ? "--files-from" : NULL, opts.checkpoint ? "--checkpoint" : NULL,
+                              opts.partial ? "--partial" : NULL, opts.shard_count ? "--shard" : NULL,
+                              opts.bitrate_model ? "--bitrate-model" : NULL};
+        int conflicts = 0;
+        for (size_t k = 0; k < sizeof(with) / sizeof(with[0]); ++k)
+            if (with[k])
+                fprintf(stderr, "%s %s", conflicts++ ? "," : "--estimate cannot be combined with", with[k]);
+        if (conflicts)
+        {
+            fprintf(stderr, "\n");
+            return 1;
+        }
+    }
+
+    // Строки папок печатаются по мере завершения, а поддеревья из журнала
+    // не обходятся: продолженный запуск напечатал бы только часть строк
+    if (opts.checkpoint && !opts.format_json && (opts.verbose || opts.rollup != ROLLUP_NONE))
+    {
+        fprintf(stderr, "--checkpoint cannot be combined with %s\n",
+                opts.rollup == ROLLUP_DU ? "--du" : opts.rollup == ROLLUP_TREE ? "--tree" : "-v");
+        return 1;
+    }
+
+    FILE *list = NULL;
+    if (opts.files_from)
+    {
+        // Журнал хранит поддеревья папок, а у списка файлов их нет;
+        // правила исключений применяются при обходе, которого здесь нет
+        if (target_dir || opts.checkpoint || opts.nmatch_rules)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        list = strcmp(opts.files_from, "-") == 0 ? stdin : fopen(opts.files_from, "rb");
+        if (!list)
+        {
+            perror(opts.files_from);
+            return 1;
+        }
+        target_dir = opts.files_from;
+    }
+
+    if (!target_dir)
+    {
+        if (!getcwd(path, sizeof(path)))
+        {
+            perror("getcwd failed");
+            return 1;
+        }
+        target_dir = path;
+        roots[nroots++] = target_dir;
+    }
+
+    int base_fds = count_open_fds();
+    g_timing_enabled = opts.stats;
+    rate_limits_apply(&opts);
+    if (opts.format_json)
+    {
+        opts.verbose = 0;
+        opts.rollup = ROLLUP_NONE;
+    }
+
+    char partial_path[64];
+    if (!opts.partial && opts.shard_count)
+    {
+        snprintf(partial_path, sizeof(partial_path), "shard-%d-of-%d.part", opts.shard_index, opts.shard_count);
+        opts.partial = partial_path;
+    }
+
+    ProcIo io_before, io_after;
+    int have_io = read_proc_io(&io_before);
+    install_interrupt_handler();
+
+    if (list)
+    {
+        if (!opts.format_json)
+            printf("\xF0\x9F\x93\x83 Reading file list: %s\n", target_dir);
+        scan_file_list(list, opts.list_nul ? '\0' : '\n', &stats, &opts, &walk);
+        if (list != stdin)
+            fclose(list);
+    }
+    else
+    {
+        if (!opts.format_json)
+            for (int r = 0; r < nroots; r++)
+                printf("\xF0\x9F\x95\x92 Scanning folder: %s\n", roots[r]);
+        scan_roots(roots, nroots, &stats, &opts, &walk);
+    }
+
+    if (!walk.roots)
+    {
+        free_options(&opts);
+        free(roots);
+        return 1;
+    }
+    // Код выхода как у процесса, убитого SIGINT
+    int exit_code = g_interrupted ? 130 : 0;
+    if (walk.lost_entries)
+    {
+        fprintf(stderr, "Incomplete scan: %llu folders or files lost to memory or spill file errors\n",
+                (unsigned long long)walk.lost_entries);
+        if (!exit_code)
+            exit_code = 1;
+    }
+
+    if (opts.partial && !write_partial_result(opts.partial, &stats, &walk) && !exit_code)
+        exit_code = 1;
+
+    have_io = have_io && read_proc_io(&io_after);
+    rank_sort(&walk.tally.top);
+    rank_sort(&walk.tally.bottom);
+    if (opts.format_json)
+    {
+        print_summary_json(target_dir, &stats, &walk);
+        walk_release(&walk);
+        free_options(&opts);
+        free(roots);
+        return exit_code;
+    }
+
+    int h, m, s;
+    format_duration((double)stats.total_ticks / TICKS_PER_SECOND, &h, &m, &s);
+
+    printf("\n\xF0\x9F\x93\x8A Result:\n");
+    if (g_interrupted)
+        printf("\xE2\x9A\xA0 Interrupted: partial results%s\n",
+               opts.checkpoint ? ", rerun with the same --checkpoint to resume" : "");
+    if (walk.estimate)
+        print_estimate(&walk);
+    else
+    {
+        printf("\xF0\x9F\x91\x8C Found " COLOR_YELLOW "%llu" COLOR_RESET " MP4 files in " COLOR_YELLOW "%llu" COLOR_RESET
+               " folders.\n",
+               (unsigned long long)stats.total_files, (unsigned long long)stats.total_folders_with_mp4);
+        printf("\xF0\x9F\x8F\x81 Total duration: " COLOR_YELLOW "%d:%02d:%02d" COLOR_RESET "\n", h, m, s);
+        print_duration_report(&walk.tally.dist, &opts);
+        print_model(&walk);
+    }
+    print_roots(&walk);
+
+    long rss = peak_rss_kb();
+    if (rss >= 0 && base_fds >= 0)
+        printf("\xF0\x9F\xA7\xA0 Peak RSS: %.1f MiB, peak open fds: %d\n",
+               rss / 1024.0, base_fds + atomic_load(&g_peak_handles));
+    if (walk.spilled_items > 0)
+        printf("\xF0\x9F\x92\xBE Pending folders spilled to disk: %lld\n", walk.spilled_items);
+    if (have_io && (opts.io_hints || opts.stats))
+        printf("\xF0\x9F\x92\xBD Device reads: %.2f MiB (read_bytes %llu -> %llu)\n",
+               (io_after.read_bytes - io_before.read_bytes) / (1024.0 * 1024.0),
+               io_before.read_bytes, io_after.read_bytes);
+    if (opts.stats)
+        print_stats_report(&walk);
+    print_groups(&walk.tally.groups, &opts.group);
+    print_ranked(&walk.tally.top, "\xE2\x8F\xAB Longest files");
+    print_ranked(&walk.tally.bottom, "\xE2\x8F\xAC Shortest files");
+    walk_release(&walk);
+    free_options(&opts);
+    free(roots);
+
+    return exit_code;
+}
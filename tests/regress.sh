@@ -0,0 +1,150 @@
+#!/bin/sh
+# Регрессионные проверки mp4_scanner на синтетических деревьях gentree.
+#
+# Запуск: sh tests/regress.sh [ПРОГРАММА]
+# Без аргумента программа собирается из mp4_scanner.c компилятором $CC
+# (по умолчанию cc). Код выхода — число проваленных проверок.
+
+set -u
+
+here=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d "${TMPDIR:-/tmp}/mp4_scanner_regress.XXXXXX") || exit 1
+trap 'rm -rf "$work"' EXIT INT TERM
+
+if [ $# -ge 1 ]; then
+    scanner=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+else
+    scanner=$work/mp4_scanner
+    ${CC:-cc} -O2 -Wall -Wextra -pthread -o "$scanner" "$here/../mp4_scanner.c" -lm || exit 1
+fi
+cd "$work" || exit 1
+
+failed=0
+
+ok()
+{
+    echo "ok   $1"
+}
+
+fail()
+{
+    echo "FAIL $1"
+    failed=$((failed + 1))
+}
+
+# Поле верхнего уровня из JSON-итога сканирования или gentree.
+json_field()
+{
+    sed -n "s/^  \"$2\": \\([0-9.]*\\).*/\\1/p" "$1"
+}
+
+# Итог без строк, которые законно меняются от запуска к запуску: память,
+# диагностика пропусков, продолжение по журналу и квантили t-digest,
+# зависящие от порядка добавления.
+scan_text()
+{
+    "$scanner" "$@" 2>/dev/null | grep -v "Peak RSS\|Resumed\|Skipped already\|t-digest\|spilled to disk"
+}
+
+# Дерево с файлами всех видов и дерево с битрейтом, пропорциональным длительности.
+"$scanner" gentree mixed --depth 3 --fanout 4 --files 12 --moov-end 0.4 --fragmented 0.2 \
+    --largesize 0.1 --corrupt 0.05 --seed 5 >mixed.json || exit 1
+"$scanner" gentree rated --depth 2 --fanout 5 --files 30 --bitrate 256K --seed 9 >rated.json || exit 1
+
+# 1. Сумма длительностей и число файлов совпадают с тем, что записал gentree.
+for tree in mixed rated; do
+    for jobs in 1 4; do
+        "$scanner" --format json -j "$jobs" "$tree" >scan.json 2>/dev/null
+        expected=$(json_field "$tree.json" expected_duration_seconds)
+        mp4=$(json_field "$tree.json" mp4_files)
+        corrupt=$(json_field "$tree.json" corrupt)
+        if [ "$(json_field scan.json total_us)" = "${expected}000000" ] &&
+            [ "$(json_field scan.json files)" = "$((mp4 - corrupt))" ]; then
+            ok "gentree $tree -j $jobs: ${expected} s in $((mp4 - corrupt)) files"
+        else
+            fail "gentree $tree -j $jobs: expected ${expected} s, got $(json_field scan.json total_us) us"
+        fi
+    done
+done
+
+# 2. Части --shard, объединённые merge, дают то же, что полный проход.
+"$scanner" --partial full.part mixed >/dev/null 2>&1
+for n in 2 3 7; do
+    rm -f shard-*.part
+    i=0
+    while [ $i -lt $n ]; do
+        "$scanner" --shard $i/$n -j 2 mixed >/dev/null 2>&1
+        i=$((i + 1))
+    done
+    "$scanner" merge --partial merged.part shard-*.part >/dev/null 2>&1
+    "$scanner" merge -v --histogram full.part >full.txt 2>&1
+    "$scanner" merge -v --histogram merged.part >merged.txt 2>&1
+    if cmp -s full.txt merged.txt; then
+        ok "--shard I/$n + merge == full scan"
+    else
+        fail "--shard I/$n + merge differs from full scan"
+    fi
+done
+
+# 3. Продолжение по журналу --checkpoint, оборванному после любой записи,
+#    даёт тот же итог, что непрерывный проход.
+opts="-j 4 --top 5 --bottom 5 --histogram --group-by depth:1"
+# shellcheck disable=SC2086
+scan_text $opts mixed >full.txt
+# shellcheck disable=SC2086
+"$scanner" $opts --checkpoint journal mixed >/dev/null 2>&1
+lines=$(wc -l <journal)
+bad=0
+k=3
+while [ "$k" -le "$lines" ]; do
+    head -n "$k" journal >resume
+    # shellcheck disable=SC2086
+    scan_text $opts --checkpoint resume mixed >resumed.txt
+    cmp -s full.txt resumed.txt || bad=$((bad + 1))
+    k=$((k + 11))
+done
+if [ $bad -eq 0 ]; then
+    ok "--checkpoint resume == full run ($lines journal records)"
+else
+    fail "--checkpoint resume differs from full run at $bad cut points"
+fi
+
+# 4. Правила исключения: итог совпадает с копией дерева, из которой
+#    удалены те же записи.
+check_rules()
+{
+    name=$1
+    shift
+    rm -rf pruned
+    cp -R mixed pruned
+    (cd pruned && eval "$prune")
+    scan_text "$@" mixed | grep "Found\|Total duration" >ruled.txt
+    scan_text pruned | grep "Found\|Total duration" >expected.txt
+    if cmp -s ruled.txt expected.txt; then
+        ok "rules: $name"
+    else
+        fail "rules: $name"
+    fi
+}
+prune='find . -type d -name dir_001 -prune -exec rm -rf {} +'
+check_rules "--exclude dir_001/" --exclude dir_001/
+prune='rm -rf dir_002/dir_003; find dir_002 -name "clip_0001.mp4" -exec rm -f {} +'
+check_rules "anchored and ** patterns" --exclude /dir_002/dir_003/ --exclude "/dir_002/**/clip_0001.mp4"
+prune='find . -name "*.mp4" ! -name "clip_0000.mp4" -exec rm -f {} +'
+check_rules "--include after --exclude" --exclude "*.mp4" --include clip_0000.mp4
+printf 'dir_000/\n' >mixed/dir_003/.scanignore
+prune='rm -rf dir_003/dir_000'
+check_rules ".scanignore in a subfolder"
+rm -f mixed/dir_003/.scanignore
+
+# 5. С --mem-budget 0 очередь папок уходит на диск, а итог не меняется.
+scan_text -v -j 4 mixed | sort >full.txt
+scan_text -v -j 4 --mem-budget 0 mixed | sort >spilled.txt
+"$scanner" --format json --mem-budget 0 mixed >scan.json 2>/dev/null
+if cmp -s full.txt spilled.txt && [ "$(json_field scan.json spilled_folders)" -gt 0 ]; then
+    ok "--mem-budget 0 spills $(json_field scan.json spilled_folders) folders, same result"
+else
+    fail "--mem-budget 0 changes the result or does not spill"
+fi
+
+exit $failed